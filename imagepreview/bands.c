@@ -0,0 +1,188 @@
+//
+//  bands.c
+//  imagepreview
+//
+//  Images too large for the memory budget of preview -M. The section shown
+//  is read a band of rows at a time and binned down on the way, by the
+//  smallest power of two that lets the binned copies and a band fit in what
+//  the budget leaves. The pixels the sky statistics are sampled from are
+//  picked out as their rows go by, so that -z gives what it gives on the
+//  whole image and nothing larger than a band is ever held.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#include "fitsio.h"
+
+#define BAND_MAXBYTES (64L << 20)   /* a bigger band reads no faster */
+#define BAND_MAXBIN 4096
+
+int kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status);
+void kern_bin2(const float *src, long nx, long ny, float *dst);
+
+struct band_sample
+{
+    long offset;
+    int k;
+};
+
+static int
+by_offset(const void *a, const void *b)
+{
+    long x = ((const struct band_sample *)a)->offset, y = ((const struct band_sample *)b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+/* The largest this process has been resident so far, in bytes. */
+long
+peak_rss(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return ru.ru_maxrss * 1024L;
+#endif
+}
+
+/* What this process has resident now, in bytes: unlike the peak, less
+ * once memory is given back. The peak where neither can be had. */
+long
+current_rss(void)
+{
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) == KERN_SUCCESS)
+        return info.resident_size;
+#elif defined(__linux__)
+    FILE *fp;
+    long pages, resident;
+    int n;
+
+    if ((fp = fopen("/proc/self/statm", "r"))) {
+        n = fscanf(fp, "%ld %ld", &pages, &resident);
+        fclose(fp);
+        if (n == 2)
+            return resident * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return peak_rss();
+}
+
+/* Bytes a band of rows rows takes: the rows read whole, nx wide, and the
+ * first binning of their w wide section. */
+static long
+band_bytes(long nx, long w, long rows)
+{
+    return (rows * nx + ((w + 1) / 2) * ((rows + 1) / 2)) * (long)sizeof(float);
+}
+
+/* The smallest power of two to bin the w by h section of nx wide planes by
+ * so that copies of the binned section and a band of rows fit in avail
+ * bytes, and in rows the most rows a band can have. Returns 0 if not even
+ * a band of one binned row fits. */
+int
+band_bin(long nx, long w, long h, int copies, long avail, long *rows)
+{
+    long out;
+    int bin;
+
+    for (bin=1; bin<=BAND_MAXBIN; bin*=2) {
+        out = copies * ((w + bin - 1) / bin) * ((h + bin - 1) / bin) * (long)sizeof(float);
+        if (out + band_bytes(nx, w, bin) > avail)
+            continue;
+        /* as many binned rows as fit in what is left, and no more than needed */
+        for (*rows=bin; *rows<h && out + band_bytes(nx, w, 2 * *rows) <= avail &&
+             band_bytes(nx, w, 2 * *rows) <= BAND_MAXBYTES; *rows*=2);
+        return bin;
+    }
+    return 0;
+}
+
+/* Reads rows y1..y2, columns x1..x2 of the nx wide plane that starts at
+ * pixel first of the current HDU, rows rows at a time (a multiple of bin),
+ * into out binned by bin: (x2-x1+bin)/bin by (y2-y1+bin)/bin, the edges
+ * as kern_bin2 leaves them. The nsample pixels at sample[k], offsets from
+ * first, are put in value[k] on the way. */
+int
+band_read(fitsfile *fptr, long nx, long first, int x1, int x2, int y1, int y2, int bin, long rows,
+          const long *sample, float *value, int nsample, float *out, int *status)
+{
+    struct band_sample *order = NULL;
+    float *band, *tmp, *src, *dst, *t;
+    long w = x2 - x1 + 1, h = y2 - y1 + 1, lo, hi, start, r, n, j, bw, bh;
+    int b, k, s, anynul;
+
+    if (*status)
+        return *status;
+    if (rows > h)
+        rows = h;
+
+    band = malloc(band_bytes(nx, w, rows));
+    if (!band || (nsample && !(order = malloc(nsample * sizeof(struct band_sample))))) {
+        free(band);
+        return *status = MEMORY_ALLOCATION;
+    }
+    tmp = band + rows * nx;
+
+    /* samples outside the rows of the section are read one by one, by
+     * CFITSIO itself: kern_read_img would look up the header and set up a
+     * block buffer for each */
+    lo = (long)(y1 - 1) * nx;
+    hi = (long)y2 * nx;
+    for (s=0; s<nsample; s++) {
+        order[s].offset = sample[s];
+        order[s].k = s;
+        if (sample[s] < lo || sample[s] >= hi)
+            fits_read_img(fptr, TFLOAT, first + sample[s], 1, NULL, &value[s], &anynul, status);
+    }
+    if (nsample)
+        qsort(order, nsample, sizeof(struct band_sample), by_offset);
+    for (k=0; k<nsample && order[k].offset < lo; k++);
+
+    for (r=0; r<h && !*status; r+=n) {
+        n = (h - r < rows) ? h - r : rows;
+        start = lo + r * nx;
+        if (kern_read_img(fptr, first + start, n * nx, band, status))
+            break;
+        for (; k<nsample && order[k].offset < start + n * nx; k++)
+            value[order[k].k] = band[order[k].offset - start];
+
+        /* the columns of the section, then halved bin times over */
+        if (w < nx)
+            for (j=0; j<n; j++)
+                memmove(band + j * w, band + j * nx + x1 - 1, w * sizeof(float));
+        src = band;
+        dst = tmp;
+        bw = w;
+        bh = n;
+        for (b=1; b<bin; b*=2) {
+            kern_bin2(src, bw, bh, dst);
+            bw = (bw + 1) / 2;
+            bh = (bh + 1) / 2;
+            t = src;
+            src = dst;
+            dst = t;
+        }
+        memcpy(out + (r / bin) * bw, src, bw * bh * sizeof(float));
+    }
+
+    free(order);
+    free(band);
+    return *status;
+}
@@ -0,0 +1,226 @@
+//
+//  benchfetch.c
+//  imagepreview
+//
+//  Times the catalogue overlay of preview -2 / -3 end to end, fetch, parse
+//  and projection onto the chips, against the stand-in server of httpstub.c
+//  rather than the archive. Each round submits the cones of one pointing,
+//  a chip each, and waits until all of them are plotted (on /null); the
+//  rounds give the latency, the sources over the whole run the throughput.
+//  The tile cache is turned off so that every cone goes over the wire.
+//
+//  With -s it only serves, for running preview itself against the stub:
+//
+//      benchfetch -s 8080 &
+//      TWOMASS_URL='http://127.0.0.1:8080/gen/5000.tsv?ra=%f&dec=%f&rad=%f' preview -2 ...
+//
+//  gcc benchfetch.c httpstub.c conesearch.c fopen.c tableparse.c coords.c tilecache.c healpix.c refcat.c wcsgrid.c -o benchfetch -I/usr/local/include/wcslib -lwcs -lcurl -lcpgplot -lpthread -lz -lm
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "wcs.h"
+#include "cpgplot.h"
+
+#define MAXROUND 10000
+
+typedef struct http_stub HTTP_STUB;
+HTTP_STUB *stub_open(const char *dir, int port, const char *opts);
+int stub_port(HTTP_STUB *stub);
+int stub_requests(HTTP_STUB *stub);
+int stub_connections(HTTP_STUB *stub);
+long stub_bytes(HTTP_STUB *stub);
+
+typedef struct cone_set CONE_SET;
+CONE_SET *cone_open(const char *survey, const char *urlpath);
+int cone_submit(CONE_SET *set, double ra, double dec, double radius, struct wcsprm *wcs);
+void cone_panel(CONE_SET *set, int k, int ix, int iy);
+int cone_drain(CONE_SET *set, int wait, int symbol, float cheight);
+long cone_sources(CONE_SET *set, int k);
+void cone_close(CONE_SET *set);
+void url_cleanup(void);
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* A tangent-plane chip of nx by ny pixels of scale arcsec centred on ra,
+ * dec, as the cone search expects to be handed. */
+static struct wcsprm *
+chip_wcs(double ra, double dec, int nx, int ny, double scale)
+{
+    struct wcsprm *wcs = malloc(sizeof(struct wcsprm));
+
+    wcs->flag = -1;
+    wcsini(1, 2, wcs);
+    strcpy(wcs->ctype[0], "RA---TAN");
+    strcpy(wcs->ctype[1], "DEC--TAN");
+    wcs->crval[0] = ra;
+    wcs->crval[1] = dec;
+    wcs->crpix[0] = nx / 2.0;
+    wcs->crpix[1] = ny / 2.0;
+    wcs->cdelt[0] = -scale / 3600.0;
+    wcs->cdelt[1] = scale / 3600.0;
+    (void)wcsset(wcs);
+
+    return wcs;
+}
+
+static int
+by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *t, int n, double p)
+{
+    int k = (int)ceil(p / 100.0 * n) - 1;
+
+    return t[k < 0 ? 0 : k >= n ? n-1 : k];
+}
+
+int main (int argc, char *argv[]) {
+    HTTP_STUB *stub;
+    CONE_SET *set;
+    char *dir = "fixtures", *opts = "", *fixture = NULL, *rows = "2000.tsv", url[1024];
+    int c, k, r, nquery = 16, nround = 20, port = 0, serve = 0, nx = 2048, ny = 4096, nempty = 0;
+    double radius = 10.0, scale = 0.34, ra, dec, t0, t, total = 0.0, lat[MAXROUND];
+    long nsrc = 0, n;
+
+    while ((c = getopt(argc, argv, "d:f:g:k:o:p:r:s:")) != -1)
+        switch(c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'f':
+                fixture = optarg;
+                break;
+            case 'g':
+                rows = optarg;
+                break;
+            case 'k':
+                nquery = atoi(optarg);
+                break;
+            case 'o':
+                opts = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'r':
+                nround = atoi(optarg);
+                break;
+            case 's':
+                port = atoi(optarg);
+                serve = 1;
+                break;
+            default:
+                return 1;
+        }
+
+    if (optind != argc || nquery < 1 || nround < 1 || nround > MAXROUND) {
+        printf("Usage:\n");
+        printf("\n");
+        printf("    benchfetch [-k 16] [-r 20] [-g 2000.tsv | -f file] [-o opts]\n");
+        printf("    benchfetch -s 8080 [-d fixtures] [-o opts]\n");
+        printf("\n");
+        printf("Options:\n\n");
+        printf("  -d fixtures   : directory of the recorded responses served\n");
+        printf("  -f file       : answer every cone with this recorded response\n");
+        printf("  -g 2000.tsv   : answer with generated sources instead, .tsv, .xml or .bin\n");
+        printf("  -k 16         : cones per round, one per chip\n");
+        printf("  -o chunk=1460 : how the stub answers: latency=ms, chunk=bytes, gap=ms,\n");
+        printf("                  stall=ms@bytes, chunked=1, fail=n,\n");
+        printf("                  close=1, gzip=1\n");
+        printf("  -p 0          : port to listen on [any free one]\n");
+        printf("  -r 20         : number of rounds\n");
+        printf("  -s 8080       : only serve, on this port, until killed\n");
+        printf("\n");
+        printf("Examples:\n");
+        printf("\n");
+        printf("    benchfetch -k 16 -g 5000.bin -o latency=50,chunk=1460\n");
+        printf("    benchfetch -f twomass-small.tsv -o stall=500@4000\n");
+        printf("\n");
+        return 1;
+    }
+
+    if (!(stub = stub_open(dir, port, opts))) {
+        fprintf(stderr, "Cannot listen on port %d\n", port);
+        return 1;
+    }
+    port = stub_port(stub);
+
+    if (serve) {
+        printf("Serving %s on 127.0.0.1:%d, for instance\n", dir, port);
+        printf("    TWOMASS_URL='http://127.0.0.1:%d/gen/5000.tsv?ra=%%f&dec=%%f&rad=%%f'\n", port);
+        printf("    SDSS_URL='http://127.0.0.1:%d/gen/5000.xml?ra=%%f&dec=%%f&rad=%%f'\n", port);
+        printf("    TWOMASS_URL='http://127.0.0.1:%d/twomass-small.tsv?ra=%%f&dec=%%f&rad=%%f'\n", port);
+        fflush(stdout);
+        for (;;)
+            pause();
+    }
+
+    if (fixture)
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s?ra=%%f&dec=%%f&rad=%%f", port, fixture);
+    else
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/gen/%s?ra=%%f&dec=%%f&rad=%%f", port, rows);
+
+    setenv("IMAGEPREVIEW_CACHE_MAXSIZE", "0", 1);
+    if (cpgopen("/null") <= 0) {
+        fprintf(stderr, "Cannot open the null plot device\n");
+        return 1;
+    }
+    cpgsvp(0.0, 1.0, 0.0, 1.0);
+    cpgswin(0.5, nx + 0.5, 0.5, ny + 0.5);
+
+    for (r=0; r<nround; r++) {
+        set = cone_open("bench", url);
+        t0 = now();
+
+        /* the chips of a pointing, a little apart, in a new place each round */
+        for (k=0; k<nquery; k++) {
+            ra = fmod(10.0 + r * 1.7 + (k % 4) * 0.2, 360.0);
+            dec = -30.0 + (k / 4) * 0.2;
+            cone_submit(set, ra, dec, radius, chip_wcs(ra, dec, nx, ny, scale));
+            cone_panel(set, k, 1, 1);
+        }
+        cone_drain(set, 1, 1, 1.0);
+
+        t = now();
+        lat[r] = t - t0;
+        total += lat[r];
+        for (k=0; k<nquery; k++) {
+            n = cone_sources(set, k);
+            nsrc += n;
+            nempty += !n;
+        }
+        cone_close(set);
+    }
+    url_cleanup();
+    cpgend();
+
+    qsort(lat, nround, sizeof(double), by_value);
+    printf("%d rounds of %d cones, %d cones empty\n", nround, nquery, nempty);
+    printf("%d requests on %d connections, %.2f MB of responses\n",
+           stub_requests(stub), stub_connections(stub), stub_bytes(stub) / 1048576.0);
+    printf("%ld sources in %.3f s, %.0f sources/s\n", nsrc, total, total > 0.0 ? nsrc / total : 0.0);
+    printf("round latency p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           percentile(lat, nround, 50.0) * 1e3, percentile(lat, nround, 90.0) * 1e3,
+           percentile(lat, nround, 99.0) * 1e3, lat[nround-1] * 1e3);
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+//
+//  benchkern.c
+//  imagepreview
+//
+//  Times the pixel kernels in each of the variants this CPU can run, on a
+//  made up image, and checks that every variant gives what the plain C one
+//  does. preview picks the widest at startup; IMAGEPREVIEW_ISA names
+//  another, and preview -v says which it is using.
+//
+//  gcc -O2 benchkern.c kernels.c -o benchkern -lcfitsio -lpthread -lm
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+const char *kern_isa(void);
+int kern_use(const char *name);
+void kern_to_float(const void *src, int bitpix, long n, double scale, double zero, float *dst);
+void kern_minmax(const float *x, long n, float *lo, float *hi);
+void kern_scale_u8(const float *x, long n, float scale, float off, float top, unsigned char *dst);
+void kern_bin2(const float *src, long nx, long ny, float *dst);
+
+static const char *variants[] = {"generic", "sse4.2", "avx2", "avx512"};
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* the results of one variant, to hold against the plain C */
+struct run
+{
+    float *f16, *f32, *fflt, *binned;
+    unsigned char *grey;
+    float lo, hi;
+};
+
+static struct run *
+run_alloc(long npix)
+{
+    struct run *r = calloc(1, sizeof(struct run));
+
+    r->f16 = malloc(npix * sizeof(float));
+    r->f32 = malloc(npix * sizeof(float));
+    r->fflt = malloc(npix * sizeof(float));
+    r->binned = malloc(npix * sizeof(float));
+    r->grey = malloc(npix);
+    return r;
+}
+
+static int
+run_same(const struct run *a, const struct run *b, long npix, long nbin)
+{
+    return !memcmp(a->f16, b->f16, npix * sizeof(float)) &&
+           !memcmp(a->f32, b->f32, npix * sizeof(float)) &&
+           !memcmp(a->fflt, b->fflt, npix * sizeof(float)) &&
+           !memcmp(a->binned, b->binned, nbin * sizeof(float)) &&
+           !memcmp(a->grey, b->grey, npix) &&
+           a->lo == b->lo && a->hi == b->hi;
+}
+
+int main (int argc, char *argv[]) {
+    unsigned char *raw16, *raw32, *rawflt;
+    struct run *ref = NULL, *r;
+    float *image, f;
+    double t[5], t0;
+    long nx = 4096, ny = 4096, npix, nbin, i;
+    int c, k, v, nrep = 5, failed = 0;
+    unsigned int s = 1, u;
+
+    while ((c = getopt(argc, argv, "r:s:")) != -1)
+        switch(c) {
+            case 'r':
+                nrep = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%ldx%ld", &nx, &ny) != 2)
+                    nx = 0;
+                break;
+            default:
+                return 1;
+        }
+
+    if (optind != argc || nrep < 1 || nx < 1 || ny < 1) {
+        printf("Usage:\n");
+        printf("\n");
+        printf("    benchkern [-s 4096x4096] [-r 5]\n");
+        printf("\n");
+        printf("Options:\n\n");
+        printf("  -r 5          : repeats, the fastest of which is reported\n");
+        printf("  -s 4096x4096  : size of the made up image\n");
+        printf("\n");
+        return 1;
+    }
+    npix = nx * ny;
+    nbin = ((nx + 1) / 2) * ((ny + 1) / 2);
+
+    /* sky and noise, as big-endian shorts, ints and floats as in a file */
+    raw16 = malloc(npix * 2);
+    raw32 = malloc(npix * 4);
+    rawflt = malloc(npix * 4);
+    image = malloc(npix * sizeof(float));
+    for (i=0; i<npix; i++) {
+        s = s * 1103515245 + 12345;
+        k = 1000 + (int)((s >> 16) % 200) - 100;
+        u = (unsigned int)(k - 32768);
+        raw16[2*i] = u >> 8;
+        raw16[2*i+1] = u;
+        raw32[4*i] = raw32[4*i+1] = 0;
+        raw32[4*i+2] = k >> 8;
+        raw32[4*i+3] = k;
+        f = k + 0.25f;
+        memcpy(&u, &f, 4);
+        rawflt[4*i] = u >> 24;
+        rawflt[4*i+1] = u >> 16;
+        rawflt[4*i+2] = u >> 8;
+        rawflt[4*i+3] = u;
+        image[i] = f;
+    }
+
+    printf("%ldx%ld pixels, %s chosen for this CPU\n", nx, ny, kern_isa());
+    printf("%-8s %9s %9s %9s %9s %9s  ms\n", "", "int16", "int32", "float", "minmax", "bin2+u8");
+    for (v=0; v<4; v++) {
+        if (kern_use(variants[v])) {
+            printf("%-8s not on this CPU\n", variants[v]);
+            continue;
+        }
+        r = run_alloc(npix);
+        for (k=0; k<5; k++)
+            t[k] = HUGE_VAL;
+        for (c=0; c<nrep; c++) {
+            t0 = now();
+            kern_to_float(raw16, 16, npix, 1.0, 32768.0, r->f16);
+            t0 = now() - t0;
+            if (t0 < t[0]) t[0] = t0;
+
+            t0 = now();
+            kern_to_float(raw32, 32, npix, 1.0, 0.0, r->f32);
+            t0 = now() - t0;
+            if (t0 < t[1]) t[1] = t0;
+
+            t0 = now();
+            kern_to_float(rawflt, -32, npix, 1.0, 0.0, r->fflt);
+            t0 = now() - t0;
+            if (t0 < t[2]) t[2] = t0;
+
+            t0 = now();
+            r->lo = HUGE_VALF;
+            r->hi = -HUGE_VALF;
+            kern_minmax(image, npix, &r->lo, &r->hi);
+            t0 = now() - t0;
+            if (t0 < t[3]) t[3] = t0;
+
+            t0 = now();
+            kern_bin2(image, nx, ny, r->binned);
+            kern_scale_u8(image, npix, 2.55f, -2400.0f, 255.0f, r->grey);
+            t0 = now() - t0;
+            if (t0 < t[4]) t[4] = t0;
+        }
+        printf("%-8s", variants[v]);
+        for (k=0; k<5; k++)
+            printf(" %9.2f", t[k] * 1e3);
+        if (!ref)
+            ref = r;
+        else if (!run_same(ref, r, npix, nbin)) {
+            printf("  differs from generic");
+            failed = 1;
+        }
+        printf("\n");
+    }
+
+    return failed;
+}
@@ -0,0 +1,234 @@
+//
+//  benchparse.c
+//  imagepreview
+//
+//  Times the reading of RA and Dec from text catalogues: str2radec over a
+//  whole buffer, str2ra and str2dec field by field as the header keywords
+//  are read, and strtod on the same decimal columns for comparison. The
+//  text is made up in memory, decimal or sexagesimal, unless a file is
+//  given, so that only the parsing is timed.
+//
+//  gcc -O2 benchparse.c coords.c tableparse.c -o benchparse -lm
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+double str2ra (const char *in);
+double str2dec (const char *in);
+long str2radec(const char *s, const char *e, char sep, int racol, int deccol,
+               double *ra, double *dec, long nmax, const char **next);
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* nrows of id, ra, dec, mag split at sep, the angles in sexagesimal when
+ * sexa is set, from a fixed seed so runs compare. */
+static char *
+make_table(long nrows, char sep, int sexa, size_t *len)
+{
+    char *buf, *p;
+    double ra, dec, s;
+    long i;
+    int h, m, d;
+
+    p = buf = malloc(nrows * 64 + 64);
+    p += sprintf(p, "# id%cra%cdec%cmag\n", sep, sep, sep);
+    srand(1);
+    for (i=0; i<nrows; i++) {
+        ra = 360.0 * rand() / ((double)RAND_MAX + 1);
+        dec = asin(2.0 * rand() / ((double)RAND_MAX + 1) - 1.0) * 180.0 / M_PI;
+        p += sprintf(p, "%ld%c", i+1, sep);
+        if (sexa) {
+            s = ra / 15.0 * 3600.0;
+            h = (int)(s / 3600.0);
+            m = (int)(s / 60.0) % 60;
+            p += sprintf(p, "%02d:%02d:%06.3f%c", h, m, s - h*3600.0 - m*60.0, sep);
+            s = fabs(dec) * 3600.0;
+            d = (int)(s / 3600.0);
+            m = (int)(s / 60.0) % 60;
+            p += sprintf(p, "%c%02d:%02d:%05.2f", dec < 0 ? '-' : '+', d, m, s - d*3600.0 - m*60.0);
+        } else
+            p += sprintf(p, "%.7f%c%+.7f", ra, sep, dec);
+        p += sprintf(p, "%c%.3f\n", sep, 12.0 + 8.0 * rand() / RAND_MAX);
+    }
+    *len = p - buf;
+
+    return buf;
+}
+
+static char *
+read_file(const char *name, size_t *len)
+{
+    FILE *fp;
+    char *buf;
+    long n;
+
+    if (!(fp = fopen(name, "rb")) || fseek(fp, 0, SEEK_END) || (n = ftell(fp)) < 0) {
+        if (fp) fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    buf = malloc(n + 1);
+    *len = fread(buf, 1, n, fp);
+    buf[*len] = '\0';
+    fclose(fp);
+
+    return buf;
+}
+
+/* Copies of the two columns, NUL ended, one after another, for the
+ * functions that want strings. Returns the number of rows. */
+static long
+split_columns(const char *buf, size_t len, char sep, int racol, int deccol, char **ras, char **decs)
+{
+    const char *s = buf, *e = buf + len, *eol, *fs, *fe;
+    char *r = *ras = malloc(len + 1), *d = *decs = malloc(len + 1);
+    long n = 0;
+    int col;
+
+    for (; s < e; s = eol + 1) {
+        if (!(eol = memchr(s, '\n', e - s)))
+            eol = e;
+        if (*s == '#')
+            continue;
+        for (fs = s, col = 0; col <= racol || col <= deccol; col++, fs = fe + 1) {
+            if (fs > eol)
+                break;
+            if (sep == ' ') {
+                while (fs < eol && (*fs == ' ' || *fs == '\t'))
+                    fs++;
+                for (fe = fs; fe < eol && *fe != ' ' && *fe != '\t'; fe++);
+            } else if (!(fe = memchr(fs, sep, eol - fs)))
+                fe = eol;
+            if (col == racol) {
+                memcpy(r, fs, fe - fs);
+                r += fe - fs;
+                *r++ = '\0';
+            }
+            if (col == deccol) {
+                memcpy(d, fs, fe - fs);
+                d += fe - fs;
+                *d++ = '\0';
+            }
+        }
+        n++;
+    }
+
+    return n;
+}
+
+int main (int argc, char *argv[]) {
+    char *buf, *file = NULL, *ras, *decs, *r, *d, *end;
+    const char *next;
+    size_t len;
+    long nrows = 1000000, n, m, i;
+    int c, k, nrep = 5, sexa = 0, racol = 1, deccol = 2;
+    char sep = '\t';
+    double *ra, *dec, t, best, sum, sum2;
+
+    while ((c = getopt(argc, argv, "c:f:n:r:s:x")) != -1)
+        switch(c) {
+            case 'c':
+                if (sscanf(optarg, "%d,%d", &racol, &deccol) != 2)
+                    racol = -1;
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 'n':
+                nrows = atol(optarg);
+                break;
+            case 'r':
+                nrep = atoi(optarg);
+                break;
+            case 's':
+                sep = !strcmp(optarg, "tab") ? '\t' : !strcmp(optarg, "space") ? ' ' : optarg[0];
+                break;
+            case 'x':
+                sexa = 1;
+                break;
+            default:
+                return 1;
+        }
+
+    if (optind != argc || nrows < 1 || nrep < 1 || racol < 0 || deccol < 0 || !sep) {
+        printf("Usage:\n");
+        printf("\n");
+        printf("    benchparse [-n 1000000] [-x] [-s tab] [-r 5]\n");
+        printf("    benchparse -f table.tsv [-c 1,2] [-s tab]\n");
+        printf("\n");
+        printf("Options:\n\n");
+        printf("  -c 1,2        : columns of RA and Dec, from 0\n");
+        printf("  -f file       : parse this text table instead of a made up one\n");
+        printf("  -n 1000000    : rows to make up\n");
+        printf("  -r 5          : repeats, the fastest of which is reported\n");
+        printf("  -s tab        : field separator, tab, space or a character\n");
+        printf("  -x            : make up sexagesimal angles [decimal degrees]\n");
+        printf("\n");
+        return 1;
+    }
+
+    if (file) {
+        if (!(buf = read_file(file, &len))) {
+            fprintf(stderr, "Cannot read %s\n", file);
+            return 1;
+        }
+        nrows = len / 8 + 1;
+    } else
+        buf = make_table(nrows, sep, sexa, &len);
+
+    ra = malloc(nrows * sizeof(double));
+    dec = malloc(nrows * sizeof(double));
+
+    for (k=0, best=HUGE_VAL; k<nrep; k++) {
+        t = now();
+        n = str2radec(buf, buf + len, sep, racol, deccol, ra, dec, nrows, &next);
+        t = now() - t;
+        if (t < best) best = t;
+    }
+    for (i=0, sum=0.0; i<n; i++)
+        sum += ra[i] + dec[i];
+    printf("%.1f MB, %ld rows of RA and Dec\n", len / 1048576.0, n);
+    printf("str2radec       : %8.1f MB/s %8.2f Mrows/s\n", len / best / 1048576.0, n / best * 1e-6);
+
+    /* the same fields one string at a time */
+    m = split_columns(buf, len, sep, racol, deccol, &ras, &decs);
+    for (k=0, best=HUGE_VAL; k<nrep; k++) {
+        t = now();
+        sum2 = 0.0;
+        for (i=0, r=ras, d=decs; i<m; i++, r+=strlen(r)+1, d+=strlen(d)+1)
+            sum2 += str2ra(r) + str2dec(d);
+        t = now() - t;
+        if (t < best) best = t;
+    }
+    printf("str2ra, str2dec : %8.1f MB/s %8.2f Mrows/s\n", len / best / 1048576.0, m / best * 1e-6);
+    if (m == n && fabs(sum - sum2) > 1e-9 * fabs(sum))
+        printf("  sums differ: %.9g and %.9g\n", sum, sum2);
+
+    if (!sexa) {
+        for (k=0, best=HUGE_VAL; k<nrep; k++) {
+            t = now();
+            sum2 = 0.0;
+            for (i=0, r=ras, d=decs; i<m; i++, r+=strlen(r)+1, d+=strlen(d)+1)
+                sum2 += strtod(r, &end) + strtod(d, &end);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        printf("strtod          : %8.1f MB/s %8.2f Mrows/s\n", len / best / 1048576.0, m / best * 1e-6);
+    }
+
+    return 0;
+}
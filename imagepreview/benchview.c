@@ -0,0 +1,231 @@
+//
+//  benchview.c
+//  imagepreview
+//
+//  Times views served by preview -D: each client thread keeps a connection
+//  to the socket and sends the request lines given, round after round. The
+//  first round reads the HDUs; the latency of the repeats is what the web
+//  front end sees for a view it has asked for before.
+//
+//      preview -D /tmp/preview.sock &
+//      benchview -s /tmp/preview.sock -r 50 -k 4 'v.fit hdu=1' 'v.fit hdu=2 c=1'
+//
+//  gcc benchview.c -o benchview -lpthread -lm
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXVIEW 100000
+
+struct client
+{
+    int k;
+    double *lat;                /* of every request after the first round */
+    long nlat;
+    double first;               /* the first round, all its requests */
+    long bytes;
+    int failed;
+};
+
+static char *sockpath = "/tmp/preview.sock", *outname = NULL;
+static char **views;
+static int nviews, nround = 20;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static int
+connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Sends one request and reads the answer, into *img when it is an image.
+ * Returns its size, or -1. */
+static long
+request(int fd, const char *line, char **img)
+{
+    char head[256];
+    size_t n = 0;
+    ssize_t got;
+    long len, have;
+    int w, h;
+
+    if (send(fd, line, strlen(line), 0) < 0 || send(fd, "\n", 1, 0) < 0)
+        return -1;
+    while (n < sizeof(head)-1 && (got = recv(fd, head+n, 1, 0)) == 1 && head[n] != '\n')
+        n++;
+    head[n] = '\0';
+    if (sscanf(head, "OK %ld %d %d", &len, &w, &h) != 3) {
+        fprintf(stderr, "%s: %s\n", line, head);
+        return -1;
+    }
+    *img = realloc(*img, len);
+    for (have=0; have<len; have+=got)
+        if ((got = recv(fd, *img + have, len - have, 0)) <= 0)
+            return -1;
+    return len;
+}
+
+static void *
+client_run(void *arg)
+{
+    struct client *cl = arg;
+    char *img = NULL;
+    double t0, t;
+    long n = 0;
+    int r, v, fd;
+
+    if ((fd = connect_to(sockpath)) < 0) {
+        cl->failed = 1;
+        return NULL;
+    }
+    t0 = now();
+    for (r=0; r<nround && !cl->failed; r++) {
+        for (v=0; v<nviews; v++) {
+            t = now();
+            if ((n = request(fd, views[v], &img)) < 0) {
+                cl->failed = 1;
+                break;
+            }
+            cl->bytes += n;
+            if (r)
+                cl->lat[cl->nlat++] = now() - t;
+        }
+        if (!r)
+            cl->first = now() - t0;
+    }
+    if (outname && !cl->k && img && !cl->failed) {
+        FILE *fp = fopen(outname, "wb");
+        if (fp) {
+            fwrite(img, 1, n, fp);
+            fclose(fp);
+        }
+    }
+    free(img);
+    close(fd);
+    return NULL;
+}
+
+static int
+by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *t, long n, double p)
+{
+    long k = (long)ceil(p / 100.0 * n) - 1;
+
+    return n ? t[k < 0 ? 0 : k >= n ? n-1 : k] : 0.0;
+}
+
+int main (int argc, char *argv[]) {
+    struct client *cl;
+    pthread_t *thread;
+    double *lat, first = 0.0, t0, t;
+    long n = 0, bytes = 0;
+    int c, k, nclient = 1, failed = 0;
+
+    while ((c = getopt(argc, argv, "k:o:r:s:")) != -1)
+        switch(c) {
+            case 'k':
+                nclient = atoi(optarg);
+                break;
+            case 'o':
+                outname = optarg;
+                break;
+            case 'r':
+                nround = atoi(optarg);
+                break;
+            case 's':
+                sockpath = optarg;
+                break;
+            default:
+                return 1;
+        }
+    views = argv + optind;
+    nviews = argc - optind;
+
+    if (!nviews || nclient < 1 || nround < 2 || (long)nround * nviews > MAXVIEW) {
+        printf("Usage:\n");
+        printf("\n");
+        printf("    benchview [-s /tmp/preview.sock] [-k 1] [-r 20] [-o last.pgm] 'request' ...\n");
+        printf("\n");
+        printf("Options:\n\n");
+        printf("  -k 1          : clients, each on its own connection\n");
+        printf("  -o last.pgm   : keep the last image of the first client\n");
+        printf("  -r 20         : rounds of all the requests, the first to fill the cache\n");
+        printf("  -s sock       : the socket preview -D listens on\n");
+        printf("\n");
+        printf("Examples:\n");
+        printf("\n");
+        printf("    benchview -k 4 'v20091103_00368_st.fit hdu=12 size=512 c=1'\n");
+        printf("\n");
+        return 1;
+    }
+
+    cl = calloc(nclient, sizeof(struct client));
+    thread = malloc(nclient * sizeof(pthread_t));
+    t0 = now();
+    for (k=0; k<nclient; k++) {
+        cl[k].k = k;
+        cl[k].lat = malloc((long)nround * nviews * sizeof(double));
+        pthread_create(&thread[k], NULL, client_run, &cl[k]);
+    }
+    for (k=0; k<nclient; k++)
+        pthread_join(thread[k], NULL);
+    t = now() - t0;
+
+    lat = malloc((long)nclient * nround * nviews * sizeof(double));
+    for (k=0; k<nclient; k++) {
+        memcpy(lat + n, cl[k].lat, cl[k].nlat * sizeof(double));
+        n += cl[k].nlat;
+        bytes += cl[k].bytes;
+        failed += cl[k].failed;
+        if (cl[k].first > first)
+            first = cl[k].first;
+    }
+    if (failed)
+        printf("%d of %d clients failed, see above\n", failed, nclient);
+    qsort(lat, n, sizeof(double), by_value);
+    printf("%d clients, %d views a round, %.1f MB of images in %.2f s\n",
+           nclient, nviews, bytes / 1048576.0, t);
+    printf("first round %.1f ms, its views read from disk\n", first * 1e3);
+    printf("repeat views %ld, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", n,
+           percentile(lat, n, 50.0) * 1e3, percentile(lat, n, 90.0) * 1e3,
+           percentile(lat, n, 99.0) * 1e3, n ? lat[n-1] * 1e3 : 0.0);
+
+    return failed != 0;
+}
@@ -0,0 +1,542 @@
+//
+//  catalogue.c
+//  imagepreview
+//
+//  Reader for the _cat.fits tables. The file stays open across HDUs and the
+//  column numbers of the columns asked for are resolved once, so the overlay
+//  can pull just the columns it needs in row chunks of its choosing.
+//
+//  The columns registered before cat_cache() can also be kept in a sidecar
+//  file, native-endian and one array per column and extension, which later
+//  runs map straight into memory instead of decoding the table again.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "fitsio.h"
+
+#define CAT_MAXCOL 32
+#define CAT_BLOCK 8192
+
+#define CACHE_MAGIC "IPCATSC"
+#define CACHE_VERSION 1
+#define CACHE_BYTEORDER 0x01020304
+#define CACHE_ALIGN 64
+
+/* sidecar layout: the header, ncol names of FLEN_VALUE bytes, one
+ * cache_hdu with ncol offsets for each HDU from the first, then the
+ * columns at the offsets, each nrows floats */
+struct cache_head
+{
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t version;
+    int64_t mtime;                  /* of the source table */
+    int64_t size;
+    int32_t ncol;
+    int32_t nhdu;
+};
+
+struct cache_hdu
+{
+    int64_t nrows;
+    int64_t offset[1];              /* ncol of them, 0 when not in the HDU */
+};
+
+struct cat_reader
+{
+    fitsfile *fptr;
+    char filename[FLEN_FILENAME];
+    int hdu;                        /* current HDU, 0 before the first select */
+    long nrows;                     /* rows in the current HDU */
+    int fitshdu;                    /* HDU the table file is positioned on */
+    int tfields;                    /* layout the column numbers belong to */
+
+    int ncol;
+    char name[CAT_MAXCOL][FLEN_VALUE];
+    int colnum[CAT_MAXCOL];         /* 0 when the column is not in the table */
+
+    char *map;                      /* sidecar, NULL when not used */
+    size_t maplen;
+    int cachencol, cachenhdu;
+    int cacheidx[CAT_MAXCOL];       /* sidecar column of each slot, or -1 */
+};
+
+typedef struct cat_reader CAT_READER;
+
+static void
+cat_resolve(CAT_READER *cat, int slot)
+{
+    int status = 0;
+
+    if (fits_get_colnum(cat->fptr, CASEINSEN, cat->name[slot], &cat->colnum[slot], &status))
+        cat->colnum[slot] = 0;
+}
+
+/* Whether the columns found so far are still under the same numbers: one
+ * TTYPEn keyword each. Those not found before are looked for again. */
+static int
+cat_same_layout(CAT_READER *cat)
+{
+    char key[FLEN_KEYWORD], value[FLEN_VALUE];
+    int slot, status = 0;
+
+    for (slot=0; slot<cat->ncol; slot++) {
+        if (!cat->colnum[slot]) {
+            cat_resolve(cat, slot);
+            continue;
+        }
+        fits_make_keyn("TTYPE", cat->colnum[slot], key, &status);
+        if (fits_read_key(cat->fptr, TSTRING, key, value, NULL, &status) ||
+            strcasecmp(value, cat->name[slot]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Brings the table file onto the current HDU. Column numbers are only
+ * looked up again when the table layout differs from the one they were
+ * resolved for; the extensions of a pawprint catalogue all share one, which
+ * the TTYPEn of each column found confirms. */
+static int
+cat_sync(CAT_READER *cat, int *status)
+{
+    int hdutype, tfields = 0, slot;
+
+    if (*status || cat->fitshdu == cat->hdu)
+        return *status;
+
+    if (fits_movabs_hdu(cat->fptr, cat->hdu, &hdutype, status))
+        return *status;
+    fits_get_num_cols(cat->fptr, &tfields, status);
+    if (*status)
+        return *status;
+
+    if (!cat->tfields || tfields != cat->tfields || !cat_same_layout(cat))
+        for (slot=0; slot<cat->ncol; slot++)
+            cat_resolve(cat, slot);
+    cat->fitshdu = cat->hdu;
+    cat->tfields = tfields;
+
+    return *status;
+}
+
+static struct cache_hdu *
+cache_hdu(CAT_READER *cat, int hdu)
+{
+    size_t size = sizeof(struct cache_hdu) + (cat->cachencol-1) * sizeof(int64_t);
+
+    return (struct cache_hdu *)(cat->map + sizeof(struct cache_head) +
+                                cat->cachencol * FLEN_VALUE + (hdu-1) * size);
+}
+
+/* The sidecar column of a slot in the current HDU, NULL if it is not cached. */
+static struct cache_hdu *
+cache_entry(CAT_READER *cat, int slot)
+{
+    if (!cat->map || cat->hdu < 1 || cat->hdu > cat->cachenhdu ||
+        slot < 0 || slot >= cat->ncol || cat->cacheidx[slot] < 0)
+        return NULL;
+
+    return cache_hdu(cat, cat->hdu);
+}
+
+static void
+cache_match(CAT_READER *cat, int slot)
+{
+    int k;
+
+    cat->cacheidx[slot] = -1;
+    for (k=0; cat->map && k<cat->cachencol; k++)
+        if (!strcmp(cat->map + sizeof(struct cache_head) + k*FLEN_VALUE, cat->name[slot]))
+            cat->cacheidx[slot] = k;
+}
+
+CAT_READER *
+cat_open(char *filename, int *status)
+{
+    CAT_READER *cat;
+
+    if (*status)
+        return NULL;
+
+    cat = malloc(sizeof(CAT_READER));
+    if (!cat) {
+        *status = MEMORY_ALLOCATION;
+        return NULL;
+    }
+    memset(cat, 0, sizeof(CAT_READER));
+    strncpy(cat->filename, filename, FLEN_FILENAME-1);
+
+    if (fits_open_table(&cat->fptr, filename, READONLY, status)) {
+        free(cat);
+        return NULL;
+    }
+
+    return cat;
+}
+
+/* Registers a column by name and returns the slot used to read it. */
+int
+cat_column(CAT_READER *cat, char *name)
+{
+    int slot;
+
+    for (slot=0; slot<cat->ncol; slot++)
+        if (!strcmp(cat->name[slot], name))
+            return slot;
+
+    if (cat->ncol == CAT_MAXCOL)
+        return -1;
+
+    slot = cat->ncol++;
+    strncpy(cat->name[slot], name, FLEN_VALUE-1);
+    cat->colnum[slot] = 0;
+    if (cat->fitshdu && cat->fitshdu == cat->hdu)
+        cat_resolve(cat, slot);
+    else
+        cat->tfields = 0;
+    cache_match(cat, slot);
+
+    return slot;
+}
+
+int
+cat_has_column(CAT_READER *cat, int slot)
+{
+    struct cache_hdu *h;
+    int status = 0;
+
+    if (slot < 0 || slot >= cat->ncol)
+        return 0;
+    if ((h = cache_entry(cat, slot)))
+        return h->offset[cat->cacheidx[slot]] != 0;
+
+    cat_sync(cat, &status);
+    return !status && cat->colnum[slot] > 0;
+}
+
+/* Moves to a table HDU. An HDU held in the sidecar is not looked at in
+ * the table file until a column outside the sidecar is read. */
+int
+cat_select(CAT_READER *cat, int hdu, long *nrows, int *status)
+{
+    if (*status)
+        return *status;
+
+    if (hdu != cat->hdu) {
+        cat->hdu = hdu;
+        if (cat->map && hdu <= cat->cachenhdu) {
+            cat->nrows = (long)cache_hdu(cat, hdu)->nrows;
+        } else {
+            if (cat_sync(cat, status))
+                return *status;
+            fits_get_num_rows(cat->fptr, &cat->nrows, status);
+        }
+    }
+
+    *nrows = cat->nrows;
+    return *status;
+}
+
+/* Reads nrows rows of a column from firstrow (1-based) into dest. */
+int
+cat_read(CAT_READER *cat, int slot, long firstrow, long nrows, float *dest, int *status)
+{
+    struct cache_hdu *h;
+    float nulval = 0.;
+    int anynul;
+
+    if (*status)
+        return *status;
+
+    if ((h = cache_entry(cat, slot))) {
+        if (!h->offset[cat->cacheidx[slot]])
+            return *status = COL_NOT_FOUND;
+        memcpy(dest, (float *)(cat->map + h->offset[cat->cacheidx[slot]]) + firstrow-1,
+               nrows * sizeof(float));
+        return *status;
+    }
+
+    if (cat_sync(cat, status))
+        return *status;
+    if (!cat_has_column(cat, slot))
+        return *status = COL_NOT_FOUND;
+
+    return fits_read_col(cat->fptr, TFLOAT, cat->colnum[slot], firstrow, 1, nrows,
+                         &nulval, dest, &anynul, status);
+}
+
+/* The whole of a column of the current HDU when it sits in the sidecar,
+ * so it can be used in place; NULL when it has to be read. */
+const float *
+cat_mapped(CAT_READER *cat, int slot)
+{
+    struct cache_hdu *h = cache_entry(cat, slot);
+
+    if (!h || !h->offset[cat->cacheidx[slot]])
+        return NULL;
+
+    return (const float *)(cat->map + h->offset[cat->cacheidx[slot]]);
+}
+
+/* The file the table is in: its name without the +N extension or the
+ * [...] that CFITSIO takes after it. */
+static void
+cache_source(CAT_READER *cat, char *name, size_t len)
+{
+    char *p;
+
+    snprintf(name, len, "%s", cat->filename);
+    if ((p = strchr(name, '[')))
+        *p = '\0';
+    for (p=name+strlen(name); p>name && isdigit((unsigned char)p[-1]); p--);
+    if (p > name+1 && p[-1] == '+' && *p)
+        p[-1] = '\0';
+}
+
+/* FNV-1a, as tilecache.c keys its directories */
+static unsigned long
+hash_str(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *s; s++)
+        h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+/* Sidecar of the file name, next to it or under $IMAGEPREVIEW_CACHE when
+ * set; one for all its extensions. In the shared directory the name
+ * carries a hash of the full path, so that tables of the same name in
+ * different directories keep a sidecar each. */
+static void
+cache_path(const char *name, char *path, size_t len)
+{
+    char *dir = getenv("IMAGEPREVIEW_CACHE"), *full;
+    const char *base;
+
+    if (dir && *dir) {
+        mkdir(dir, 0755);
+        base = strrchr(name, '/');
+        full = realpath(name, NULL);
+        snprintf(path, len, "%s/%s-%08lx.cache", dir, base ? base+1 : name,
+                 hash_str(full ? full : name));
+        free(full);
+    } else {
+        snprintf(path, len, "%s.cache", name);
+    }
+}
+
+/* Maps the sidecar if it belongs to the table as it is now. */
+static int
+cache_load(CAT_READER *cat, const char *path, struct stat *src)
+{
+    struct cache_head head;
+    struct cache_hdu *h;
+    struct stat st;
+    size_t need;
+    int fd, slot, hdu, k;
+    char *map;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(head) ||
+        read(fd, &head, sizeof(head)) != sizeof(head) ||
+        memcmp(head.magic, CACHE_MAGIC, 8) || head.byteorder != CACHE_BYTEORDER ||
+        head.version != CACHE_VERSION || head.mtime != (int64_t)src->st_mtime ||
+        head.size != (int64_t)src->st_size || head.ncol < 1 || head.nhdu < 1) {
+        close(fd);
+        return -1;
+    }
+
+    need = sizeof(head) + head.ncol * FLEN_VALUE +
+           head.nhdu * (sizeof(struct cache_hdu) + (head.ncol-1) * sizeof(int64_t));
+    if ((size_t)st.st_size < need) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    cat->map = map;
+    cat->maplen = st.st_size;
+    cat->cachencol = head.ncol;
+    cat->cachenhdu = head.nhdu;
+
+    /* a sidecar cut short is written again */
+    for (hdu=1; hdu<=head.nhdu; hdu++) {
+        h = cache_hdu(cat, hdu);
+        for (k=0; k<head.ncol; k++) {
+            if (h->offset[k] && (h->offset[k] < (int64_t)need ||
+                h->offset[k] + h->nrows * (int64_t)sizeof(float) > (int64_t)st.st_size)) {
+                munmap(map, st.st_size);
+                cat->map = NULL;
+                return -1;
+            }
+        }
+    }
+    for (slot=0; slot<cat->ncol; slot++)
+        cache_match(cat, slot);
+
+    return 0;
+}
+
+/* Writes the sidecar for the columns registered so far, going through the
+ * table twice: once for the sizes, once for the data. */
+static int
+cache_build(CAT_READER *cat, const char *path, struct stat *src, int *status)
+{
+    struct cache_head head;
+    struct cache_hdu *hdus;
+    size_t hsize;
+    int64_t offset;
+    char tmp[FLEN_FILENAME+32], name[FLEN_VALUE], pad[CACHE_ALIGN];
+    float buffer[CAT_BLOCK], nulval = 0.;
+    long nrows, row, n;
+    int nhdu, hdu, hdutype, k, colnum[CAT_MAXCOL], anynul;
+    FILE *fp;
+
+    if (fits_get_num_hdus(cat->fptr, &nhdu, status))
+        return *status;
+
+    hsize = sizeof(struct cache_hdu) + (cat->ncol-1) * sizeof(int64_t);
+    hdus = calloc(nhdu, hsize);
+    if (!hdus)
+        return *status = MEMORY_ALLOCATION;
+#define HDU(h) ((struct cache_hdu *)((char *)hdus + ((h)-1) * hsize))
+
+    offset = sizeof(head) + cat->ncol * FLEN_VALUE + nhdu * hsize;
+    for (hdu=2; hdu<=nhdu; hdu++) {
+        if (fits_movabs_hdu(cat->fptr, hdu, &hdutype, status))
+            break;
+        if (hdutype == IMAGE_HDU)
+            continue;
+        fits_get_num_rows(cat->fptr, &nrows, status);
+        HDU(hdu)->nrows = nrows;
+        for (k=0; k<cat->ncol; k++) {
+            if (fits_get_colnum(cat->fptr, CASEINSEN, cat->name[k], &colnum[k], status)) {
+                *status = 0;
+                continue;
+            }
+            offset = (offset + CACHE_ALIGN-1) / CACHE_ALIGN * CACHE_ALIGN;
+            HDU(hdu)->offset[k] = offset;
+            offset += (int64_t)nrows * sizeof(float);
+        }
+    }
+    cat->fitshdu = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fp = *status ? NULL : fopen(tmp, "wb");
+    if (!fp) {
+        free(hdus);
+        return *status ? *status : (*status = FILE_NOT_CREATED);
+    }
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CACHE_MAGIC, 8);
+    head.byteorder = CACHE_BYTEORDER;
+    head.version = CACHE_VERSION;
+    head.mtime = src->st_mtime;
+    head.size = src->st_size;
+    head.ncol = cat->ncol;
+    head.nhdu = nhdu;
+    fwrite(&head, sizeof(head), 1, fp);
+    for (k=0; k<cat->ncol; k++) {
+        memset(name, 0, FLEN_VALUE);
+        strncpy(name, cat->name[k], FLEN_VALUE-1);
+        fwrite(name, FLEN_VALUE, 1, fp);
+    }
+    fwrite(hdus, hsize, nhdu, fp);
+
+    memset(pad, 0, CACHE_ALIGN);
+    for (hdu=2; hdu<=nhdu && !*status; hdu++) {
+        if (!HDU(hdu)->nrows)
+            continue;
+        fits_movabs_hdu(cat->fptr, hdu, &hdutype, status);
+        for (k=0; k<cat->ncol && !*status; k++) {
+            if (!HDU(hdu)->offset[k])
+                continue;
+            fits_get_colnum(cat->fptr, CASEINSEN, cat->name[k], &colnum[k], status);
+            fwrite(pad, HDU(hdu)->offset[k] - ftell(fp), 1, fp);
+            for (row=1; row<=HDU(hdu)->nrows && !*status; row+=CAT_BLOCK) {
+                n = HDU(hdu)->nrows - row + 1;
+                if (n > CAT_BLOCK) n = CAT_BLOCK;
+                fits_read_col(cat->fptr, TFLOAT, colnum[k], row, 1, n, &nulval,
+                              buffer, &anynul, status);
+                fwrite(buffer, sizeof(float), n, fp);
+            }
+        }
+    }
+#undef HDU
+    free(hdus);
+
+    if (ferror(fp) && !*status)
+        *status = WRITE_ERROR;
+    if (fclose(fp) && !*status)
+        *status = WRITE_ERROR;
+    if (*status || rename(tmp, path)) {
+        remove(tmp);
+        return *status ? *status : (*status = FILE_NOT_CREATED);
+    }
+
+    return *status;
+}
+
+/* Serves the columns registered so far from the sidecar, writing it first
+ * if there is none or the table has changed since. Failing to do either
+ * is not an error: the columns are then read from the table as before. */
+int
+cat_cache(CAT_READER *cat)
+{
+    char name[FLEN_FILENAME], path[FLEN_FILENAME+32];
+    struct stat src;
+    int status = 0;
+
+    if (cat->map || !cat->ncol)
+        return -1;
+    cache_source(cat, name, sizeof(name));
+    if (stat(name, &src))
+        return -1;
+
+    cache_path(name, path, sizeof(path));
+    if (!cache_load(cat, path, &src))
+        return 0;
+
+    if (cache_build(cat, path, &src, &status)) {
+        fprintf(stderr, "Catalogue cache %s not written: ", path);
+        fits_report_error(stderr, status);
+        return -1;
+    }
+
+    return cache_load(cat, path, &src);
+}
+
+int
+cat_close(CAT_READER *cat, int *status)
+{
+    if (!cat)
+        return *status;
+
+    if (cat->map)
+        munmap(cat->map, cat->maplen);
+    fits_close_file(cat->fptr, status);
+    free(cat);
+
+    return *status;
+}
@@ -0,0 +1,469 @@
+//
+//  conesearch.c
+//  imagepreview
+//
+//  Archive cone searches for the chips on display. All the queries are put
+//  on the shared multi handle before the first chip is drawn; responses are
+//  parsed as they arrive and plotted into the panel of their chip once it
+//  is there, so a pawprint waits about one round trip rather than one per
+//  chip. Cones already covered by the tile cache need no query at all, and
+//  with a local reference index (see refcat.c) none goes out either.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wcs.h"
+#include "cpgplot.h"
+
+#define CONE_CHUNK 4096         /* sources projected and plotted together */
+#define CONE_MAXTHREAD 8
+#define CONE_GRIDMIN 16384      /* sources that pay for fitting the projection */
+#define CONE_GRIDTOL 0.01       /* pixels */
+
+typedef struct fcurl_data URL_FILE;
+URL_FILE *url_fopen(const char *url, const char *operation);
+int url_fclose(URL_FILE *file);
+char *url_fpeek(URL_FILE *file, size_t *len, int *last);
+void url_fskip(URL_FILE *file, size_t n);
+int url_wait(int timeout_ms);
+int url_ferror(URL_FILE *file);
+
+typedef struct table_parser TABLE_PARSER;
+TABLE_PARSER *table_parser(void (*fn)(double ra, double dec, void *arg), void *arg);
+size_t table_feed(TABLE_PARSER *tp, const char *data, size_t len, int last);
+void table_free(TABLE_PARSER *tp);
+
+typedef struct tile_cache TILE_CACHE;
+TILE_CACHE *tile_open(const char *survey, const char *urlpath);
+int tile_lookup(TILE_CACHE *tc, double ra, double dec, double radius,
+                double **radec, long *n, long *max, double *fetch);
+int tile_store(TILE_CACHE *tc, double ra, double dec, double radius, const double *radec, long n);
+void tile_close(TILE_CACHE *tc);
+double hp_distance(double ra1, double dec1, double ra2, double dec2);
+
+typedef struct refcat REFCAT;
+REFCAT *refcat_open(const char *path);
+long refcat_cone(REFCAT *rc, double ra, double dec, double radius,
+                 double **radec, long *n, long *max);
+void refcat_close(REFCAT *rc);
+
+typedef struct wcs_grid WCS_GRID;
+WCS_GRID *wcsgrid_new(struct wcsprm *wcs, double x1, double x2, double y1, double y2, double tol);
+int wcsgrid_s2p(WCS_GRID *g, struct wcsprm *wcs, int n, const double world[], double pix[], int stat[]);
+void wcsgrid_free(WCS_GRID *g);
+
+struct cone_query
+{
+    URL_FILE *handle;           /* NULL once the response is in */
+    TABLE_PARSER *parser;
+    struct wcsprm *wcs;
+    WCS_GRID *grid;             /* fitted to wcs over the window, for many sources */
+    int gridded;                /* the fit has been tried */
+    double ra, dec, radius;     /* the cone, in degrees */
+    double fetch;               /* radius asked of the archive for the cache */
+    double *radec;              /* sources in the cone so far */
+    long nsrc, maxsrc, ndrawn;
+    double *fetched;            /* all the sources the archive sent */
+    long nfetched, maxfetched;
+    int ix, iy;                 /* panel, 0 until the chip is drawn */
+    float vp[4], win[4];        /* its viewport (NDC) and window */
+};
+
+struct cone_set
+{
+    char *urlpath;              /* printf template taking ra, dec, radius */
+    TILE_CACHE *tiles;          /* NULL without a cache */
+    REFCAT *refcat;             /* local index in place of the archive */
+    struct cone_query **q;      /* each on its own, for the parser to hold */
+    int n, max;
+    int current;                /* query of the panel being drawn on, or -1 */
+};
+
+typedef struct cone_set CONE_SET;
+
+struct cone_job
+{
+    struct wcsprm *wcs;         /* the query's, or a copy for another thread */
+    struct wcsprm copy;
+    WCS_GRID *grid;             /* shared, or NULL */
+    const double *radec;
+    long n, first, last;        /* sources, and the chunks of this job */
+    float win[4];               /* x and y limits of the window */
+    float *x, *y;               /* CONE_CHUNK for each chunk, those kept first */
+    int *kept;                  /* how many of each chunk are in the window */
+};
+
+static void
+add_source(double **radec, long *n, long *max, const double src[2])
+{
+    if (*n == *max) {
+        *max = *max ? 2 * *max : 1024;
+        *radec = realloc(*radec, 2 * *max * sizeof(double));
+    }
+    (*radec)[2 * *n] = src[0];
+    (*radec)[2 * *n + 1] = src[1];
+    (*n)++;
+}
+
+/* A source of the response: with a wider cone fetched for the cache, all
+ * of them are kept for it and only those in the cone plotted. */
+static void
+got_source(double ra, double dec, void *arg)
+{
+    struct cone_query *q = arg;
+    double src[2] = {ra, dec};
+
+    if (q->fetch > 0)
+        add_source(&q->fetched, &q->nfetched, &q->maxfetched, src);
+    if (q->fetch <= 0 || hp_distance(q->ra, q->dec, ra, dec) <= q->radius)
+        add_source(&q->radec, &q->nsrc, &q->maxsrc, src);
+}
+
+/* Queries of survey go to urlpath, which takes ra, dec (degrees) and the
+ * radius (arcmin) in that order. */
+CONE_SET *
+cone_open(const char *survey, const char *urlpath)
+{
+    CONE_SET *set = malloc(sizeof(CONE_SET));
+
+    if (!set)
+        return NULL;
+    memset(set, 0, sizeof(CONE_SET));
+    set->current = -1;
+    set->urlpath = strdup(urlpath);
+    set->tiles = tile_open(survey, urlpath);
+
+    return set;
+}
+
+/* Cones answered from the reference index at path instead; NULL when it
+ * cannot be read. */
+CONE_SET *
+cone_open_index(const char *path)
+{
+    CONE_SET *set;
+    REFCAT *rc = refcat_open(path);
+
+    if (!rc)
+        return NULL;
+    if (!(set = malloc(sizeof(CONE_SET)))) {
+        refcat_close(rc);
+        return NULL;
+    }
+    memset(set, 0, sizeof(CONE_SET));
+    set->current = -1;
+    set->refcat = rc;
+
+    return set;
+}
+
+/* Starts the query of a cone, radius in arcmin; wcs (taken over, freed by
+ * cone_close) maps its sources onto the chip, and without one the query is
+ * left empty. Returns the query number, which is the order of the call. */
+int
+cone_submit(CONE_SET *set, double ra, double dec, double radius, struct wcsprm *wcs)
+{
+    struct cone_query *q;
+    char url[1024];
+
+    if (set->n == set->max) {
+        set->max = set->max ? 2*set->max : 16;
+        set->q = realloc(set->q, set->max * sizeof(struct cone_query *));
+    }
+    q = set->q[set->n] = calloc(1, sizeof(struct cone_query));
+    q->wcs = wcs;
+    q->ra = ra;
+    q->dec = dec;
+    q->radius = radius / 60.0;
+
+    if (!wcs)
+        return set->n++;
+
+    if (set->refcat) {
+        refcat_cone(set->refcat, ra, dec, q->radius, &q->radec, &q->nsrc, &q->maxsrc);
+        return set->n++;
+    }
+
+    /* a cone the cache has all of needs no query; otherwise one cone
+     * covering all the missing cells fills them in */
+    if (set->tiles) {
+        if (!tile_lookup(set->tiles, ra, dec, q->radius, &q->radec, &q->nsrc, &q->maxsrc, &q->fetch))
+            return set->n++;
+        q->nsrc = 0;
+        if (q->fetch > q->radius)
+            radius = q->fetch * 60.0;
+    }
+
+    snprintf(url, sizeof(url), set->urlpath, ra, dec, radius);
+    q->handle = url_fopen(url, "r");
+    q->parser = table_parser(got_source, q);
+
+    return set->n++;
+}
+
+/* The chip of query k has just been drawn in panel (ix, iy): remember the
+ * viewport and window to come back to. */
+void
+cone_panel(CONE_SET *set, int k, int ix, int iy)
+{
+    struct cone_query *q;
+
+    if (k < 0 || k >= set->n)
+        return;
+
+    q = set->q[k];
+    q->ix = ix;
+    q->iy = iy;
+    cpgqvp(0, &q->vp[0], &q->vp[1], &q->vp[2], &q->vp[3]);
+    cpgqwin(&q->win[0], &q->win[1], &q->win[2], &q->win[3]);
+    set->current = k;
+}
+
+static void
+cone_read(CONE_SET *set, struct cone_query *q)
+{
+    char *data;
+    size_t len, used;
+    int last;
+
+    /* the parser leaves a row cut short where it is until the rest comes */
+    while (q->handle && (data = url_fpeek(q->handle, &len, &last))) {
+        used = table_feed(q->parser, data, len, last);
+        url_fskip(q->handle, used);
+        if (!used && !last)
+            return;
+    }
+    if (!q->handle)
+        return;
+
+    /* the response is in */
+    if (!url_ferror(q->handle) && q->fetch > 0)
+        tile_store(set->tiles, q->ra, q->dec, q->fetch, q->fetched, q->nfetched);
+    free(q->fetched);
+    q->fetched = NULL;
+    table_free(q->parser);
+    q->parser = NULL;
+    url_fclose(q->handle);
+    q->handle = NULL;
+}
+
+static void *
+cone_project(void *arg)
+{
+    struct cone_job *job = (struct cone_job *)arg;
+    double *phi, *theta, *img, *pix;
+    int *stat, k, m, i;
+    long c, i0;
+    float *x, *y;
+
+    phi = malloc(6 * CONE_CHUNK * sizeof(double));
+    stat = malloc(CONE_CHUNK * sizeof(int));
+    if (!phi || !stat) {
+        for (c=job->first; c<job->last; c++)
+            job->kept[c] = 0;
+        free(phi);
+        free(stat);
+        return NULL;
+    }
+    theta = phi + CONE_CHUNK;
+    img = theta + CONE_CHUNK;
+    pix = img + 2*CONE_CHUNK;
+
+    for (c=job->first; c<job->last; c++) {
+        i0 = c * CONE_CHUNK;
+        m = job->n - i0 < CONE_CHUNK ? (int)(job->n - i0) : CONE_CHUNK;
+        /* sources off the sky of the fit are off the window too */
+        if (job->grid)
+            (void)wcsgrid_s2p(job->grid, job->wcs, m, job->radec + 2*i0, pix, stat);
+        else
+            (void)wcss2p(job->wcs, m, 2, job->radec + 2*i0, phi, theta, img, pix, stat);
+
+        /* PGPLOT leaves out markers centred off the window anyway */
+        x = job->x + i0;
+        y = job->y + i0;
+        for (i=0, k=0; i<m; i++) {
+            if (stat[i] || pix[2*i] < job->win[0] || pix[2*i] > job->win[1] ||
+                pix[2*i+1] < job->win[2] || pix[2*i+1] > job->win[3])
+                continue;
+            x[k] = pix[2*i];
+            y[k] = pix[2*i+1];
+            k++;
+        }
+        job->kept[c] = k;
+    }
+
+    free(phi);
+    free(stat);
+    return NULL;
+}
+
+/* Plots the sources of q not drawn yet: projected a chunk at a time, the
+ * chunks split over threads for large responses, and the ones on the chip
+ * drawn with one cpgpt per chunk. */
+static void
+cone_draw(struct cone_query *q, int symbol, float cheight)
+{
+    struct cone_job job[CONE_MAXTHREAD];
+    pthread_t thread[CONE_MAXTHREAD];
+    long n = q->nsrc - q->ndrawn, nchunk = (n + CONE_CHUNK-1) / CONE_CHUNK, c;
+    float *x, *y;
+    int *kept, t, nthread;
+
+    cpgpanl(q->ix, q->iy);
+    cpgsvp(q->vp[0], q->vp[1], q->vp[2], q->vp[3]);
+    cpgswin(q->win[0], q->win[1], q->win[2], q->win[3]);
+
+    x = malloc(2 * nchunk * CONE_CHUNK * sizeof(float));
+    kept = malloc(nchunk * sizeof(int));
+    if (!x || !kept) {
+        free(x);
+        free(kept);
+        return;
+    }
+    y = x + nchunk * CONE_CHUNK;
+
+    /* once enough sources have come, the projection is fitted over the
+     * window and the rest go through the fit */
+    if (!q->gridded && q->nsrc >= CONE_GRIDMIN) {
+        q->grid = wcsgrid_new(q->wcs, q->win[0], q->win[1], q->win[2], q->win[3], CONE_GRIDTOL);
+        q->gridded = 1;
+    }
+
+    nthread = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread > CONE_MAXTHREAD) nthread = CONE_MAXTHREAD;
+    if (nthread > nchunk) nthread = (int)nchunk;
+    if (nthread < 1 || n < 4*CONE_CHUNK) nthread = 1;
+
+    /* wcss2p keeps its workings in the wcsprm, so each thread has its own */
+    for (t=0; t<nthread; t++) {
+        job[t].wcs = q->wcs;
+        if (t) {
+            job[t].copy.flag = -1;
+            if (wcssub(1, q->wcs, 0x0, 0x0, &job[t].copy)) {
+                nthread = t;
+                break;
+            }
+            job[t].wcs = &job[t].copy;
+        }
+    }
+    for (t=0; t<nthread; t++) {
+        job[t].grid = q->grid;
+        job[t].radec = q->radec + 2*q->ndrawn;
+        job[t].n = n;
+        job[t].first = nchunk * t / nthread;
+        job[t].last = nchunk * (t+1) / nthread;
+        job[t].win[0] = q->win[0] < q->win[1] ? q->win[0] : q->win[1];
+        job[t].win[1] = q->win[0] < q->win[1] ? q->win[1] : q->win[0];
+        job[t].win[2] = q->win[2] < q->win[3] ? q->win[2] : q->win[3];
+        job[t].win[3] = q->win[2] < q->win[3] ? q->win[3] : q->win[2];
+        job[t].x = x;
+        job[t].y = y;
+        job[t].kept = kept;
+    }
+
+    for (t=1; t<nthread; t++)
+        pthread_create(&thread[t], NULL, cone_project, &job[t]);
+    cone_project(&job[0]);
+    for (t=1; t<nthread; t++) {
+        pthread_join(thread[t], NULL);
+        wcsfree(&job[t].copy);
+    }
+
+    cpgsci(3);
+    cpgsch(cheight);
+    for (c=0; c<nchunk; c++)
+        if (kept[c])
+            cpgpt(kept[c], x + c*CONE_CHUNK, y + c*CONE_CHUNK, symbol);
+    q->ndrawn = q->nsrc;
+
+    free(x);
+    free(kept);
+}
+
+/* Reads what has arrived and plots it on the chips already drawn. With wait
+ * set, carries on until the queries of all those chips are complete.
+ * Returns the number of queries still going. */
+int
+cone_drain(CONE_SET *set, int wait, int symbol, float cheight)
+{
+    struct cone_query *q, *cur;
+    int k, pending, moved;
+
+    url_wait(0);
+    for (;;) {
+        pending = 0;
+        moved = 0;
+        cpgbbuf();
+        cpgsave();
+        for (k=0; k<set->n; k++) {
+            q = set->q[k];
+            cone_read(set, q);
+            if (q->ix && q->ndrawn < q->nsrc) {
+                cone_draw(q, symbol, cheight);
+                moved |= (k != set->current);
+            }
+            if (q->handle && q->ix)
+                pending++;
+        }
+
+        /* back to the panel being drawn on, for whatever comes next */
+        if (moved && set->current >= 0) {
+            cur = set->q[set->current];
+            cpgpanl(cur->ix, cur->iy);
+            cpgsvp(cur->vp[0], cur->vp[1], cur->vp[2], cur->vp[3]);
+            cpgswin(cur->win[0], cur->win[1], cur->win[2], cur->win[3]);
+        }
+        cpgunsa();
+        cpgebuf();
+
+        if (!wait || !pending)
+            break;
+        url_wait(1000);
+    }
+
+    for (k=0, pending=0; k<set->n; k++)
+        pending += set->q[k]->handle != NULL;
+    return pending;
+}
+
+/* Sources in the cone of query k so far. */
+long
+cone_sources(CONE_SET *set, int k)
+{
+    return k >= 0 && k < set->n ? set->q[k]->nsrc : 0;
+}
+
+void
+cone_close(CONE_SET *set)
+{
+    struct cone_query *q;
+    int k;
+
+    if (!set)
+        return;
+
+    for (k=0; k<set->n; k++) {
+        q = set->q[k];
+        if (q->handle)
+            url_fclose(q->handle);
+        table_free(q->parser);
+        if (q->wcs) {
+            wcsfree(q->wcs);
+            free(q->wcs);
+        }
+        wcsgrid_free(q->grid);
+        free(q->radec);
+        free(q->fetched);
+        free(q);
+    }
+    tile_close(set->tiles);
+    refcat_close(set->refcat);
+    free(set->urlpath);
+    free(set->q);
+    free(set);
+}
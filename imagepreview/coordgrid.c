@@ -0,0 +1,319 @@
+//
+//  coordgrid.c
+//  imagepreview
+//
+//  RA and Dec lines over a chip, at a round spacing picked for the size of
+//  the field, with labels where they leave the window. Each line starts as
+//  a few chords whose middles are projected; a chord is halved only where
+//  its middle is off it by more than a quarter of a device pixel, so a
+//  straight TAN line costs a few dozen projections and one bending through
+//  the ZPN distortion at the edge of the VISTA field not many more.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "wcs.h"
+#include "cpgplot.h"
+
+#define GRID_LINES 6            /* at most this many lines each way, about */
+#define GRID_START 8            /* chords a line starts as */
+#define GRID_DEPTH 10           /* halvings of one at most */
+#define GRID_EDGE 32            /* points along each edge sampled for the extent */
+
+/* round spacings, seconds of time for RA and of arc for Dec */
+static const double ra_steps[] = {1, 2, 5, 10, 15, 20, 30, 60, 120, 300, 600, 900, 1200,
+                                  1800, 3600, 7200, 10800, 21600};
+static const double dec_steps[] = {1, 2, 5, 10, 15, 20, 30, 60, 120, 300, 600, 900, 1200,
+                                   1800, 3600, 7200, 18000, 36000, 54000, 108000, 324000};
+
+struct trace
+{
+    struct wcsprm *wcs;
+    int ra_line;                /* a line of constant RA, traced in Dec */
+    double fixed;               /* its RA or Dec */
+    float win[4];               /* x1, x2, y1, y2 */
+    double tol;                 /* largest miss of a chord, world units */
+    float *x, *y;               /* the polyline drawn so far */
+    int n, max;
+    float cross[4][2];          /* first crossing of each edge */
+    int crossed[4];
+    long nproj;
+};
+
+static double
+wrap180(double a)
+{
+    a = fmod(a, 360.0);
+    if (a > 180.0) a -= 360.0;
+    if (a <= -180.0) a += 360.0;
+    return a;
+}
+
+/* The step from steps (in units of unit degrees) giving at most want
+ * lines over range. */
+static double
+round_step(const double *steps, int n, double unit, double range, int want)
+{
+    int k;
+
+    for (k=0; k<n-1; k++)
+        if (range / (steps[k] * unit) <= want)
+            break;
+    return steps[k] * unit;
+}
+
+/* The pixel of point s of the line, 0 when it has one. */
+static int
+project(struct trace *t, double s, double pix[2])
+{
+    double world[2], phi, theta, img[2];
+    int stat;
+
+    world[0] = t->ra_line ? t->fixed : s;
+    world[1] = t->ra_line ? s : t->fixed;
+    world[0] = fmod(world[0] + 720.0, 360.0);
+    t->nproj++;
+    return wcss2p(t->wcs, 1, 2, world, &phi, &theta, img, pix, &stat) || stat;
+}
+
+static void
+flush_line(struct trace *t)
+{
+    if (t->n > 1)
+        cpgline(t->n, t->x, t->y);
+    t->n = 0;
+}
+
+static void
+add_point(struct trace *t, const double p[2])
+{
+    int max = t->max ? 2*t->max : 256;
+    float *v;
+
+    if (t->n == t->max) {
+        if (!(v = realloc(t->x, max * sizeof(float))))
+            return;
+        t->x = v;
+        if (!(v = realloc(t->y, max * sizeof(float))))
+            return;
+        t->y = v;
+        t->max = max;
+    }
+    t->x[t->n] = p[0];
+    t->y[t->n] = p[1];
+    t->n++;
+}
+
+/* Where the chord from p0 to p1 first crosses each edge of the window. */
+static void
+edge_crossings(struct trace *t, const double p0[2], const double p1[2])
+{
+    double f, c;
+    int e, axis;
+
+    for (e=0; e<4; e++) {
+        axis = e / 2;           /* 0: x = x1 or x2, 1: y = y1 or y2 */
+        if (t->crossed[e] || (p0[axis] - t->win[e]) * (p1[axis] - t->win[e]) > 0.0 ||
+            p0[axis] == p1[axis])
+            continue;
+        f = (t->win[e] - p0[axis]) / (p1[axis] - p0[axis]);
+        c = p0[1-axis] + f * (p1[1-axis] - p0[1-axis]);
+        if (c < t->win[2*(1-axis)] || c > t->win[2*(1-axis)+1])
+            continue;
+        t->cross[e][axis] = t->win[e];
+        t->cross[e][1-axis] = c;
+        t->crossed[e] = 1;
+    }
+}
+
+/* Adds the part s0..s1 of the line, halving it while its middle is off the
+ * chord; pieces with an end that does not project break the line. */
+static void
+trace_piece(struct trace *t, double s0, const double p0[2], int bad0,
+            double s1, const double p1[2], int bad1, int depth)
+{
+    double sm = (s0 + s1) / 2.0, pm[2];
+    int badm, outside;
+
+    /* wholly on one side of the window: the chord will do */
+    outside = !bad0 && !bad1 &&
+        ((p0[0] < t->win[0] && p1[0] < t->win[0]) || (p0[0] > t->win[1] && p1[0] > t->win[1]) ||
+         (p0[1] < t->win[2] && p1[1] < t->win[2]) || (p0[1] > t->win[3] && p1[1] > t->win[3]));
+
+    if (depth < GRID_DEPTH && !outside) {
+        badm = project(t, sm, pm);
+        if (bad0 || bad1 || badm ||
+            hypot(pm[0] - (p0[0]+p1[0])/2.0, pm[1] - (p0[1]+p1[1])/2.0) > t->tol) {
+            trace_piece(t, s0, p0, bad0, sm, pm, badm, depth+1);
+            trace_piece(t, sm, pm, badm, s1, p1, bad1, depth+1);
+            return;
+        }
+    }
+
+    if (bad0 || bad1) {
+        flush_line(t);
+        return;
+    }
+    if (!t->n)
+        add_point(t, p0);
+    add_point(t, p1);
+    edge_crossings(t, p0, p1);
+}
+
+static void
+trace_line(struct trace *t, double s0, double s1)
+{
+    double p0[2], p1[2], s, ds = (s1 - s0) / GRID_START;
+    int k, bad0, bad1;
+
+    t->n = 0;
+    t->crossed[0] = t->crossed[1] = t->crossed[2] = t->crossed[3] = 0;
+    bad0 = project(t, s0, p0);
+    for (k=1; k<=GRID_START; k++) {
+        s = s0 + k * ds;
+        bad1 = project(t, s, p1);
+        trace_piece(t, s - ds, p0, bad0, s, p1, bad1, 0);
+        p0[0] = p1[0];
+        p0[1] = p1[1];
+        bad0 = bad1;
+    }
+    flush_line(t);
+}
+
+static void
+ra_label(double ra, double step, char *text, size_t len)
+{
+    long s = lround(fmod(ra + 360.0, 360.0) * 240.0) % 86400;
+
+    if (step >= 15.0)
+        snprintf(text, len, "%02ld\\uh\\d", s / 3600);
+    else if (step >= 0.25)
+        snprintf(text, len, "%02ld\\uh\\d%02ld\\um\\d", s / 3600, s / 60 % 60);
+    else
+        snprintf(text, len, "%02ld\\uh\\d%02ld\\um\\d%02ld\\us\\d", s / 3600, s / 60 % 60, s % 60);
+}
+
+static void
+dec_label(double dec, double step, char *text, size_t len)
+{
+    long s = lround(fabs(dec) * 3600.0);
+    char sign = dec < 0.0 && s ? '-' : '+';
+
+    if (step >= 1.0)
+        snprintf(text, len, "%c%02ld\\uo\\d", sign, s / 3600);
+    else if (step >= 1.0/60.0)
+        snprintf(text, len, "%c%02ld\\uo\\d%02ld'", sign, s / 3600, s / 60 % 60);
+    else
+        snprintf(text, len, "%c%02ld\\uo\\d%02ld'%02ld\"", sign, s / 3600, s / 60 % 60, s % 60);
+}
+
+/* Draws the RA and Dec lines of wcs over the window x1..x2, y1..y2 (pixels)
+ * of the current panel. Returns the number of projections it took. */
+long
+coord_grid(struct wcsprm *wcs, float x1, float x2, float y1, float y2)
+{
+    double pix[4*GRID_EDGE+1][2], world[4*GRID_EDGE+1][2], img[4*GRID_EDGE+1][2];
+    double phi[4*GRID_EDGE+1], theta[4*GRID_EDGE+1], pole[2], pp[2];
+    double ra0, rlo = 0.0, rhi = 0.0, dlo = 90.0, dhi = -90.0, rstep, dstep, v, f, pad;
+    float vx1, vx2, vy1, vy2, xch, ych;
+    int stat[4*GRID_EDGE+1], k, n = 4*GRID_EDGE+1, e;
+    struct trace t;
+    char text[64];
+
+    /* the extent on the sky from the edges and centre of the window */
+    for (k=0; k<4*GRID_EDGE; k++) {
+        f = (double)(k % GRID_EDGE) / GRID_EDGE;
+        switch (k / GRID_EDGE) {
+            case 0: pix[k][0] = x1 + f*(x2-x1); pix[k][1] = y1; break;
+            case 1: pix[k][0] = x2; pix[k][1] = y1 + f*(y2-y1); break;
+            case 2: pix[k][0] = x2 - f*(x2-x1); pix[k][1] = y2; break;
+            default: pix[k][0] = x1; pix[k][1] = y2 - f*(y2-y1); break;
+        }
+    }
+    pix[n-1][0] = (x1 + x2) / 2.0;
+    pix[n-1][1] = (y1 + y2) / 2.0;
+    (void)wcsp2s(wcs, n, 2, pix[0], img[0], phi, theta, world[0], stat);
+    if (stat[n-1])
+        return 0;
+    ra0 = world[n-1][0];
+    for (k=0; k<n; k++) {
+        if (stat[k])
+            continue;
+        v = wrap180(world[k][0] - ra0);
+        if (v < rlo) rlo = v;
+        if (v > rhi) rhi = v;
+        if (world[k][1] < dlo) dlo = world[k][1];
+        if (world[k][1] > dhi) dhi = world[k][1];
+    }
+
+    /* a pole on the chip takes in every RA */
+    for (k=0; k<2; k++) {
+        pole[0] = 0.0;
+        pole[1] = k ? -90.0 : 90.0;
+        if (!wcss2p(wcs, 1, 2, pole, phi, theta, img[0], pp, stat) && !stat[0] &&
+            pp[0] >= x1 && pp[0] <= x2 && pp[1] >= y1 && pp[1] <= y2) {
+            rlo = -180.0;
+            rhi = 180.0;
+            if (k) dlo = -90.0; else dhi = 90.0;
+        }
+    }
+
+    dstep = round_step(dec_steps, sizeof(dec_steps)/sizeof(double), 1.0/3600.0, dhi - dlo, GRID_LINES);
+    rstep = round_step(ra_steps, sizeof(ra_steps)/sizeof(double), 15.0/3600.0, rhi - rlo, GRID_LINES);
+
+    t.wcs = wcs;
+    t.win[0] = x1 < x2 ? x1 : x2;
+    t.win[1] = x1 < x2 ? x2 : x1;
+    t.win[2] = y1 < y2 ? y1 : y2;
+    t.win[3] = y1 < y2 ? y2 : y1;
+    cpgqvp(3, &vx1, &vx2, &vy1, &vy2);
+    t.tol = 0.25 * fabs(x2 - x1) / (vx2 - vx1);
+    t.x = t.y = NULL;
+    t.n = t.max = 0;
+    t.nproj = 0;
+
+    cpgbbuf();
+    cpgsave();
+    cpgsci(5);
+    cpgqcs(4, &xch, &ych);
+
+    /* the lines run a step past the extent, so they reach the corners */
+    pad = 0.05 * (dhi - dlo);
+    t.ra_line = 1;
+    for (v = ceil((ra0 + rlo) / rstep) * rstep; v <= ra0 + rhi; v += rstep) {
+        t.fixed = v;
+        trace_line(&t, dlo - pad > -90.0 ? dlo - pad : -90.0, dhi + pad < 90.0 ? dhi + pad : 90.0);
+        /* at the bottom, or failing that the top */
+        for (e=2; e<4 && !t.crossed[e]; e++);
+        if (e < 4) {
+            ra_label(v, rstep, text, sizeof(text));
+            cpgptxt(t.cross[e][0], t.cross[e][1] + (e == 2 ? 0.5 : -1.5) * ych, 0.0, 0.5, text);
+        }
+    }
+
+    pad = 0.05 * (rhi - rlo);
+    t.ra_line = 0;
+    for (v = ceil(dlo / dstep) * dstep; v <= dhi; v += dstep) {
+        if (fabs(v) >= 90.0)
+            continue;
+        t.fixed = v;
+        trace_line(&t, ra0 + rlo - pad, ra0 + rhi + pad);
+        /* on the left, or failing that the right */
+        for (e=0; e<2 && !t.crossed[e]; e++);
+        if (e < 2) {
+            dec_label(v, dstep, text, sizeof(text));
+            cpgptxt(t.cross[e][0] + (e == 0 ? 0.5 : -0.5) * xch, t.cross[e][1] - 0.3 * ych,
+                    0.0, e == 0 ? 0.0 : 1.0, text);
+        }
+    }
+
+    cpgunsa();
+    cpgebuf();
+    free(t.x);
+    free(t.y);
+
+    return t.nproj + n + 2;
+}
@@ -48,6 +48,9 @@
  * Subroutine:	ksearch (hstring,keyword) returns pointer to header string entry
  * Subroutine:	str2ra (in) converts string to right ascension in degrees
  * Subroutine:	str2dec (in) converts string to declination in degrees
+ * Subroutine:	str2deg (s,e,hours,deg) reads an angle from a string, leaving it as it is
+ * Subroutine:	str2angle (s,e,hours,deg) reads a field of a string that is only an angle
+ * Subroutine:	str2radec (s,e,sep,racol,deccol,...) reads RA and Dec columns of text
  * Subroutine:	strsrch (s1, s2) finds string s2 in null-terminated string s1
  * Subroutine:	strnsrch (s1, s2, ls1) finds string s2 in ls1-byte string s1
  * Subroutine:	hlength (header,lhead) sets length of FITS header for searching
@@ -66,13 +69,15 @@
 #define INT_MAX  2147483647 /* Biggest number that can fit in long */
 #define SHRT_MAX 32767
 #endif
-#define VLENGTH 81
-
-static char val[VLENGTH+1];
-static int multiline = 0;
+#include <math.h>
 
 double str2ra (const char *in);
 double str2dec (const char *in);
+const char *str2deg (const char *s, const char *e, int hours, double *deg);
+int str2angle (const char *s, const char *e, int hours, double *deg);
+long str2radec (const char *s, const char *e, char sep, int racol, int deccol,
+                double *ra, double *dec, long nmax, const char **next);
+const char *scan_double (const char *s, const char *e, double *v);
 char *strsrch (const char *s1, const char *s2);
 char *strnsrch (const char *s1, const char *s2, const int ls1);
 char *strncsrch (const char *s1, const char *s2, const int ls1);
@@ -82,11 +87,11 @@ char *strncsrch (const char *s1, const char *s2, const int ls1);
 
 double str2ra (const char *in)
 {
-    double ra;	/* Right ascension in degrees (returned) */
+    double ra = 0.0;	/* Right ascension in degrees (returned) */
     
-    ra = str2dec (in);
-    if (strsrch (in,":"))
-        ra = ra * 15.0;
+    /* Return 0.0 if string is null or does not start with an angle */
+    if (in == NULL || str2deg (in, in + strlen (in), 1, &ra) == NULL)
+        return (0.0);
     
     return (ra);
 }
@@ -96,84 +101,120 @@ double str2ra (const char *in)
 
 double str2dec (const char *in)
 {
-    double dec;		/* Declination in degrees (returned) */
-    double deg, min, sec, sign;
-    char *value, *c1, *c2;
-    int lval;
-    char *dchar;
+    double dec = 0.0;	/* Declination in degrees (returned) */
+    
+    if (in == NULL || str2deg (in, in + strlen (in), 0, &dec) == NULL)
+        return (0.0);
     
-    dec = 0.0;
+    return (dec);
+}
+
+
+/* Read an angle at the start of [s, e), after any blanks: decimal degrees,
+ * or sexagesimal d:m:s or d m s, in hours when hours is set. Minutes and
+ * seconds may be left off and any field may have a fraction. The string is
+ * only read, in one pass, and need not end in a NUL. Returns the end of the
+ * angle, or NULL when there is none. */
+
+const char *
+str2deg (const char *s, const char *e, int hours, double *deg)
+{
+    double f[3] = {0.0, 0.0, 0.0}, x;
+    const char *t;
+    int n, neg = 0;
     
-    /* Return 0.0 if string is null */
-    if (in == NULL)
-        return (dec);
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    if (s < e && (*s == '+' || *s == '-'))
+        neg = *s++ == '-';
+    if (s == e || ((*s < '0' || *s > '9') && *s != '.'))
+        return (NULL);
     
-    /* Translate value from ASCII colon-delimited string to binary */
-    if (in[0]) {
-        value = (char *) in;
-        
-        /* Remove leading spaces */
-        while (*value == ' ')
-            value++;
+    for (n = 0; n < 3; ) {
+        if ((t = scan_double (s, e, &f[n])) == NULL)
+            break;
+        s = t;
+        n++;
         
-        /* Save sign */
-        if (*value == '-') {
-            sign = -1.0;
-            value++;
-	    }
-        else if (*value == '+') {
-            sign = 1.0;
-            value++;
-	    }
+        /* another field only after a colon or blanks, and then a digit */
+        if (t < e && *t == ':')
+            t++;
         else
-            sign = 1.0;
-        
-        /* Remove trailing spaces */
-        lval = strlen (value);
-        while (value[lval-1] == ' ')
-            lval--;
+            while (t < e && (*t == ' ' || *t == '\t'))
+                t++;
+        if (t == s || t == e || *t < '0' || *t > '9')
+            break;
+        s = t;
+    }
+    if (n == 0)
+        return (NULL);
+    
+    x = f[0] + f[1] / 60.0 + f[2] / 3600.0;
+    if (n > 1 && hours)
+        x *= 15.0;
+    *deg = neg ? -x : x;
+    
+    return (s);
+}
+
+
+/* Return 1 if the whole of [s, e) is an angle, blanks and quotes around
+ * it allowed, and set deg to it */
+
+int
+str2angle (const char *s, const char *e, int hours, double *deg)
+{
+    while (s < e && (*s == '"' || *s == ' ' || *s == '\t'))
+        s++;
+    if ((s = str2deg (s, e, hours, deg)) == NULL)
+        return (0);
+    while (s < e && (*s == '"' || *s == ' ' || *s == '\t' || *s == '\r'))
+        s++;
+    return (s == e && isfinite (*deg));
+}
+
+
+/* Read RA and Dec from columns racol and deccol (from 0) of the lines of
+ * [s, e), split at sep, or at runs of blanks when sep is ' '. RA in
+ * sexagesimal is taken to be in hours. Lines starting with '#', and those
+ * where either column is not an angle, are skipped. Stops after nmax rows,
+ * setting next (if not NULL) to where to carry on. Returns the number of
+ * rows read. */
+
+long
+str2radec (const char *s, const char *e, char sep, int racol, int deccol,
+           double *ra, double *dec, long nmax, const char **next)
+{
+    const char *eol, *fs, *fe;
+    long n = 0;
+    int col, got, last = racol > deccol ? racol : deccol;
+    
+    for (; s < e && n < nmax; s = eol + 1) {
+        if ((eol = memchr (s, '\n', e - s)) == NULL)
+            eol = e;
+        if (*s == '#')
+            continue;
         
-        if ((c1 = strsrch (value,":")) == NULL)
-            c1 = strnsrch (value," ",lval);
-		
-        if (c1 != NULL) {
-            *c1 = 0;
-            
-            deg = (double) atoi (value);
-            *c1 = ':';
-            value = c1 + 1;
-            if ((c2 = strsrch (value,":")) == NULL)
-                c2 = strsrch (value," ");
-            if (c2 != NULL) {
-                *c2 = 0;
-                min = (double) atoi (value);
-                *c2 = ':';
-                value = c2 + 1;
-                sec = atof (value);
-                
-            }
-            else {
-                sec = 0.0;
-                if ((c1 = strsrch (value,".")) != NULL)
-                    min = atof (value);
-                if (strlen (value) > 0)
-                    min = (double) atoi (value);
+        for (fs = s, col = 0, got = 0; col <= last && fs <= eol; col++, fs = fe + 1) {
+            if (sep == ' ') {
+                while (fs < eol && (*fs == ' ' || *fs == '\t'))
+                    fs++;
+                for (fe = fs; fe < eol && *fe != ' ' && *fe != '\t'; fe++);
             }
-            dec = sign * (deg + (min / 60.0) + (sec / 3600.0));
-	    }
-        else if (isnum (value) == 2) {
-            if ((dchar = strchr (value, 'D')))
-                *dchar = 'e';
-            if ((dchar = strchr (value, 'd')))
-                *dchar = 'e';
-            if ((dchar = strchr (value, 'E')))
-                *dchar = 'e';
-            dec = sign * atof (value);
-	    }
-        else
-            dec = sign * (double) atoi (value);
-	}
-    return (dec);
+            else if ((fe = memchr (fs, sep, eol - fs)) == NULL)
+                fe = eol;
+            if (col == racol)
+                got += str2angle (fs, fe, 1, &ra[n]);
+            if (col == deccol)
+                got += str2angle (fs, fe, 0, &dec[n]);
+        }
+        if (got == 2)
+            n++;
+    }
+    if (next != NULL)
+        *next = s < e ? s : e;
+    
+    return (n);
 }
 
 
@@ -0,0 +1,246 @@
+//
+//  cube.c
+//  imagepreview
+//
+//  Plane streaming for data cubes (NAXIS3 and above). A reader thread owns a
+//  private CFITSIO handle and keeps a small ring of planes prefetched ahead of
+//  the display, so a cube is never held in memory as a whole. Under the -M
+//  budget the ring holds planes read in bands and binned, as bands.c does.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fitsio.h"
+
+#define CUBE_RING 3             /* number of prefetched planes */
+
+int kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status);
+int band_read(fitsfile *fptr, long nx, long first, int x1, int x2, int y1, int y2, int bin, long rows,
+              const long *sample, float *value, int nsample, float *out, int *status);
+
+struct cube_stream
+{
+    fitsfile *fptr;             /* private handle, only used by the reader */
+    long npix;                  /* pixels per plane */
+    long nx, rows;              /* with bin set, planes are read in bands */
+    int x1, x2, y1, y2, bin;    /* of rows rows, the section binned by bin */
+    long first, last;           /* plane range, 1-based and inclusive */
+    int loop;                   /* wrap around at the end of the range */
+
+    float *buf[CUBE_RING];      /* plane buffers */
+    long plane[CUBE_RING];      /* plane held by each buffer */
+    int head;                   /* next buffer handed to the display */
+    int count;                  /* buffers filled, including a held one */
+    int held;                   /* buffer currently owned by the display */
+
+    long next;                  /* next plane the reader will fetch */
+    unsigned int generation;    /* bumped on seek to discard stale reads */
+    int stop, status;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+};
+
+typedef struct cube_stream CUBE_STREAM;
+
+static void *
+cube_reader(void *arg)
+{
+    CUBE_STREAM *cs = (CUBE_STREAM *)arg;
+    int slot, status;
+    long plane;
+    unsigned int generation;
+
+    pthread_mutex_lock(&cs->lock);
+    while (!cs->stop) {
+        if (cs->count == CUBE_RING || cs->next > cs->last || cs->status) {
+            pthread_cond_wait(&cs->drained, &cs->lock);
+            continue;
+        }
+
+        slot = (cs->head + cs->count) % CUBE_RING;
+        plane = cs->next;
+        generation = cs->generation;
+        pthread_mutex_unlock(&cs->lock);
+
+        /* the slot is outside the filled part of the ring, so nobody else
+         * touches it while we read without the lock */
+        status = 0;
+        if (cs->bin)
+            band_read(cs->fptr, cs->nx, 1 + (plane - 1) * cs->npix, cs->x1, cs->x2, cs->y1, cs->y2,
+                      cs->bin, cs->rows, NULL, NULL, 0, cs->buf[slot], &status);
+        else
+            kern_read_img(cs->fptr, 1 + (plane - 1) * cs->npix, cs->npix, cs->buf[slot], &status);
+
+        pthread_mutex_lock(&cs->lock);
+        if (generation != cs->generation)
+            continue;   /* a seek happened while we were reading */
+
+        if (status) {
+            cs->status = status;
+        } else {
+            cs->plane[slot] = plane;
+            cs->count++;
+            cs->next = plane + 1;
+            if (cs->next > cs->last && cs->loop)
+                cs->next = cs->first;
+        }
+        pthread_cond_signal(&cs->filled);
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    return NULL;
+}
+
+/* give the buffer held by the display back to the reader; lock held */
+static void
+cube_release(CUBE_STREAM *cs)
+{
+    if (cs->held < 0)
+        return;
+
+    cs->head = (cs->head + 1) % CUBE_RING;
+    cs->count--;
+    cs->held = -1;
+    pthread_cond_signal(&cs->drained);
+}
+
+/* Streams planes first..last of npix pixels from start, round again if
+ * loop is set. With bin set, the planes, nx wide, are read rows rows at a
+ * time and only their section x1..x2, y1..y2 is kept, binned by bin. */
+CUBE_STREAM *
+cube_open(char *filename, int hdunum, long npix, long nx, int x1, int x2, int y1, int y2,
+          int bin, long rows, long first, long last, long start, int loop, int *status)
+{
+    CUBE_STREAM *cs;
+    long size = npix;
+    int i, hdutype;
+
+    if (*status)
+        return NULL;
+
+    cs = malloc(sizeof(CUBE_STREAM));
+    if (!cs)
+        return NULL;
+
+    memset(cs, 0, sizeof(CUBE_STREAM));
+
+    if (fits_open_image(&cs->fptr, filename, READONLY, status) ||
+        fits_movabs_hdu(cs->fptr, hdunum, &hdutype, status)) {
+        if (cs->fptr) {
+            i = 0;
+            fits_close_file(cs->fptr, &i);
+        }
+        free(cs);
+        return NULL;
+    }
+
+    if (bin)
+        size = ((x2 - x1 + bin) / bin) * ((y2 - y1 + bin) / bin);
+    for (i=0; i<CUBE_RING; i++) {
+        cs->buf[i] = (float *) malloc(size * sizeof(float));
+        if (!cs->buf[i]) {
+            while (i--)
+                free(cs->buf[i]);
+            fits_close_file(cs->fptr, status);
+            free(cs);
+            return NULL;
+        }
+    }
+
+    cs->npix = npix;
+    cs->nx = nx;
+    cs->x1 = x1;
+    cs->x2 = x2;
+    cs->y1 = y1;
+    cs->y2 = y2;
+    cs->bin = bin;
+    cs->rows = rows;
+    cs->first = first;
+    cs->last = last;
+    cs->loop = loop;
+    cs->next = (start < first || start > last) ? first : start;
+    cs->held = -1;
+
+    pthread_mutex_init(&cs->lock, NULL);
+    pthread_cond_init(&cs->filled, NULL);
+    pthread_cond_init(&cs->drained, NULL);
+    pthread_create(&cs->thread, NULL, cube_reader, cs);
+
+    return cs;
+}
+/* Returns the next plane in the stream, blocking until the reader has it.
+ * The buffer stays valid until the following cube_next/cube_seek call.
+ * NULL at the end of a non-looping range or on a read error. */
+float *
+cube_next(CUBE_STREAM *cs, long *plane)
+{
+    float *array = NULL;
+
+    pthread_mutex_lock(&cs->lock);
+    cube_release(cs);
+
+    while (cs->count == 0 && cs->next <= cs->last && !cs->status)
+        pthread_cond_wait(&cs->filled, &cs->lock);
+
+    if (cs->count > 0) {
+        cs->held = cs->head;
+        array = cs->buf[cs->head];
+        if (plane)
+            *plane = cs->plane[cs->head];
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    return array;
+}
+
+/* drops whatever was prefetched and restarts the stream at plane */
+void
+cube_seek(CUBE_STREAM *cs, long plane)
+{
+    pthread_mutex_lock(&cs->lock);
+    cube_release(cs);
+
+    if (plane < cs->first)
+        plane = cs->loop ? cs->last : cs->first;
+    if (plane > cs->last)
+        plane = cs->loop ? cs->first : cs->last;
+
+    cs->head = 0;
+    cs->count = 0;
+    cs->next = plane;
+    cs->generation++;
+    pthread_cond_signal(&cs->drained);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+int
+cube_close(CUBE_STREAM *cs)
+{
+    int i, status;
+
+    pthread_mutex_lock(&cs->lock);
+    cs->stop = 1;
+    pthread_cond_signal(&cs->drained);
+    pthread_mutex_unlock(&cs->lock);
+    pthread_join(cs->thread, NULL);
+
+    status = cs->status;
+    fits_close_file(cs->fptr, &status);
+
+    for (i=0; i<CUBE_RING; i++)
+        free(cs->buf[i]);
+
+    pthread_cond_destroy(&cs->filled);
+    pthread_cond_destroy(&cs->drained);
+    pthread_mutex_destroy(&cs->lock);
+    free(cs);
+
+    return status;
+}
@@ -0,0 +1,195 @@
+//
+//  density.c
+//  imagepreview
+//
+//  Level-of-detail overlay for crowded catalogues. Sources are binned onto
+//  a grid of a few device pixels per cell, split over threads, and each
+//  cell is painted with the colour of its dominant class, brighter where
+//  the density is higher.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cpgplot.h"
+
+#define DENSITY_NCLASS 4        /* stellar, noise, non-stellar, other */
+#define DENSITY_NLEVEL 3
+#define DENSITY_CI 6            /* palette in colour indices 6-15, */
+#define DENSITY_NCI 10          /* their colours put back after drawing */
+#define DENSITY_MAXTHREAD 8
+
+struct density_job
+{
+    const float *x, *y;
+    const unsigned char *code;
+    const long *rows;
+    long first, last;
+    float x0, y0, cell;
+    int nbx, nby;
+    long *counts;
+};
+
+/* the class codes follow the colours of the ellipse overlay */
+int
+density_code(float classification)
+{
+    if (classification == -1 || classification == -2) return 0;
+    if (classification == 0) return 1;
+    if (classification == 1 || classification == 2) return 2;
+    return 3;
+}
+
+int
+density_shape_code(float ellipticity)
+{
+    if (ellipticity <= 0.2) return 0;
+    if (ellipticity > 0.4) return 1;
+    return 3;
+}
+
+static void *
+density_worker(void *arg)
+{
+    struct density_job *job = (struct density_job *)arg;
+    long k, i;
+    int bx, by;
+
+    for (k=job->first; k<job->last; k++) {
+        i = job->rows[k];
+        bx = (int)((job->x[i] - job->x0) / job->cell);
+        by = (int)((job->y[i] - job->y0) / job->cell);
+        if (bx < 0 || bx >= job->nbx || by < 0 || by >= job->nby)
+            continue;
+        job->counts[((long)by*job->nbx + bx)*DENSITY_NCLASS + job->code[k]]++;
+    }
+
+    return NULL;
+}
+
+/* Counts the n sources x[rows[k]], y[rows[k]] of class code[k] in cells of
+ * the given size from (x0, y0). Returns nbx*nby*DENSITY_NCLASS counts. */
+long *
+density_bin(const float *x, const float *y, const unsigned char *code, const long *rows,
+            long n, float x0, float y0, float cell, int nbx, int nby)
+{
+    struct density_job job[DENSITY_MAXTHREAD];
+    pthread_t thread[DENSITY_MAXTHREAD];
+    long ncount = (long)nbx * nby * DENSITY_NCLASS, i;
+    long *counts;
+    int t, nthread;
+
+    nthread = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthread > DENSITY_MAXTHREAD) nthread = DENSITY_MAXTHREAD;
+    if (nthread < 1 || n < 65536) nthread = 1;
+
+    counts = (long *) calloc(ncount, sizeof(long));
+    if (!counts)
+        return NULL;
+
+    /* every thread fills a private grid, summed at the end */
+    for (t=0; t<nthread; t++) {
+        job[t].x = x;
+        job[t].y = y;
+        job[t].code = code;
+        job[t].rows = rows;
+        job[t].first = n * t / nthread;
+        job[t].last = n * (t+1) / nthread;
+        job[t].x0 = x0;
+        job[t].y0 = y0;
+        job[t].cell = cell;
+        job[t].nbx = nbx;
+        job[t].nby = nby;
+        job[t].counts = t ? (long *) calloc(ncount, sizeof(long)) : counts;
+        if (!job[t].counts) {
+            nthread = t;
+            break;
+        }
+    }
+    if (nthread == 0) {
+        free(counts);
+        return NULL;
+    }
+
+    for (t=1; t<nthread; t++)
+        pthread_create(&thread[t], NULL, density_worker, &job[t]);
+    density_worker(&job[0]);
+
+    for (t=1; t<nthread; t++) {
+        pthread_join(thread[t], NULL);
+        for (i=0; i<ncount; i++)
+            counts[i] += job[t].counts[i];
+        free(job[t].counts);
+    }
+
+    return counts;
+}
+
+/* Paints the non-empty cells, with cell (0,0) starting at (x0, y0) in the
+ * current window. */
+void
+density_draw(const long *counts, int nbx, int nby, float x0, float y0, float cell)
+{
+    static const float rgb[DENSITY_NCLASS-1][3] = {
+        {0.3, 0.5, 1.0}, {1.0, 0.3, 0.3}, {0.3, 1.0, 0.3}
+    };
+    const long *c;
+    long total, best, peak = 1;
+    int bx, by, k, l, dominant, ci;
+    float f, lpeak, saved[DENSITY_NCI][3];
+
+    /* the named colours -k and the ellipses use live here too */
+    for (k=0; k<DENSITY_NCI; k++)
+        cpgqcr(DENSITY_CI + k, &saved[k][0], &saved[k][1], &saved[k][2]);
+
+    /* three levels for each class, a single grey for the rest */
+    for (k=0; k<DENSITY_NCLASS-1; k++)
+        for (l=0; l<DENSITY_NLEVEL; l++) {
+            f = (l + 1.0) / DENSITY_NLEVEL;
+            cpgscr(DENSITY_CI + k*DENSITY_NLEVEL + l, f*rgb[k][0], f*rgb[k][1], f*rgb[k][2]);
+        }
+    cpgscr(DENSITY_CI + (DENSITY_NCLASS-1)*DENSITY_NLEVEL, 0.7, 0.7, 0.7);
+
+    for (k=0; k<nbx*nby; k++) {
+        c = counts + (long)k*DENSITY_NCLASS;
+        total = c[0] + c[1] + c[2] + c[3];
+        if (total > peak) peak = total;
+    }
+    lpeak = log((float)peak + 1.0);
+
+    cpgbbuf();
+    cpgsfs(1);
+    for (by=0; by<nby; by++) {
+        for (bx=0; bx<nbx; bx++) {
+            c = counts + ((long)by*nbx + bx)*DENSITY_NCLASS;
+            total = 0;
+            best = -1;
+            dominant = 0;
+            for (k=0; k<DENSITY_NCLASS; k++) {
+                total += c[k];
+                if (c[k] > best) {
+                    best = c[k];
+                    dominant = k;
+                }
+            }
+            if (!total)
+                continue;
+
+            /* brightness on a log scale of the densest cell */
+            l = (int)(DENSITY_NLEVEL * log((float)total + 1.0) / lpeak);
+            if (l >= DENSITY_NLEVEL) l = DENSITY_NLEVEL-1;
+            ci = DENSITY_CI + dominant*DENSITY_NLEVEL;
+            if (dominant < DENSITY_NCLASS-1) ci += l;
+            cpgsci(ci);
+            cpgrect(x0 + bx*cell, x0 + (bx+1)*cell, y0 + by*cell, y0 + (by+1)*cell);
+        }
+    }
+    cpgebuf();
+
+    for (k=0; k<DENSITY_NCI; k++)
+        cpgscr(DENSITY_CI + k, saved[k][0], saved[k][1], saved[k][2]);
+}
@@ -0,0 +1,82 @@
+//
+//  ellipse.c
+//  imagepreview
+//
+//  Polygon vertices for catalogue ellipses. The unit circle is tabulated
+//  once for a handful of vertex counts, so each source costs one sin/cos
+//  pair for its position angle and a multiply-add loop over the table.
+//  The table is made once whichever thread asks first, so the daemon's
+//  workers can share it.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <pthread.h>
+
+#define ELLIPSE_MAXVERT 60
+#define ELLIPSE_NLEVEL 6
+
+static const int nvert[ELLIPSE_NLEVEL] = {8, 12, 16, 24, 36, ELLIPSE_MAXVERT};
+static int offset[ELLIPSE_NLEVEL];
+static float ctab[8+12+16+24+36+ELLIPSE_MAXVERT];
+static float stab[8+12+16+24+36+ELLIPSE_MAXVERT];
+static pthread_once_t ready = PTHREAD_ONCE_INIT;
+
+static void
+ellipse_init(void)
+{
+    int k, j, o = 0;
+
+    for (k=0; k<ELLIPSE_NLEVEL; k++) {
+        offset[k] = o;
+        for (j=0; j<nvert[k]; j++, o++) {
+            ctab[o] = cos(2.0*M_PI*j/nvert[k]);
+            stab[o] = sin(2.0*M_PI*j/nvert[k]);
+        }
+    }
+}
+
+/* Fills xe/ye (room for ELLIPSE_MAXVERT+1 points) with a closed polygon for
+ * the ellipse of semi-axes a, b at position angle pa (degrees) centred on
+ * (xc, yc), and returns the number of points. devpix is the size of one
+ * device pixel in world units: the vertex count is the smallest that keeps
+ * the chord error under half a device pixel, and 0 is returned when the
+ * ellipse is below one device pixel so the caller can plot a dot instead. */
+int
+ellipse_vertices(float xc, float yc, float a, float b, float pa, float devpix,
+                 float *restrict xe, float *restrict ye)
+{
+    const float *restrict c, *restrict s;
+    float rdev, ca, sa, ax, ay, bx, by;
+    int j, k, n;
+
+    pthread_once(&ready, ellipse_init);
+
+    rdev = fabsf(a) / devpix;
+    if (rdev < 1.0f)
+        return 0;
+
+    /* sagitta r(1 - cos(pi/n)) < 0.5 pixel  <=>  n > pi sqrt(r) */
+    for (k=0; k<ELLIPSE_NLEVEL-1 && nvert[k] < M_PI*sqrtf(rdev); k++);
+    n = nvert[k];
+    c = ctab + offset[k];
+    s = stab + offset[k];
+
+    pa *= (float)(M_PI/180.0);
+    ca = cosf(pa);
+    sa = sinf(pa);
+    ax = a*ca;
+    ay = a*sa;
+    bx = -b*sa;
+    by = b*ca;
+
+    for (j=0; j<n; j++) {
+        xe[j] = xc + ax*c[j] + bx*s[j];
+        ye[j] = yc + ay*c[j] + by*s[j];
+    }
+    xe[n] = xe[0];
+    ye[n] = ye[0];
+
+    return n+1;
+}
@@ -0,0 +1,549 @@
+//
+//  filter.c
+//  imagepreview
+//
+//  Row filters and colour rules over catalogue columns, e.g.
+//
+//      classification==-1 && aper_flux_3>1000
+//      classification==-1:blue; classification==1:green
+//
+//  An expression is compiled once into a postfix program. It is run one
+//  operator at a time over whole blocks of rows, so every step is a
+//  simple loop over arrays that the compiler can vectorize.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "fitsio.h"
+
+#define FILTER_BLOCK 8192       /* rows evaluated at a time */
+#define FILTER_MAXOP 256
+#define FILTER_MAXSTACK 32
+#define FILTER_MAXCOL 16
+#define FILTER_MAXRULE 16
+
+typedef struct cat_reader CAT_READER;
+int cat_column(CAT_READER *cat, char *name);
+int cat_has_column(CAT_READER *cat, int slot);
+int cat_read(CAT_READER *cat, int slot, long firstrow, long nrows, float *dest, int *status);
+
+enum filter_op {
+    OP_COL, OP_CONST, OP_NEG, OP_NOT,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR
+};
+
+struct filter_insn
+{
+    enum filter_op op;
+    int arg;                    /* column of OP_COL */
+    float value;                /* constant of OP_CONST */
+};
+
+struct row_filter
+{
+    struct filter_insn code[FILTER_MAXOP];
+    int ncode, depth;
+
+    int ncol;
+    char name[FILTER_MAXCOL][FLEN_VALUE];
+    int slot[FILTER_MAXCOL];    /* catalogue reader slots */
+
+    float *column[FILTER_MAXCOL];
+    float *stack[FILTER_MAXSTACK];
+    float *spare;               /* swapped in so no loop writes its input */
+};
+
+typedef struct row_filter ROW_FILTER;
+
+struct colour_rules
+{
+    int nrule;
+    ROW_FILTER *rule[FILTER_MAXRULE];
+    int ci[FILTER_MAXRULE];
+    unsigned char *mask;
+};
+
+typedef struct colour_rules COLOUR_RULES;
+
+/* recursive descent parser state */
+struct filter_parse
+{
+    const char *p;
+    ROW_FILTER *f;
+    CAT_READER *cat;
+    int sp;
+    char *errmsg;
+};
+
+static int parse_or(struct filter_parse *ps);
+
+static int
+parse_error(struct filter_parse *ps, const char *what)
+{
+    if (ps->errmsg && !ps->errmsg[0])
+        sprintf(ps->errmsg, "%s at '%.20s'", what, ps->p);
+    return -1;
+}
+
+static void
+skip_space(struct filter_parse *ps)
+{
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+}
+
+static int
+accept(struct filter_parse *ps, const char *tok)
+{
+    size_t n = strlen(tok);
+
+    skip_space(ps);
+    if (strncmp(ps->p, tok, n))
+        return 0;
+    /* '<' must not take the first half of '<=' */
+    if (n == 1 && (tok[0] == '<' || tok[0] == '>' || tok[0] == '!') && ps->p[1] == '=')
+        return 0;
+    ps->p += n;
+    return 1;
+}
+
+static int
+emit(struct filter_parse *ps, enum filter_op op, int arg, float value)
+{
+    ROW_FILTER *f = ps->f;
+
+    if (f->ncode == FILTER_MAXOP)
+        return parse_error(ps, "expression too long");
+
+    f->code[f->ncode].op = op;
+    f->code[f->ncode].arg = arg;
+    f->code[f->ncode].value = value;
+    f->ncode++;
+
+    /* track the stack depth the program will need */
+    if (op == OP_COL || op == OP_CONST) {
+        if (++ps->sp > f->depth) f->depth = ps->sp;
+        if (f->depth > FILTER_MAXSTACK)
+            return parse_error(ps, "expression too deep");
+    } else if (op != OP_NEG && op != OP_NOT) {
+        ps->sp--;
+    }
+    return 0;
+}
+
+static int
+parse_column(struct filter_parse *ps)
+{
+    ROW_FILTER *f = ps->f;
+    char name[FLEN_VALUE];
+    int n = 0, k;
+
+    while ((isalnum((unsigned char)*ps->p) || *ps->p == '_') && n < FLEN_VALUE-1)
+        name[n++] = *ps->p++;
+    name[n] = '\0';
+
+    for (k=0; k<f->ncol; k++)
+        if (!strcasecmp(f->name[k], name))
+            return emit(ps, OP_COL, k, 0.0);
+
+    if (f->ncol == FILTER_MAXCOL)
+        return parse_error(ps, "too many columns");
+
+    strcpy(f->name[f->ncol], name);
+    f->slot[f->ncol] = cat_column(ps->cat, name);
+    if (f->slot[f->ncol] < 0)
+        return parse_error(ps, "too many catalogue columns");
+    f->ncol++;
+
+    return emit(ps, OP_COL, f->ncol-1, 0.0);
+}
+
+static int
+parse_primary(struct filter_parse *ps)
+{
+    char *end;
+    double value;
+
+    skip_space(ps);
+    if (accept(ps, "(")) {
+        if (parse_or(ps)) return -1;
+        if (!accept(ps, ")")) return parse_error(ps, "missing ')'");
+        return 0;
+    }
+    if (isalpha((unsigned char)*ps->p) || *ps->p == '_')
+        return parse_column(ps);
+
+    value = strtod(ps->p, &end);
+    if (end == ps->p)
+        return parse_error(ps, "syntax error");
+    ps->p = end;
+
+    return emit(ps, OP_CONST, 0, (float)value);
+}
+
+static int
+parse_unary(struct filter_parse *ps)
+{
+    if (accept(ps, "-")) {
+        if (parse_unary(ps)) return -1;
+        return emit(ps, OP_NEG, 0, 0.0);
+    }
+    if (accept(ps, "!")) {
+        if (parse_unary(ps)) return -1;
+        return emit(ps, OP_NOT, 0, 0.0);
+    }
+    return parse_primary(ps);
+}
+
+static int
+parse_product(struct filter_parse *ps)
+{
+    enum filter_op op;
+
+    if (parse_unary(ps)) return -1;
+    for (;;) {
+        if (accept(ps, "*")) op = OP_MUL;
+        else if (accept(ps, "/")) op = OP_DIV;
+        else return 0;
+        if (parse_unary(ps) || emit(ps, op, 0, 0.0)) return -1;
+    }
+}
+
+static int
+parse_sum(struct filter_parse *ps)
+{
+    enum filter_op op;
+
+    if (parse_product(ps)) return -1;
+    for (;;) {
+        if (accept(ps, "+")) op = OP_ADD;
+        else if (accept(ps, "-")) op = OP_SUB;
+        else return 0;
+        if (parse_product(ps) || emit(ps, op, 0, 0.0)) return -1;
+    }
+}
+
+static int
+parse_compare(struct filter_parse *ps)
+{
+    enum filter_op op;
+
+    if (parse_sum(ps)) return -1;
+    if (accept(ps, "==")) op = OP_EQ;
+    else if (accept(ps, "!=")) op = OP_NE;
+    else if (accept(ps, "<=")) op = OP_LE;
+    else if (accept(ps, ">=")) op = OP_GE;
+    else if (accept(ps, "<")) op = OP_LT;
+    else if (accept(ps, ">")) op = OP_GT;
+    else return 0;
+    if (parse_sum(ps)) return -1;
+    return emit(ps, op, 0, 0.0);
+}
+
+static int
+parse_and(struct filter_parse *ps)
+{
+    if (parse_compare(ps)) return -1;
+    while (accept(ps, "&&"))
+        if (parse_compare(ps) || emit(ps, OP_AND, 0, 0.0)) return -1;
+    return 0;
+}
+
+static int
+parse_or(struct filter_parse *ps)
+{
+    if (parse_and(ps)) return -1;
+    while (accept(ps, "||"))
+        if (parse_and(ps) || emit(ps, OP_OR, 0, 0.0)) return -1;
+    return 0;
+}
+
+void
+filter_free(ROW_FILTER *f)
+{
+    int k;
+
+    if (!f)
+        return;
+    for (k=0; k<FILTER_MAXCOL; k++)
+        free(f->column[k]);
+    for (k=0; k<FILTER_MAXSTACK; k++)
+        free(f->stack[k]);
+    free(f->spare);
+    free(f);
+}
+
+/* Compiles expr against the columns of cat. On a syntax error NULL is
+ * returned and the reason written to errmsg. */
+ROW_FILTER *
+filter_compile(const char *expr, CAT_READER *cat, char *errmsg)
+{
+    struct filter_parse ps;
+    ROW_FILTER *f;
+    int k;
+
+    if (errmsg) errmsg[0] = '\0';
+
+    f = malloc(sizeof(ROW_FILTER));
+    if (!f)
+        return NULL;
+    memset(f, 0, sizeof(ROW_FILTER));
+
+    ps.p = expr;
+    ps.f = f;
+    ps.cat = cat;
+    ps.sp = 0;
+    ps.errmsg = errmsg;
+
+    if (parse_or(&ps)) {
+        filter_free(f);
+        return NULL;
+    }
+    skip_space(&ps);
+    if (*ps.p) {
+        parse_error(&ps, "unexpected text");
+        filter_free(f);
+        return NULL;
+    }
+
+    for (k=0; k<f->ncol; k++)
+        f->column[k] = (float *) malloc(FILTER_BLOCK * sizeof(float));
+    for (k=0; k<f->depth; k++)
+        f->stack[k] = (float *) malloc(FILTER_BLOCK * sizeof(float));
+    f->spare = (float *) malloc(FILTER_BLOCK * sizeof(float));
+    if (!f->spare) { filter_free(f); return NULL; }
+    for (k=0; k<f->ncol; k++)
+        if (!f->column[k]) { filter_free(f); return NULL; }
+    for (k=0; k<f->depth; k++)
+        if (!f->stack[k]) { filter_free(f); return NULL; }
+
+    return f;
+}
+
+/* output buffer for an operator replacing stack slot sp: the slot's own
+ * buffer unless it holds an operand, in which case the spare one */
+static float *
+filter_output(ROW_FILTER *f, int sp, const float *a, const float *b)
+{
+    float *o = f->stack[sp];
+
+    if (o == a || o == b) {
+        f->stack[sp] = f->spare;
+        f->spare = o;
+        o = f->stack[sp];
+    }
+    return o;
+}
+
+/* runs the program over n <= FILTER_BLOCK rows already in the buffers */
+static void
+filter_run(ROW_FILTER *f, long n, unsigned char *restrict mask)
+{
+    const float *val[FILTER_MAXSTACK] = {NULL};
+    const float *restrict a, *restrict b;
+    float *restrict o;
+    float c;
+    int pc, sp = 0;
+    long i;
+
+    for (pc=0; pc<f->ncode; pc++) {
+        switch (f->code[pc].op) {
+            case OP_COL:
+                val[sp++] = f->column[f->code[pc].arg];
+                continue;
+            case OP_CONST:
+                o = f->stack[sp];
+                c = f->code[pc].value;
+                for (i=0; i<n; i++) o[i] = c;
+                val[sp++] = o;
+                continue;
+            case OP_NEG:
+            case OP_NOT:
+                a = val[sp-1];
+                o = filter_output(f, sp-1, a, NULL);
+                if (f->code[pc].op == OP_NEG)
+                    for (i=0; i<n; i++) o[i] = -a[i];
+                else
+                    for (i=0; i<n; i++) o[i] = (a[i] == 0.0f);
+                val[sp-1] = o;
+                continue;
+            default:
+                break;
+        }
+
+        /* binary operators replace the left operand's stack slot */
+        a = val[sp-2];
+        b = val[sp-1];
+        o = filter_output(f, sp-2, a, b);
+        switch (f->code[pc].op) {
+            case OP_ADD: for (i=0; i<n; i++) o[i] = a[i] + b[i]; break;
+            case OP_SUB: for (i=0; i<n; i++) o[i] = a[i] - b[i]; break;
+            case OP_MUL: for (i=0; i<n; i++) o[i] = a[i] * b[i]; break;
+            case OP_DIV: for (i=0; i<n; i++) o[i] = a[i] / b[i]; break;
+            case OP_LT:  for (i=0; i<n; i++) o[i] = (a[i] < b[i]); break;
+            case OP_LE:  for (i=0; i<n; i++) o[i] = (a[i] <= b[i]); break;
+            case OP_GT:  for (i=0; i<n; i++) o[i] = (a[i] > b[i]); break;
+            case OP_GE:  for (i=0; i<n; i++) o[i] = (a[i] >= b[i]); break;
+            case OP_EQ:  for (i=0; i<n; i++) o[i] = (a[i] == b[i]); break;
+            case OP_NE:  for (i=0; i<n; i++) o[i] = (a[i] != b[i]); break;
+            case OP_AND: for (i=0; i<n; i++) o[i] = (a[i] != 0.0f) & (b[i] != 0.0f); break;
+            case OP_OR:  for (i=0; i<n; i++) o[i] = (a[i] != 0.0f) | (b[i] != 0.0f); break;
+            default: break;
+        }
+        val[sp-2] = o;
+        sp--;
+    }
+
+    a = val[0];
+    for (i=0; i<n; i++) mask[i] = (a[i] != 0.0f);
+}
+
+/* Sets mask[i] for each of the n rows from firstrow (1-based) that passes
+ * the filter. Only the columns named in the expression are read. */
+int
+filter_eval(ROW_FILTER *f, CAT_READER *cat, long firstrow, long n, unsigned char *mask, int *status)
+{
+    long done, m;
+    int k;
+
+    if (*status)
+        return *status;
+
+    for (k=0; k<f->ncol; k++) {
+        if (!cat_has_column(cat, f->slot[k])) {
+            fprintf(stderr, "No column %s in the catalogue\n", f->name[k]);
+            return *status = COL_NOT_FOUND;
+        }
+    }
+
+    for (done=0; done<n; done+=m) {
+        m = n - done;
+        if (m > FILTER_BLOCK) m = FILTER_BLOCK;
+        for (k=0; k<f->ncol; k++)
+            if (cat_read(cat, f->slot[k], firstrow+done, m, f->column[k], status))
+                return *status;
+        filter_run(f, m, mask+done);
+    }
+
+    return *status;
+}
+
+static int
+colour_index(const char *s)
+{
+    static const char *names[] = {"black", "white", "red", "green", "blue",
+                                  "cyan", "magenta", "yellow", "orange", NULL};
+    char *end;
+    int k, ci;
+
+    while (isspace((unsigned char)*s)) s++;
+    for (k=0; names[k]; k++)
+        if (!strncasecmp(s, names[k], strlen(names[k])))
+            return k;
+
+    ci = (int)strtol(s, &end, 10);
+    return (end == s) ? -1 : ci;
+}
+
+void
+rules_free(COLOUR_RULES *r)
+{
+    int k;
+
+    if (!r)
+        return;
+    for (k=0; k<r->nrule; k++)
+        filter_free(r->rule[k]);
+    free(r->mask);
+    free(r);
+}
+
+/* Compiles "expr:colour; expr:colour; ..." where colour is a PGPLOT colour
+ * index or one of its standard colour names. */
+COLOUR_RULES *
+rules_compile(const char *spec, CAT_READER *cat, char *errmsg)
+{
+    COLOUR_RULES *r;
+    char rule[1024], *colon, *semi;
+    const char *p = spec;
+    size_t len;
+
+    if (errmsg) errmsg[0] = '\0';
+
+    r = malloc(sizeof(COLOUR_RULES));
+    if (!r)
+        return NULL;
+    memset(r, 0, sizeof(COLOUR_RULES));
+    r->mask = (unsigned char *) malloc(FILTER_BLOCK);
+
+    while (*p && r->mask) {
+        semi = strchr(p, ';');
+        len = semi ? (size_t)(semi - p) : strlen(p);
+        if (len >= sizeof(rule)) len = sizeof(rule)-1;
+        memcpy(rule, p, len);
+        rule[len] = '\0';
+        p += semi ? len+1 : len;
+
+        if (!(colon = strrchr(rule, ':'))) {
+            if (strspn(rule, " \t") == strlen(rule)) continue;
+            if (errmsg) sprintf(errmsg, "no colour in rule '%.40s'", rule);
+            rules_free(r);
+            return NULL;
+        }
+        *colon = '\0';
+
+        if (r->nrule == FILTER_MAXRULE) {
+            if (errmsg) sprintf(errmsg, "too many colour rules");
+            rules_free(r);
+            return NULL;
+        }
+        r->ci[r->nrule] = colour_index(colon+1);
+        if (r->ci[r->nrule] < 0) {
+            if (errmsg) sprintf(errmsg, "unknown colour '%.20s'", colon+1);
+            rules_free(r);
+            return NULL;
+        }
+        if (!(r->rule[r->nrule] = filter_compile(rule, cat, errmsg))) {
+            rules_free(r);
+            return NULL;
+        }
+        r->nrule++;
+    }
+
+    if (!r->mask) {
+        rules_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Sets ci[i] for n rows from firstrow to the colour of the first rule each
+ * row matches, or to defci when it matches none. */
+int
+rules_eval(COLOUR_RULES *r, CAT_READER *cat, long firstrow, long n, int defci, int *ci, int *status)
+{
+    long done, m, i;
+    int k;
+
+    for (i=0; i<n; i++) ci[i] = -1;
+
+    for (done=0; done<n; done+=m) {
+        m = n - done;
+        if (m > FILTER_BLOCK) m = FILTER_BLOCK;
+        for (k=0; k<r->nrule; k++) {
+            if (filter_eval(r->rule[k], cat, firstrow+done, m, r->mask, status))
+                return *status;
+            for (i=0; i<m; i++)
+                if (ci[done+i] < 0 && r->mask[i]) ci[done+i] = r->ci[k];
+        }
+    }
+    for (i=0; i<n; i++)
+        if (ci[i] < 0) ci[i] = defci;
+
+    return *status;
+}
@@ -40,7 +40,7 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
- * This example requires libcurl 7.9.7 or later.
+ * This example requires libcurl 7.28.0 or later (curl_multi_wait).
  */
 
 #include <stdio.h>
@@ -49,6 +49,7 @@
 #  include <sys/time.h>
 #endif
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include <curl/curl.h>
@@ -64,9 +65,20 @@ struct fcurl_data
     } handle;                   /* handle */
     
     char *buffer;               /* buffer to store cached data*/
-    int buffer_len;             /* currently allocated buffers length */
-    int buffer_pos;             /* end of data in buffer*/
+    size_t buffer_len;          /* currently allocated buffers length */
+    size_t buffer_start;        /* start of unread data in buffer */
+    size_t buffer_pos;          /* end of data in buffer*/
+    size_t buffer_scan;         /* no newline in buffer before this */
     int still_running;          /* Is background url fetch still in progress */
+    
+    char *url;                  /* for the messages */
+    CURLcode result;            /* of the finished transfer */
+    size_t received;            /* bytes delivered by the transfer */
+    int attempts;               /* retries made so far */
+    double started;             /* time of the first attempt */
+    double retry_at;            /* when to try again, 0 if not waiting */
+    double stalled;             /* time spent waiting with nothing arriving */
+    struct fcurl_data *next;    /* list of open transfers */
 };
 
 typedef struct fcurl_data URL_FILE;
@@ -77,11 +89,277 @@ int url_fclose(URL_FILE *file);
 int url_feof(URL_FILE *file);
 size_t url_fread(void *ptr, size_t size, size_t nmemb, URL_FILE *file);
 char * url_fgets(char *ptr, int size, URL_FILE *file);
+char * url_fgetline(URL_FILE *file, size_t *len);
+char * url_fpeek(URL_FILE *file, size_t *len, int *last);
+void url_fskip(URL_FILE *file, size_t n);
 void url_rewind(URL_FILE *file);
+int url_set_timeouts(const char *spec);
+void url_set_retries(int retries);
+int url_wait(int timeout_ms);
+int url_ready(URL_FILE *file);
+int url_ferror(URL_FILE *file);
+void url_cleanup(void);
 
 /* we use a global one for convenience */
 CURLM *multi_handle;
 
+/* transfers on the multi handle, to match finished ones and restart retries */
+static URL_FILE *transfers;
+
+/* easy handles of closed files, kept for the next url_fopen, and the DNS
+ * cache, TLS sessions and open connections they all share, so that a run
+ * of queries to one server pays for the lookup and handshake once */
+#define POOL_MAX 16
+
+static CURL *pool[POOL_MAX];
+static int npool;
+static CURLSH *share;
+
+/* transfer limits: connect and total timeouts and the time below
+ * LOW_SPEED_LIMIT bytes per second after which a transfer is dropped, all in
+ * seconds, 0 for none; then the retries on failure, each after twice the
+ * wait of the one before */
+#define LOW_SPEED_LIMIT 100
+#define RETRY_WAIT 0.5
+
+static struct {
+    int read_env;
+    double connect, total, lowspeed;
+    int retries;
+} limits = { 0, 10, 300, 30, 2 };
+
+static double
+now(void)
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void
+read_env(void)
+{
+    char *env;
+    
+    if(limits.read_env)
+        return;
+    limits.read_env = 1;
+    
+    if((env = getenv("IMAGEPREVIEW_TIMEOUT")))
+        url_set_timeouts(env);
+    if((env = getenv("IMAGEPREVIEW_RETRIES")))
+        url_set_retries(atoi(env));
+}
+
+/* "connect,total,lowspeed" in seconds; fields left empty are unchanged.
+ * Set from the command line these override the environment. */
+int
+url_set_timeouts(const char *spec)
+{
+    double v[3] = { limits.connect, limits.total, limits.lowspeed };
+    const char *p = spec;
+    char *end;
+    int k;
+    
+    read_env();
+    for(k=0; k<3 && *p; k++)
+    {
+        if(*p != ',')
+        {
+            v[k] = strtod(p, &end);
+            if(end == p || v[k] < 0)
+                return -1;
+            p = end;
+        }
+        if(*p == ',')
+            p++;
+        else if(*p)
+            return -1;
+    }
+    limits.connect = v[0];
+    limits.total = v[1];
+    limits.lowspeed = v[2];
+    return 0;
+}
+
+void
+url_set_retries(int retries)
+{
+    read_env();
+    limits.retries = retries < 0 ? 0 : retries;
+}
+
+static void
+set_limits(CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)(limits.connect * 1000));
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)(limits.total * 1000));
+    if(limits.lowspeed > 0)
+    {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)LOW_SPEED_LIMIT);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)(limits.lowspeed + 0.5));
+    }
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+}
+
+/* a handle from the pool, or a new one, set to share with the others */
+static CURL *
+get_handle(void)
+{
+    CURL *curl;
+    
+    if(!share && (share = curl_share_init()))
+    {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+    
+    if(npool)
+    {
+        curl = pool[--npool];
+        curl_easy_reset(curl);
+    }
+    else if(!(curl = curl_easy_init()))
+        return NULL;
+    
+    if(share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    /* gzip or deflate if the server will; curl inflates before write_callback */
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    return curl;
+}
+
+/* failures worth another go; not when data was already handed out */
+static int
+retryable(URL_FILE *file, CURLcode result)
+{
+    long code = 0;
+    
+    if(file->received || file->attempts >= limits.retries)
+        return 0;
+    
+    switch(result)
+    {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+            return 1;
+        case CURLE_HTTP_RETURNED_ERROR:
+            curl_easy_getinfo(file->handle.curl, CURLINFO_RESPONSE_CODE, &code);
+            return code >= 500;
+        default:
+            return 0;
+    }
+}
+
+static void
+transfer_done(URL_FILE *file, CURLcode result)
+{
+    double wait;
+    
+    curl_multi_remove_handle(multi_handle, file->handle.curl);
+    
+    if(result != CURLE_OK && retryable(file, result))
+    {
+        wait = RETRY_WAIT * (1 << file->attempts++);
+        file->retry_at = now() + wait;
+        fprintf(stderr, "%s: %s, retrying in %.1f s\n", file->url,
+                curl_easy_strerror(result), wait);
+        return;
+    }
+    
+    file->still_running = 0;
+    file->result = result;
+    if(result != CURLE_OK)
+        fprintf(stderr, "%s: %s\n", file->url, curl_easy_strerror(result));
+    if(file->stalled >= 1.0)
+        fprintf(stderr, "%s: stalled for %.1f s of %.1f s\n", file->url,
+                file->stalled, now() - file->started);
+}
+
+/* hands the finished transfers to their files and puts the retries that
+ * are due back on the multi handle; returns the time to the next retry */
+static double
+check_transfers(void)
+{
+    CURLMsg *msg;
+    URL_FILE *file;
+    double t, next = -1;
+    int left;
+    
+    while((msg = curl_multi_info_read(multi_handle, &left)))
+    {
+        if(msg->msg != CURLMSG_DONE)
+            continue;
+        file = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&file);
+        if(file)
+            transfer_done(file, msg->data.result);
+    }
+    
+    t = now();
+    for(file = transfers; file; file = file->next)
+    {
+        if(!file->retry_at)
+            continue;
+        if(file->retry_at <= t)
+        {
+            file->retry_at = 0;
+            curl_multi_add_handle(multi_handle, file->handle.curl);
+        }
+        else if(next < 0 || file->retry_at - t < next)
+            next = file->retry_at - t;
+    }
+    
+    return next;
+}
+
+/* make room for size more bytes at the end of the buffer, keeping one spare
+ * byte for url_fgetline to terminate the last line with. Consumed data at the
+ * front is only moved out of the way once it is at least as large as what is
+ * left, and the buffer otherwise doubles, so every byte is copied a bounded
+ * number of times however the data is read */
+static int
+reserve_buffer(URL_FILE *file, size_t size)
+{
+    size_t used = file->buffer_pos - file->buffer_start;
+    size_t newlen;
+    char *newbuff;
+    
+    if(file->buffer_pos + size < file->buffer_len)
+        return 0;
+    
+    if(file->buffer_start >= used && used + size < file->buffer_len)
+    {
+        memmove(file->buffer, file->buffer + file->buffer_start, used);
+        file->buffer_scan -= file->buffer_start;
+        file->buffer_pos = used;
+        file->buffer_start = 0;
+        return 0;
+    }
+    
+    newlen = file->buffer_len ? file->buffer_len : 16384;
+    while(newlen <= file->buffer_pos + size)
+        newlen *= 2;
+    
+    newbuff=realloc(file->buffer,newlen);
+    if(newbuff==NULL)
+        return -1;
+    
+    file->buffer=newbuff;
+    file->buffer_len=newlen;
+    return 0;
+}
+
 /* curl calls this routine to get more data */
 static size_t
 write_callback(char *buffer,
@@ -89,123 +367,140 @@ write_callback(char *buffer,
                size_t nitems,
                void *userp)
 {
-    char *newbuff;
-    int rembuff;
-    
     URL_FILE *url = (URL_FILE *)userp;
     size *= nitems;
     
-    rembuff=url->buffer_len - url->buffer_pos; /* remaining space in buffer */
-    
-    if(size > rembuff)
+    if(reserve_buffer(url, size))
     {
-        /* not enough space in buffer */
-        newbuff=realloc(url->buffer,url->buffer_len + (size - rembuff));
-        if(newbuff==NULL)
-        {
-            fprintf(stderr,"callback buffer grow failed\n");
-            size=rembuff;
-        }
-        else
-        {
-            /* realloc suceeded increase buffer size*/
-            url->buffer_len+=size - rembuff;
-            url->buffer=newbuff;
-            
-            /*printf("Callback buffer grown to %d bytes\n",url->buffer_len);*/
-        }
+        fprintf(stderr,"callback buffer grow failed\n");
+        return 0;
     }
     
     memcpy(&url->buffer[url->buffer_pos], buffer, size);
     url->buffer_pos += size;
+    url->received += size;
     
     /*fprintf(stderr, "callback %d size bytes\n", size);*/
     
     return size;
 }
 
-/* use to attempt to fill the read buffer up to requested number of bytes */
+/* use to attempt to fill the read buffer up to requested number of bytes.
+ * Waits on the sockets of all the transfers, so the others keep going too,
+ * and never longer than a second at a time so retries start on time */
 static int
-fill_buffer(URL_FILE *file,int want,int waittime)
+fill_buffer(URL_FILE *file,size_t want,int waittime)
 {
-    fd_set fdread;
-    fd_set fdwrite;
-    fd_set fdexcep;
-    int maxfd;
-    struct timeval timeout;
-    int rc;
+    CURLMcode mc;
+    size_t received = 0;
+    double t0 = 0, next;
+    int running, numfds, timeout;
     
     /* only attempt to fill buffer if transactions still running and buffer
      * doesnt exceed required size already
      */
-    if((!file->still_running) || (file->buffer_pos > want))
+    if((!file->still_running) || (file->buffer_pos - file->buffer_start > want))
         return 0;
     
     /* attempt to fill buffer */
     do
     {
-        FD_ZERO(&fdread);
-        FD_ZERO(&fdwrite);
-        FD_ZERO(&fdexcep);
-        
-        /* set a suitable timeout to fail on */
-        timeout.tv_sec = 60; /* 1 minute */
-        timeout.tv_usec = 0;
+        mc = curl_multi_perform(multi_handle, &running);
         
-        /* get file descriptors from the transfers */
-        curl_multi_fdset(multi_handle, &fdread, &fdwrite, &fdexcep, &maxfd);
-        
-        /* In a real-world program you OF COURSE check the return code of the
-         function calls, *and* you make sure that maxfd is bigger than -1
-         so that the call to select() below makes sense! */
+        /* a wait after which nothing came in counts as stalled */
+        if(t0 && file->received == received)
+            file->stalled += now() - t0;
+        next = check_transfers();
+        if(mc != CURLM_OK)
+        {
+            fprintf(stderr, "%s: transfer failed (%d)\n", file->url, (int)mc);
+            file->still_running = 0;
+            break;
+        }
+        if(!file->still_running || file->buffer_pos - file->buffer_start >= want)
+            break;
         
-        rc = select(maxfd+1, &fdread, &fdwrite, &fdexcep, &timeout);
+        timeout = 1000;
+        if(next >= 0 && next*1000 < timeout)
+            timeout = (int)(next*1000) + 1;
         
-        switch(rc) {
-            case -1:
-                /* select error */
-                break;
-                
-            case 0:
-                break;
-                
-            default:
-                /* timeout or readable/writable sockets */
-                /* note we *could* be more efficient and not wait for
-                 * CURLM_CALL_MULTI_PERFORM to clear here and check it on re-entry
-                 * but that gets messy */
-                while(curl_multi_perform(multi_handle, &file->still_running) ==
-                      CURLM_CALL_MULTI_PERFORM);
-                
-                break;
-        }
-    } while(file->still_running && (file->buffer_pos < want));
+        received = file->received;
+        t0 = now();
+#if LIBCURL_VERSION_NUM >= 0x074200
+        mc = curl_multi_poll(multi_handle, NULL, 0, timeout, &numfds);
+#else
+        mc = curl_multi_wait(multi_handle, NULL, 0, timeout, &numfds);
+        /* nothing to wait on yet, e.g. while resolving: do not spin */
+        if(mc == CURLM_OK && !numfds)
+            usleep(20000);
+#endif
+    } while(file->still_running && (file->buffer_pos - file->buffer_start < want));
     return 1;
 }
 
+/* Moves all the transfers along, waiting up to timeout_ms for data on any
+ * of them first when timeout_ms is not 0. Returns how many are still going. */
+int
+url_wait(int timeout_ms)
+{
+    URL_FILE *file;
+    double next;
+    int running, numfds, n = 0;
+    
+    if(!multi_handle)
+        return 0;
+    
+    curl_multi_perform(multi_handle, &running);
+    next = check_transfers();
+    if(timeout_ms > 0 && (running || next >= 0))
+    {
+        if(next >= 0 && next*1000 < timeout_ms)
+            timeout_ms = (int)(next*1000) + 1;
+#if LIBCURL_VERSION_NUM >= 0x074200
+        curl_multi_poll(multi_handle, NULL, 0, timeout_ms, &numfds);
+#else
+        curl_multi_wait(multi_handle, NULL, 0, timeout_ms, &numfds);
+        if(!numfds)
+            usleep(20000);
+#endif
+        curl_multi_perform(multi_handle, &running);
+        check_transfers();
+    }
+    
+    for(file = transfers; file; file = file->next)
+        n += file->still_running;
+    return n;
+}
+
+/* Whether url_fgetline can return without waiting on the network: a whole
+ * line is in the buffer, or the transfer is over. */
+int
+url_ready(URL_FILE *file)
+{
+    if(file->type != CFTYPE_CURL || !file->still_running)
+        return 1;
+    
+    if(file->buffer_pos > file->buffer_scan &&
+       memchr(file->buffer + file->buffer_scan, '\n', file->buffer_pos - file->buffer_scan))
+        return 1;
+    file->buffer_scan = file->buffer_pos;
+    return 0;
+}
+
 /* use to remove want bytes from the front of a files buffer */
 static int
-use_buffer(URL_FILE *file,int want)
+use_buffer(URL_FILE *file,size_t want)
 {
-    /* sort out buffer */
-    if((file->buffer_pos - want) <=0)
+    file->buffer_start += want;
+    if(file->buffer_scan < file->buffer_start)
+        file->buffer_scan = file->buffer_start;
+    
+    /* empty - start again at the front, nothing to move */
+    if(file->buffer_start >= file->buffer_pos)
     {
-        /* ditch buffer - write will recreate */
-        if(file->buffer)
-            free(file->buffer);
-        
-        file->buffer=NULL;
+        file->buffer_start=0;
         file->buffer_pos=0;
-        file->buffer_len=0;
-    }
-    else
-    {
-        /* move rest down make it available for later */
-        memmove(file->buffer,
-                &file->buffer[want],
-                (file->buffer_pos - want));
-        
-        file->buffer_pos -= want;
+        file->buffer_scan=0;
     }
     return 0;
 }
@@ -219,6 +514,7 @@ url_fopen(const char *url,const char *operation)
      basicly use the real fopen() for standard files */
     
     URL_FILE *file;
+    int running;
     (void)operation;
     
     file = malloc(sizeof(URL_FILE));
@@ -234,34 +530,39 @@ url_fopen(const char *url,const char *operation)
     else
     {
         file->type = CFTYPE_CURL; /* marked as URL */
-        file->handle.curl = curl_easy_init();
+        if(!(file->handle.curl = get_handle()))
+        {
+            free(file);
+            return NULL;
+        }
+        file->url = strdup(url);
+        read_env();
         
         curl_easy_setopt(file->handle.curl, CURLOPT_URL, url);
         curl_easy_setopt(file->handle.curl, CURLOPT_WRITEDATA, file);
         curl_easy_setopt(file->handle.curl, CURLOPT_VERBOSE, 0L);
         curl_easy_setopt(file->handle.curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(file->handle.curl, CURLOPT_PRIVATE, (char *)file);
+        set_limits(file->handle.curl);
         
         if(!multi_handle)
             multi_handle = curl_multi_init();
         
         curl_multi_add_handle(multi_handle, file->handle.curl);
+        file->still_running = 1;
+        file->started = now();
+        file->next = transfers;
+        transfers = file;
         
         /* lets start the fetch */
-        while(curl_multi_perform(multi_handle, &file->still_running) ==
-              CURLM_CALL_MULTI_PERFORM );
+        curl_multi_perform(multi_handle, &running);
+        check_transfers();
         
-        if((file->buffer_pos == 0) && (!file->still_running))
+        if((file->buffer_pos == file->buffer_start) && (!file->still_running))
         {
-            /* if still_running is 0 now, we should return NULL */
-            
-            /* make sure the easy handle is not in the multi handle anymore */
-            curl_multi_remove_handle(multi_handle, file->handle.curl);
-            
-            /* cleanup */
-            curl_easy_cleanup(file->handle.curl);
-            
-            free(file);
-            
+            /* if the transfer is over already with nothing to show for it,
+             * we should return NULL */
+            url_fclose(file);
             file = NULL;
         }
     }
@@ -272,6 +573,7 @@ int
 url_fclose(URL_FILE *file)
 {
     int ret=0;/* default is good return */
+    URL_FILE **prev;
     
     switch(file->type)
     {
@@ -283,8 +585,19 @@ url_fclose(URL_FILE *file)
             /* make sure the easy handle is not in the multi handle anymore */
             curl_multi_remove_handle(multi_handle, file->handle.curl);
             
-            /* cleanup */
-            curl_easy_cleanup(file->handle.curl);
+            /* back to the pool, its connection left open for the next */
+            if(npool < POOL_MAX)
+                pool[npool++] = file->handle.curl;
+            else
+                curl_easy_cleanup(file->handle.curl);
+            
+            for(prev = &transfers; *prev; prev = &(*prev)->next)
+                if(*prev == file)
+                {
+                    *prev = file->next;
+                    break;
+                }
+            free(file->url);
             break;
             
         default: /* unknown or supported type - oh dear */
@@ -314,7 +627,7 @@ url_feof(URL_FILE *file)
             break;
             
         case CFTYPE_CURL:
-            if((file->buffer_pos == 0) && (!file->still_running))
+            if((file->buffer_pos == file->buffer_start) && (!file->still_running))
                 ret = 1;
             break;
         default: /* unknown or supported type - oh dear */
@@ -343,15 +656,15 @@ url_fread(void *ptr, size_t size, size_t nmemb, URL_FILE *file)
             
             /* check if theres data in the buffer - if not fill_buffer()
              * either errored or EOF */
-            if(!file->buffer_pos)
+            if(file->buffer_pos == file->buffer_start)
                 return 0;
             
             /* ensure only available data is considered */
-            if(file->buffer_pos < want)
-                want = file->buffer_pos;
+            if(file->buffer_pos - file->buffer_start < want)
+                want = file->buffer_pos - file->buffer_start;
             
             /* xfer data to caller */
-            memcpy(ptr, file->buffer, want);
+            memcpy(ptr, file->buffer + file->buffer_start, want);
             
             use_buffer(file,want);
             
@@ -373,8 +686,8 @@ url_fread(void *ptr, size_t size, size_t nmemb, URL_FILE *file)
 char *
 url_fgets(char *ptr, int size, URL_FILE *file)
 {
-    int want = size - 1;/* always need to leave room for zero termination */
-    int loop;
+    size_t want = size - 1;/* always need to leave room for zero termination */
+    char *nl;
     
     switch(file->type)
     {
@@ -387,26 +700,20 @@ url_fgets(char *ptr, int size, URL_FILE *file)
             
             /* check if theres data in the buffer - if not fill either errored or
              * EOF */
-            if(!file->buffer_pos)
+            if(file->buffer_pos == file->buffer_start)
                 return NULL;
             
             /* ensure only available data is considered */
-            if(file->buffer_pos < want)
-                want = file->buffer_pos;
+            if(file->buffer_pos - file->buffer_start < want)
+                want = file->buffer_pos - file->buffer_start;
             
             /*buffer contains data */
             /* look for newline or eof */
-            for(loop=0;loop < want;loop++)
-            {
-                if(file->buffer[loop] == '\n')
-                {
-                    want=loop+1;/* include newline */
-                    break;
-                }
-            }
+            if((nl = memchr(file->buffer + file->buffer_start, '\n', want)))
+                want = nl - (file->buffer + file->buffer_start) + 1;/* include newline */
             
             /* xfer data to caller */
-            memcpy(ptr, file->buffer, want);
+            memcpy(ptr, file->buffer + file->buffer_start, want);
             ptr[want]=0;/* allways null terminate */
             
             use_buffer(file,want);
@@ -423,6 +730,139 @@ url_fgets(char *ptr, int size, URL_FILE *file)
     return ptr;/*success */
 }
 
+/* Returns the next line, without its newline and zero terminated, in place in
+ * the files buffer: it stays valid until the next read from file. len, when
+ * given, is set to its length. Returns NULL at the end of the data. */
+char *
+url_fgetline(URL_FILE *file, size_t *len)
+{
+    char *line, *nl;
+    size_t n;
+    ssize_t got;
+    
+    switch(file->type)
+    {
+        case CFTYPE_FILE:
+            got = getline(&file->buffer, &file->buffer_len, file->handle.file);
+            if(got < 0)
+                return NULL;
+            n = got;
+            line = file->buffer;
+            if(n && line[n-1] == '\n')
+                line[--n] = 0;
+            break;
+            
+        case CFTYPE_CURL:
+            /* only the data that arrived since the last look is searched */
+            for(;;)
+            {
+                nl = NULL;
+                if(file->buffer_pos > file->buffer_scan)
+                    nl = memchr(file->buffer + file->buffer_scan, '\n',
+                                file->buffer_pos - file->buffer_scan);
+                if(nl || !file->still_running)
+                    break;
+                file->buffer_scan = file->buffer_pos;
+                fill_buffer(file, file->buffer_pos - file->buffer_start + 1, 1);
+            }
+            
+            if(file->buffer_pos == file->buffer_start)
+                return NULL;
+            
+            line = file->buffer + file->buffer_start;
+            if(nl)
+            {
+                n = nl - line;
+                *nl = 0;
+                use_buffer(file, n+1);
+            }
+            else
+            {
+                /* last line without a newline: the spare byte holds the 0 */
+                n = file->buffer_pos - file->buffer_start;
+                line[n] = 0;
+                use_buffer(file, n);
+            }
+            break;
+            
+        default: /* unknown or supported type - oh dear */
+            errno=EBADF;
+            return NULL;
+    }
+    
+    if(len)
+        *len = n;
+    return line;
+}
+
+/* Returns all the data buffered and not yet skipped, zero terminated, in place
+ * in the files buffer, without waiting: for a transfer still going len may be
+ * 0. last is set once no more will follow. The data stays until url_fskip
+ * drops it, so a parser can leave a token cut short by the end of what has
+ * arrived and find it whole, in one piece, next time. Returns NULL at the end
+ * of the data. */
+char *
+url_fpeek(URL_FILE *file, size_t *len, int *last)
+{
+    size_t got;
+    
+    switch(file->type)
+    {
+        case CFTYPE_FILE:
+            if(reserve_buffer(file, 65536))
+                return NULL;
+            got = fread(file->buffer + file->buffer_pos, 1,
+                        file->buffer_len - file->buffer_pos - 1, file->handle.file);
+            file->buffer_pos += got;
+            *last = feof(file->handle.file) || ferror(file->handle.file);
+            break;
+            
+        case CFTYPE_CURL:
+            *last = !file->still_running;
+            break;
+            
+        default: /* unknown or supported type - oh dear */
+            errno=EBADF;
+            return NULL;
+    }
+    
+    if(*last && file->buffer_pos == file->buffer_start)
+        return NULL;
+    
+    /* the spare byte reserve_buffer keeps holds the 0 */
+    if(file->buffer)
+        file->buffer[file->buffer_pos] = 0;
+    *len = file->buffer_pos - file->buffer_start;
+    return file->buffer ? file->buffer + file->buffer_start : "";
+}
+
+/* Drops n bytes returned by url_fpeek. */
+void
+url_fskip(URL_FILE *file, size_t n)
+{
+    if(n > file->buffer_pos - file->buffer_start)
+        n = file->buffer_pos - file->buffer_start;
+    use_buffer(file, n);
+}
+
+/* Whether the transfer failed, once url_feof says it is over. */
+int
+url_ferror(URL_FILE *file)
+{
+    switch(file->type)
+    {
+        case CFTYPE_FILE:
+            return ferror(file->handle.file);
+            
+        case CFTYPE_CURL:
+            return file->result != CURLE_OK;
+            
+        default: /* unknown or supported type - oh dear */
+            errno=EBADF;
+            return -1;
+    }
+}
+
 void
 url_rewind(URL_FILE *file)
 {
@@ -438,13 +878,21 @@ url_rewind(URL_FILE *file)
             
             /* restart */
             curl_multi_add_handle(multi_handle, file->handle.curl);
+            file->still_running = 1;
+            file->received = 0;
+            file->attempts = 0;
+            file->retry_at = 0;
+            file->stalled = 0;
+            file->started = now();
             
             /* ditch buffer - write will recreate - resets stream pos*/
             if(file->buffer)
                 free(file->buffer);
             
             file->buffer=NULL;
+            file->buffer_start=0;
             file->buffer_pos=0;
+            file->buffer_scan=0;
             file->buffer_len=0;
             
             break;
@@ -455,3 +903,20 @@ url_rewind(URL_FILE *file)
     }
     
 }
+
+/* Closes the pooled handles and their connections; call once every file is
+ * closed. url_fopen starts afresh after it. */
+void
+url_cleanup(void)
+{
+    while(npool)
+        curl_easy_cleanup(pool[--npool]);
+    
+    if(multi_handle)
+        curl_multi_cleanup(multi_handle);
+    multi_handle = NULL;
+    
+    if(share)
+        curl_share_cleanup(share);
+    share = NULL;
+}
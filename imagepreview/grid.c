@@ -0,0 +1,156 @@
+//
+//  grid.c
+//  imagepreview
+//
+//  Uniform grid index over catalogue positions, built once per HDU, so that
+//  only the sources falling in the displayed window are visited on a redraw.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct src_grid
+{
+    const float *x, *y;         /* positions, owned by the caller */
+    float x0, y0;               /* lower left corner of cell (0,0) */
+    float cell;                 /* cell size in pixels */
+    int nx, ny;
+    long *start;                /* nx*ny+1 offsets into index */
+    long *index;                /* source numbers, grouped by cell */
+};
+
+typedef struct src_grid SRC_GRID;
+
+static int
+grid_cell(float v, float v0, float cell, int nv)
+{
+    float k = (v - v0) / cell;
+
+    /* clamped before the conversion, which a far-off v would overflow */
+    if (!(k >= 0.0f)) return 0;
+    if (k >= nv) return nv-1;
+    return (int)k;
+}
+
+/* Counting sort of the n sources into cells of the given size, over no
+ * more than the nx by ny image: sources off it go in the edge cells.
+ * Sources with undefined or infinite positions are left out. */
+SRC_GRID *
+grid_build(const float *x, const float *y, long n, float cell, long nx, long ny)
+{
+    SRC_GRID *g;
+    float xmin, xmax, ymin, ymax;
+    long i, k, ncell, *fill;
+
+    g = malloc(sizeof(SRC_GRID));
+    if (!g)
+        return NULL;
+    memset(g, 0, sizeof(SRC_GRID));
+
+    xmin = ymin = HUGE_VALF;
+    xmax = ymax = -HUGE_VALF;
+    for (i=0; i<n; i++) {
+        if (!isfinite(x[i]) || !isfinite(y[i])) continue;
+        if (x[i] < xmin) xmin = x[i];
+        if (x[i] > xmax) xmax = x[i];
+        if (y[i] < ymin) ymin = y[i];
+        if (y[i] > ymax) ymax = y[i];
+    }
+    if (xmin > xmax || ymin > ymax)
+        xmin = xmax = ymin = ymax = 0.0;
+    /* a stray row far off the image would otherwise size the grid */
+    if (xmin < 0.0) xmin = 0.0;
+    if (ymin < 0.0) ymin = 0.0;
+    if (xmax > nx + 1.0) xmax = nx + 1.0;
+    if (ymax > ny + 1.0) ymax = ny + 1.0;
+    if (xmin > xmax) xmin = xmax;
+    if (ymin > ymax) ymin = ymax;
+
+    g->x = x;
+    g->y = y;
+    g->x0 = xmin;
+    g->y0 = ymin;
+    g->cell = cell;
+    g->nx = (int)((xmax - xmin) / cell) + 1;
+    g->ny = (int)((ymax - ymin) / cell) + 1;
+    ncell = (long)g->nx * g->ny;
+
+    g->start = (long *) calloc(ncell+1, sizeof(long));
+    g->index = (long *) malloc((n > 0 ? n : 1) * sizeof(long));
+    fill = (long *) malloc((ncell+1) * sizeof(long));
+    if (!g->start || !g->index || !fill) {
+        free(fill);
+        free(g->start);
+        free(g->index);
+        free(g);
+        return NULL;
+    }
+
+    for (i=0; i<n; i++) {
+        if (!isfinite(x[i]) || !isfinite(y[i])) continue;
+        k = (long)grid_cell(y[i], g->y0, cell, g->ny) * g->nx + grid_cell(x[i], g->x0, cell, g->nx);
+        g->start[k+1]++;
+    }
+    for (k=0; k<ncell; k++)
+        g->start[k+1] += g->start[k];
+
+    memcpy(fill, g->start, (ncell+1) * sizeof(long));
+    for (i=0; i<n; i++) {
+        if (!isfinite(x[i]) || !isfinite(y[i])) continue;
+        k = (long)grid_cell(y[i], g->y0, cell, g->ny) * g->nx + grid_cell(x[i], g->x0, cell, g->nx);
+        g->index[fill[k]++] = i;
+    }
+    free(fill);
+
+    return g;
+}
+
+/* Writes the numbers of the sources inside [x1,x2]x[y1,y2] to out, in
+ * increasing order within each cell, and returns how many there are. */
+long
+grid_query(SRC_GRID *g, float x1, float x2, float y1, float y2, long *out)
+{
+    int i, j, i1, i2, j1, j2;
+    long k, m, nout = 0;
+
+    if (x2 < g->x0 || y2 < g->y0 ||
+        x1 > g->x0 + g->nx * g->cell || y1 > g->y0 + g->ny * g->cell)
+        return 0;
+
+    i1 = grid_cell(x1, g->x0, g->cell, g->nx);
+    i2 = grid_cell(x2, g->x0, g->cell, g->nx);
+    j1 = grid_cell(y1, g->y0, g->cell, g->ny);
+    j2 = grid_cell(y2, g->y0, g->cell, g->ny);
+
+    for (j=j1; j<=j2; j++) {
+        for (i=i1; i<=i2; i++) {
+            k = (long)j * g->nx + i;
+            /* inner cells need no test on the individual sources */
+            if (i > i1 && i < i2 && j > j1 && j < j2) {
+                for (m=g->start[k]; m<g->start[k+1]; m++)
+                    out[nout++] = g->index[m];
+                continue;
+            }
+            for (m=g->start[k]; m<g->start[k+1]; m++) {
+                if (g->x[g->index[m]] >= x1 && g->x[g->index[m]] <= x2 &&
+                    g->y[g->index[m]] >= y1 && g->y[g->index[m]] <= y2)
+                    out[nout++] = g->index[m];
+            }
+        }
+    }
+
+    return nout;
+}
+
+void
+grid_free(SRC_GRID *g)
+{
+    if (!g)
+        return;
+    free(g->start);
+    free(g->index);
+    free(g);
+}
@@ -0,0 +1,194 @@
+//
+//  healpix.c
+//  imagepreview
+//
+//  Nested HEALPix pixel numbers, enough of them to partition reference
+//  sources into cells on disk: position to cell, cell centre, and the
+//  cells that a cone may touch.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdlib.h>
+
+#define D2R (M_PI/180.0)
+
+static const int jrll[12] = {2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4};
+static const int jpll[12] = {1, 3, 5, 7, 0, 2, 4, 6, 1, 3, 5, 7};
+
+/* spreads the bits of v to the even bit positions */
+static long
+spread_bits(long v)
+{
+    long r = 0;
+    int b;
+
+    for (b=0; b<30; b++)
+        r |= ((v >> b) & 1L) << (2*b);
+    return r;
+}
+
+static long
+compress_bits(long v)
+{
+    long r = 0;
+    int b;
+
+    for (b=0; b<30; b++)
+        r |= ((v >> (2*b)) & 1L) << b;
+    return r;
+}
+
+/* Cell of (ra, dec), in degrees, at order (nside = 2^order). */
+long
+hp_ang2pix(int order, double ra, double dec)
+{
+    long nside = 1L << order, ix, iy, face;
+    double z = sin(dec*D2R), za = fabs(z), tt, tp, tmp, temp1, temp2;
+    long jp, jm, ifp, ifm, ntt;
+
+    tt = fmod(ra, 360.0);
+    if (tt < 0) tt += 360.0;
+    tt /= 90.0;                                 /* in [0,4) */
+
+    if (za <= 2.0/3.0) {
+        /* equatorial region */
+        temp1 = nside*(0.5 + tt);
+        temp2 = nside*z*0.75;
+        jp = (long)(temp1 - temp2);
+        jm = (long)(temp1 + temp2);
+        ifp = jp >> order;
+        ifm = jm >> order;
+        if (ifp == ifm)
+            face = (ifp == 4) ? 4 : ifp + 4;
+        else if (ifp < ifm)
+            face = ifp;
+        else
+            face = ifm + 8;
+        ix = jm & (nside-1);
+        iy = nside - (jp & (nside-1)) - 1;
+    } else {
+        /* polar caps */
+        ntt = (long)tt;
+        if (ntt >= 4) ntt = 3;
+        tp = tt - ntt;
+        tmp = nside*sqrt(3.0*(1.0 - za));
+        jp = (long)(tp*tmp);
+        jm = (long)((1.0 - tp)*tmp);
+        if (jp >= nside) jp = nside-1;
+        if (jm >= nside) jm = nside-1;
+        if (z >= 0) {
+            face = ntt;
+            ix = nside - jm - 1;
+            iy = nside - jp - 1;
+        } else {
+            face = ntt + 8;
+            ix = jp;
+            iy = jm;
+        }
+    }
+
+    return (face << (2*order)) + spread_bits(ix) + (spread_bits(iy) << 1);
+}
+
+/* Centre of a cell, in degrees. */
+void
+hp_pix2ang(int order, long pix, double *ra, double *dec)
+{
+    long nside = 1L << order, npface = nside*nside, face, ix, iy, jr, nr, jp, kshift;
+    double z, fact = 1.0/(3.0*nside*nside);
+
+    face = pix >> (2*order);
+    ix = compress_bits(pix & (npface-1));
+    iy = compress_bits((pix & (npface-1)) >> 1);
+
+    jr = (jrll[face] << order) - ix - iy - 1;
+    if (jr < nside) {
+        nr = jr;
+        z = 1.0 - nr*nr*fact;
+        kshift = 0;
+    } else if (jr > 3*nside) {
+        nr = 4*nside - jr;
+        z = nr*nr*fact - 1.0;
+        kshift = 0;
+    } else {
+        nr = nside;
+        z = (2*nside - jr)*2.0/(3.0*nside);
+        kshift = (jr - nside) & 1;
+    }
+
+    jp = (jpll[face]*nr + ix - iy + 1 + kshift) / 2;
+    if (jp > 4*nside) jp -= 4*nside;
+    if (jp < 1) jp += 4*nside;
+
+    *ra = (jp - (kshift+1)*0.5) * (90.0/nr);
+    *dec = asin(z) / D2R;
+}
+
+/* An upper bound on the distance from the centre of a cell to any point of
+ * it, in degrees. */
+double
+hp_pixrad(int order)
+{
+    return 1.1 * sqrt(M_PI/3.0) / (1L << order) / D2R;
+}
+
+/* Angle between two positions, all in degrees. */
+double
+hp_distance(double ra1, double dec1, double ra2, double dec2)
+{
+    double s1 = sin((dec2-dec1)*D2R/2), s2 = sin((ra2-ra1)*D2R/2);
+
+    return 2.0*asin(sqrt(s1*s1 + cos(dec1*D2R)*cos(dec2*D2R)*s2*s2)) / D2R;
+}
+
+static int
+cmp_pix(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* The cells a cone of radius (degrees) about (ra, dec) may touch, found by
+ * sampling the cone on the tangent plane at a fifth of the cell size.
+ * Writes at most maxpix of them, sorted, and returns how many there are. */
+int
+hp_disc(int order, double ra, double dec, double radius, long *pix, int maxpix)
+{
+    double r = radius + hp_pixrad(order), step = hp_pixrad(order)/6.0;
+    double u, v, rho, c, sd, cd, sd0 = sin(dec*D2R), cd0 = cos(dec*D2R), pra, pdec;
+    long *all;
+    int n = 0, k, m, nmax;
+
+    nmax = (int)(2*r/step + 3);
+    nmax *= nmax;
+    all = malloc(nmax * sizeof(long));
+    if (!all)
+        return 0;
+
+    for (u=-r; u<=r+step/2; u+=step) {
+        for (v=-r; v<=r+step/2; v+=step) {
+            rho = sqrt(u*u + v*v);
+            if (rho > r) continue;
+            /* inverse gnomonic projection about (ra, dec) */
+            c = atan(rho*D2R);
+            sd = cos(c)*sd0 + (rho > 0 ? v*D2R*sin(c)*cd0/(rho*D2R) : 0);
+            cd = rho*D2R*cd0*cos(c) - v*D2R*sd0*sin(c);
+            pdec = asin(sd) / D2R;
+            pra = ra + atan2(u*D2R*sin(c), cd) / D2R;
+            all[n++] = hp_ang2pix(order, pra, pdec);
+        }
+    }
+
+    qsort(all, n, sizeof(long), cmp_pix);
+    for (k=0, m=0; k<n; k++)
+        if (!m || all[k] != all[m-1])
+            all[m++] = all[k];
+    for (k=0; k<m && k<maxpix; k++)
+        pix[k] = all[k];
+    free(all);
+
+    return m;
+}
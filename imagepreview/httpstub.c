@@ -0,0 +1,572 @@
+//
+//  httpstub.c
+//  imagepreview
+//
+//  Stand-in for the archive cone-search service, for testing and timing the
+//  fetch path without the network. It listens on the loopback interface
+//  only, one thread per connection, and answers
+//
+//      GET /<file>?...                 a file of the fixture directory
+//      GET /gen/<rows>.<tsv|xml|bin>?ra=&dec=&rad=
+//                                      rows sources spread over the cone, as
+//                                      VizieR-style text or a VOTable in
+//                                      TABLEDATA or BINARY
+//
+//  How the answer is sent is set for all requests by the options given to
+//  stub_open, and for one by the same names in its query string:
+//
+//      latency=ms      wait before the response headers
+//      chunk=bytes     size of each write of the body
+//      gap=ms          wait between writes
+//      stall=ms@bytes  stop for a while once that much has gone out
+//      chunked=1       Transfer-Encoding: chunked, not Content-Length
+//      fail=n          503 for the first n requests made to the stub
+//      close=1         one request per connection, no keep-alive
+//      gzip=1          gzip the body for clients that accept it
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include <zlib.h>
+
+#define STUB_MAXREQ 4096
+
+struct stub_opts
+{
+    int latency, gap, stall, chunked, fail, close, gzip;
+    long chunk, stall_at;
+};
+
+struct http_stub
+{
+    int fd, port;
+    char dir[1024];
+    struct stub_opts opts;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int requests, connections;
+    long bytes;
+};
+
+typedef struct http_stub HTTP_STUB;
+
+struct stub_conn
+{
+    HTTP_STUB *stub;
+    int fd;
+};
+
+/* Reads name=value options, parted by ',' or '&', into opts; unknown names
+ * are left for whoever else reads the string. */
+static void
+parse_opts(const char *s, struct stub_opts *opts)
+{
+    const char *v;
+    size_t n;
+
+    while (s && *s) {
+        n = strcspn(s, ",&");
+        if ((v = memchr(s, '=', n))) {
+            v++;
+            if (!strncmp(s, "latency=", 8)) opts->latency = atoi(v);
+            else if (!strncmp(s, "chunk=", 6)) opts->chunk = atol(v);
+            else if (!strncmp(s, "gap=", 4)) opts->gap = atoi(v);
+            else if (!strncmp(s, "chunked=", 8)) opts->chunked = atoi(v);
+            else if (!strncmp(s, "fail=", 5)) opts->fail = atoi(v);
+            else if (!strncmp(s, "close=", 6)) opts->close = atoi(v);
+            else if (!strncmp(s, "gzip=", 5)) opts->gzip = atoi(v);
+            else if (!strncmp(s, "stall=", 6)) {
+                opts->stall = atoi(v);
+                opts->stall_at = (v = memchr(v, '@', n - (v - s))) ? atol(v+1) : 0;
+            }
+        }
+        s += n;
+        if (*s) s++;
+    }
+}
+
+static double
+query_value(const char *query, const char *name, double dflt)
+{
+    size_t n = strlen(name);
+    const char *p;
+
+    for (p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+        if (!strncmp(p, name, n) && p[n] == '=')
+            return atof(p + n + 1);
+    return dflt;
+}
+
+/* Whether the request headers have a name: line that contains value. */
+static int
+has_header(const char *req, const char *name, const char *value)
+{
+    size_t n = strlen(name);
+    const char *p, *e;
+
+    for (p = strstr(req, "\r\n"); p; p = e) {
+        p += 2;
+        if (!(e = strstr(p, "\r\n")))
+            break;
+        if (!strncasecmp(p, name, n) && p[n] == ':') {
+            for (p += n+1; p + strlen(value) <= e; p++)
+                if (!strncasecmp(p, value, strlen(value)))
+                    return 1;
+        }
+    }
+    return 0;
+}
+
+/* The body gzipped, in place, at the fastest level so the stub itself costs
+ * little; left as it is when that fails. */
+static int
+gzip_body(char **body, size_t *len)
+{
+    z_stream z;
+    char *out;
+    uLong max;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    max = deflateBound(&z, *len);
+    if (!(out = malloc(max))) {
+        deflateEnd(&z);
+        return -1;
+    }
+    z.next_in = (Bytef *)*body;
+    z.avail_in = *len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = max;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        free(out);
+        return -1;
+    }
+    free(*body);
+    *body = out;
+    *len = z.total_out;
+    deflateEnd(&z);
+    return 0;
+}
+
+static void
+msleep(int ms)
+{
+    if (ms > 0)
+        usleep(ms * 1000);
+}
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t sent;
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (len) {
+        sent = send(fd, buf, len, flags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Appends to a growing buffer. */
+static void
+append(char **buf, size_t *len, size_t *max, const void *data, size_t n)
+{
+    if (*len + n > *max) {
+        *max = (*len + n) * 2 + 4096;
+        *buf = realloc(*buf, *max);
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+static void
+append_be(char **buf, size_t *len, size_t *max, const void *v, int n)
+{
+    unsigned char b[8];
+    int k;
+
+    /* the hosts here are little-endian or big-endian, nothing stranger */
+    for (k=0; k<n; k++)
+        b[k] = ((const unsigned char *)v)[(htonl(1) == 1) ? k : n-1-k];
+    append(buf, len, max, b, n);
+}
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* A response of rows sources spread evenly over the cone, the same every
+ * time for the same request. */
+static char *
+generate(long rows, const char *kind, double ra, double dec, double rad, size_t *len)
+{
+    char *buf = NULL, *bin = NULL, line[256];
+    size_t max = 0, binlen = 0, binmax = 0, k;
+    unsigned int seed = (unsigned int)(rows * 7919 + ra * 1000 + dec * 10);
+    double r, t, sra, sdec, jmag;
+    float rmag;
+    long i;
+    int n;
+
+    *len = 0;
+    if (!strcmp(kind, "tsv")) {
+        n = snprintf(line, sizeof(line),
+                     "#\n# Generated by httpstub\n#\n_r\tRAJ2000\tDEJ2000\t2MASS\tJmag\n"
+                     "arcmin\tdeg\tdeg\t\tmag\n------\t----------\t----------\t----------------\t------\n");
+        append(&buf, len, &max, line, n);
+    } else {
+        n = snprintf(line, sizeof(line),
+                     "<?xml version=\"1.0\"?>\n<VOTABLE version=\"1.3\"><RESOURCE type=\"results\">\n"
+                     "<INFO name=\"QUERY_STATUS\" value=\"OK\"/><TABLE>\n");
+        append(&buf, len, &max, line, n);
+        n = snprintf(line, sizeof(line),
+                     "<FIELD name=\"objid\" datatype=\"char\" arraysize=\"*\"/>\n"
+                     "<FIELD name=\"ra\" ucd=\"pos.eq.ra;meta.main\" datatype=\"double\" unit=\"deg\"/>\n");
+        append(&buf, len, &max, line, n);
+        n = snprintf(line, sizeof(line),
+                     "<FIELD name=\"dec\" ucd=\"pos.eq.dec;meta.main\" datatype=\"double\" unit=\"deg\"/>\n"
+                     "<FIELD name=\"r\" datatype=\"float\" unit=\"mag\"/>\n<DATA>");
+        append(&buf, len, &max, line, n);
+        n = snprintf(line, sizeof(line), strcmp(kind, "bin") ? "<TABLEDATA>\n" :
+                     "<BINARY><STREAM encoding=\"base64\">\n");
+        append(&buf, len, &max, line, n);
+    }
+
+    for (i=0; i<rows; i++) {
+        r = rad / 60.0 * sqrt(rand_r(&seed) / (RAND_MAX + 1.0));
+        t = 2 * M_PI * rand_r(&seed) / (RAND_MAX + 1.0);
+        sdec = dec + r * sin(t);
+        sra = ra + r * cos(t) / cos(dec * M_PI / 180.0);
+        jmag = 10.0 + 8.0 * rand_r(&seed) / (RAND_MAX + 1.0);
+
+        if (!strcmp(kind, "tsv"))
+            n = snprintf(line, sizeof(line), "%6.3f\t%10.6f\t%+10.6f\tJ%015ld\t%6.3f\n",
+                         r * 60.0, sra, sdec, i, jmag);
+        else if (!strcmp(kind, "xml"))
+            n = snprintf(line, sizeof(line), "<TR><TD>%ld</TD><TD>%.7f</TD><TD>%.7f</TD><TD>%.3f</TD></TR>\n",
+                         i, sra, sdec, jmag);
+        else {
+            n = snprintf(line, sizeof(line), "%ld", i);
+            append_be(&bin, &binlen, &binmax, &n, 4);
+            append(&bin, &binlen, &binmax, line, n);
+            append_be(&bin, &binlen, &binmax, &sra, 8);
+            append_be(&bin, &binlen, &binmax, &sdec, 8);
+            rmag = (float)jmag;
+            append_be(&bin, &binlen, &binmax, &rmag, 4);
+            continue;
+        }
+        append(&buf, len, &max, line, n);
+    }
+
+    if (!strcmp(kind, "bin")) {
+        /* base64 in lines of 76 */
+        for (k=0; k<binlen; k+=3) {
+            unsigned long v = (unsigned char)bin[k] << 16;
+            if (k+1 < binlen) v |= (unsigned char)bin[k+1] << 8;
+            if (k+2 < binlen) v |= (unsigned char)bin[k+2];
+            line[0] = b64[(v >> 18) & 63];
+            line[1] = b64[(v >> 12) & 63];
+            line[2] = k+1 < binlen ? b64[(v >> 6) & 63] : '=';
+            line[3] = k+2 < binlen ? b64[v & 63] : '=';
+            append(&buf, len, &max, line, 4);
+            if (k % 57 == 54)
+                append(&buf, len, &max, "\n", 1);
+        }
+        free(bin);
+        n = snprintf(line, sizeof(line), "\n</STREAM></BINARY></DATA></TABLE></RESOURCE></VOTABLE>\n");
+        append(&buf, len, &max, line, n);
+    } else if (!strcmp(kind, "xml")) {
+        n = snprintf(line, sizeof(line), "</TABLEDATA></DATA></TABLE></RESOURCE></VOTABLE>\n");
+        append(&buf, len, &max, line, n);
+    }
+
+    return buf;
+}
+
+static char *
+read_fixture(const char *dir, const char *name, size_t *len)
+{
+    char path[1200];
+    struct stat st;
+    FILE *fp;
+    char *buf;
+
+    /* nothing outside the fixture directory, and no name too long for it */
+    if (!*name || strstr(name, "..") || strchr(name, '/') ||
+        snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+        return NULL;
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || !(fp = fopen(path, "rb")))
+        return NULL;
+    buf = malloc(st.st_size + 1);
+    *len = buf ? fread(buf, 1, st.st_size, fp) : 0;
+    fclose(fp);
+    return buf;
+}
+
+/* Answers the request for target; returns whether the connection can take
+ * another request. */
+static int
+respond(HTTP_STUB *stub, int fd, char *target, const char *req)
+{
+    struct stub_opts opts = stub->opts;
+    char head[320], *query, *body = NULL, *dot;
+    const char *status = "200 OK", *type = "text/plain", *encoding = "";
+    size_t len = 0, sent = 0, n;
+    int nreq, stalled = 0, k, keep;
+
+    if ((query = strchr(target, '?')))
+        *query++ = '\0';
+    parse_opts(query, &opts);
+
+    pthread_mutex_lock(&stub->lock);
+    nreq = ++stub->requests;
+    pthread_mutex_unlock(&stub->lock);
+
+    if (nreq <= opts.fail)
+        status = "503 Service Unavailable";
+    else if (!strncmp(target, "/gen/", 5) && (dot = strchr(target+5, '.')) &&
+             (!strcmp(dot+1, "tsv") || !strcmp(dot+1, "xml") || !strcmp(dot+1, "bin"))) {
+        body = generate(atol(target+5), dot+1, query_value(query, "ra", 0.0),
+                        query_value(query, "dec", 0.0), query_value(query, "rad", 1.0), &len);
+        if (strcmp(dot+1, "tsv"))
+            type = "text/xml";
+    } else if (!(body = read_fixture(stub->dir, target+1, &len)))
+        status = "404 Not Found";
+    else if (strstr(target, ".xml") || strstr(target, ".vot"))
+        type = "text/xml";
+
+    if (body && opts.gzip && has_header(req, "Accept-Encoding", "gzip") && !gzip_body(&body, &len))
+        encoding = "Content-Encoding: gzip\r\n";
+    keep = !opts.close && !has_header(req, "Connection", "close");
+
+    msleep(opts.latency);
+    if (opts.chunked)
+        n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s"
+                     "Transfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                     status, type, encoding, keep ? "keep-alive" : "close");
+    else
+        n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s"
+                     "Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+                     status, type, encoding, (unsigned long)len, keep ? "keep-alive" : "close");
+    if (send_all(fd, head, n)) {
+        free(body);
+        return 0;
+    }
+
+    if (opts.chunk <= 0)
+        opts.chunk = len ? (long)len : 1;
+    while (sent < len) {
+        n = len - sent < (size_t)opts.chunk ? len - sent : (size_t)opts.chunk;
+        if (opts.stall > 0 && !stalled && sent + n > (size_t)opts.stall_at) {
+            n = opts.stall_at > (long)sent ? opts.stall_at - sent : 0;
+            stalled = 1;
+        }
+        if (n) {
+            if (opts.chunked) {
+                k = snprintf(head, sizeof(head), "%lx\r\n", (unsigned long)n);
+                if (send_all(fd, head, k))
+                    break;
+            }
+            if (send_all(fd, body + sent, n) || (opts.chunked && send_all(fd, "\r\n", 2)))
+                break;
+            sent += n;
+        }
+        if (stalled == 1) {
+            msleep(opts.stall);
+            stalled = 2;
+        } else if (sent < len)
+            msleep(opts.gap);
+    }
+    if (opts.chunked && sent == len && send_all(fd, "0\r\n\r\n", 5))
+        sent = 0;
+
+    pthread_mutex_lock(&stub->lock);
+    stub->bytes += sent;
+    pthread_mutex_unlock(&stub->lock);
+
+    free(body);
+    return keep && sent == len;
+}
+
+static void *
+stub_conn(void *arg)
+{
+    struct stub_conn *conn = (struct stub_conn *)arg;
+    char req[STUB_MAXREQ], *target, *end;
+    size_t got;
+    ssize_t n;
+    int keep = 1;
+
+    pthread_mutex_lock(&conn->stub->lock);
+    conn->stub->connections++;
+    pthread_mutex_unlock(&conn->stub->lock);
+
+    /* clients wait for each answer before the next request, so whatever
+     * came in is one request; the headers are read through to its end */
+    while (keep) {
+        got = 0;
+        req[0] = '\0';
+        while (got < sizeof(req)-1 && !strstr(req, "\r\n\r\n")) {
+            n = recv(conn->fd, req + got, sizeof(req)-1 - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+            req[got] = '\0';
+        }
+        if (!got)
+            break;
+
+        if (!strncmp(req, "GET ", 4) && (end = strchr(target = req+4, ' '))) {
+            *end = '\0';
+            keep = respond(conn->stub, conn->fd, target, end+1);
+        } else {
+            send_all(conn->fd, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n", 47);
+            keep = 0;
+        }
+    }
+
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static void *
+stub_listen(void *arg)
+{
+    HTTP_STUB *stub = (HTTP_STUB *)arg;
+    struct stub_conn *conn;
+    pthread_t thread;
+    int fd;
+
+    for (;;) {
+        fd = accept(stub->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+#ifdef SO_NOSIGPIPE
+        {
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+        }
+#endif
+        if (!(conn = malloc(sizeof(struct stub_conn)))) {
+            close(fd);
+            continue;
+        }
+        conn->stub = stub;
+        conn->fd = fd;
+        if (pthread_create(&thread, NULL, stub_conn, conn)) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/* Starts a stub serving the fixtures in dir on 127.0.0.1:port, port 0 for
+ * any free one, with the default options in opts (see above). */
+HTTP_STUB *
+stub_open(const char *dir, int port, const char *opts)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    HTTP_STUB *stub;
+    int one = 1;
+
+    if (!(stub = calloc(1, sizeof(HTTP_STUB))))
+        return NULL;
+    snprintf(stub->dir, sizeof(stub->dir), "%s", dir ? dir : ".");
+    parse_opts(opts, &stub->opts);
+    pthread_mutex_init(&stub->lock, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    stub->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stub->fd < 0 ||
+        setsockopt(stub->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(stub->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(stub->fd, 64) ||
+        getsockname(stub->fd, (struct sockaddr *)&addr, &addrlen) ||
+        pthread_create(&stub->thread, NULL, stub_listen, stub)) {
+        if (stub->fd >= 0)
+            close(stub->fd);
+        free(stub);
+        return NULL;
+    }
+    stub->port = ntohs(addr.sin_port);
+
+    return stub;
+}
+
+int
+stub_port(HTTP_STUB *stub)
+{
+    return stub->port;
+}
+
+/* Requests answered so far, failed ones included. */
+int
+stub_requests(HTTP_STUB *stub)
+{
+    int n;
+
+    pthread_mutex_lock(&stub->lock);
+    n = stub->requests;
+    pthread_mutex_unlock(&stub->lock);
+    return n;
+}
+
+/* Connections accepted so far. */
+int
+stub_connections(HTTP_STUB *stub)
+{
+    int n;
+
+    pthread_mutex_lock(&stub->lock);
+    n = stub->connections;
+    pthread_mutex_unlock(&stub->lock);
+    return n;
+}
+
+/* Bytes of response bodies sent so far, as they went on the wire. */
+long
+stub_bytes(HTTP_STUB *stub)
+{
+    long n;
+
+    pthread_mutex_lock(&stub->lock);
+    n = stub->bytes;
+    pthread_mutex_unlock(&stub->lock);
+    return n;
+}
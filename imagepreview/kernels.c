@@ -0,0 +1,613 @@
+//
+//  kernels.c
+//  imagepreview
+//
+//  The loops that touch every pixel: FITS data to float, byteswapped on the
+//  way, the range of an array, scaling and clamping to grey
+//  levels, and 2x2 binning. Each is built for plain C and, on x86, with
+//  SSE4.2, AVX2 and AVX-512 intrinsics, so that the same binary runs at
+//  its best on every node; the first call picks the widest the CPU has, or
+//  the one named by IMAGEPREVIEW_ISA (generic, sse4.2, avx2, avx512). The
+//  vector forms give the same floats as the plain C, which does the tails.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "fitsio.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define KERN_X86
+#include <immintrin.h>
+#endif
+
+/* a fused multiply-add rounds once, which would set the variants apart */
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#define KERN_BLOCK 65536        /* pixels read from the file at a time */
+
+struct kern_ops
+{
+    const char *name;
+    void (*to_float)(const unsigned char *src, int bitpix, long n, double scale, double zero, float *dst);
+    void (*minmax)(const float *x, long n, float *lo, float *hi);
+    void (*scale_u8)(const float *x, long n, float scale, float off, float top, unsigned char *dst);
+    void (*bin2_row)(const float *r0, const float *r1, long nx, float *out);
+};
+
+/* which of the fast paths a conversion can take without changing a bit */
+enum { KERN_ANY, KERN_I16, KERN_I32, KERN_F32 };
+
+static int
+convert_kind(int bitpix, double scale, double zero)
+{
+    if (bitpix == 16 && scale == 1.0 && zero == floor(zero) && fabs(zero) <= 8388608.0)
+        return KERN_I16;
+    if (bitpix == 32 && scale == 1.0 && zero == 0.0)
+        return KERN_I32;
+    if (bitpix == -32 && scale == 1.0 && zero == 0.0)
+        return KERN_F32;
+    return KERN_ANY;
+}
+
+/* ---------------------------------------------------------------- plain C */
+
+static void
+to_float_generic(const unsigned char *src, int bitpix, long n, double scale, double zero, float *dst)
+{
+    union { uint32_t u; float f; } u4;
+    union { uint64_t u; double d; } u8;
+    long i;
+    int k;
+
+    switch (bitpix) {
+        case 8:
+            for (i=0; i<n; i++)
+                dst[i] = (float)(src[i] * scale + zero);
+            break;
+        case 16:
+            for (i=0; i<n; i++, src+=2)
+                dst[i] = (float)((int16_t)(src[0] << 8 | src[1]) * scale + zero);
+            break;
+        case 32:
+            for (i=0; i<n; i++, src+=4)
+                dst[i] = (float)((int32_t)((uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 |
+                                           (uint32_t)src[2] << 8 | src[3]) * scale + zero);
+            break;
+        case -32:
+            for (i=0; i<n; i++, src+=4) {
+                u4.u = (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 8 | src[3];
+                /* unscaled floats are copied, NaN and -0 as they are */
+                dst[i] = (scale == 1.0 && zero == 0.0) ? u4.f : (float)(u4.f * scale + zero);
+            }
+            break;
+        case -64:
+            for (i=0; i<n; i++, src+=8) {
+                for (k=0, u8.u=0; k<8; k++)
+                    u8.u = u8.u << 8 | src[k];
+                dst[i] = (float)(u8.d * scale + zero);
+            }
+            break;
+    }
+}
+
+static void
+minmax_generic(const float *x, long n, float *lo, float *hi)
+{
+    long i;
+
+    for (i=0; i<n; i++) {
+        if (x[i] < *lo) *lo = x[i];
+        if (x[i] > *hi) *hi = x[i];
+    }
+}
+
+static void
+scale_u8_generic(const float *x, long n, float scale, float off, float top, unsigned char *dst)
+{
+    float f;
+    long i;
+
+    for (i=0; i<n; i++) {
+        f = fminf(fmaxf(x[i] * scale + off, 0.0f), top);
+        dst[i] = (unsigned char)(f + 0.5f);
+    }
+}
+
+/* the last column of an odd width on its own */
+static void
+bin2_row_generic(const float *r0, const float *r1, long nx, float *out)
+{
+    long i, i1;
+
+    for (i=0; i<(nx + 1) / 2; i++) {
+        i1 = (2*i+1 < nx) ? 2*i+1 : 2*i;
+        out[i] = 0.25f * (r0[2*i] + r0[i1] + r1[2*i] + r1[i1]);
+    }
+}
+
+static const struct kern_ops ops_generic = {
+    "generic", to_float_generic, minmax_generic, scale_u8_generic, bin2_row_generic
+};
+
+#ifdef KERN_X86
+
+/* ----------------------------------------------------------------- SSE4.2 */
+
+__attribute__((target("sse4.2")))
+static void
+to_float_sse4(const unsigned char *src, int bitpix, long n, double scale, double zero, float *dst)
+{
+    const __m128i swap2 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128i swap4 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m128 z = _mm_set1_ps((float)zero);
+    __m128i v;
+    long i = 0;
+
+    switch (convert_kind(bitpix, scale, zero)) {
+        case KERN_I16:
+            for (; i+8<=n; i+=8) {
+                v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 2*i)), swap2);
+                _mm_storeu_ps(dst + i, _mm_add_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(v)), z));
+                _mm_storeu_ps(dst + i + 4,
+                              _mm_add_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(v, 8))), z));
+            }
+            break;
+        case KERN_I32:
+            for (; i+4<=n; i+=4) {
+                v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 4*i)), swap4);
+                _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(v));
+            }
+            break;
+        case KERN_F32:
+            for (; i+4<=n; i+=4) {
+                v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 4*i)), swap4);
+                _mm_storeu_ps(dst + i, _mm_castsi128_ps(v));
+            }
+            break;
+    }
+    to_float_generic(src + i * (abs(bitpix) / 8), bitpix, n - i, scale, zero, dst + i);
+}
+
+__attribute__((target("sse4.2")))
+static void
+minmax_sse4(const float *x, long n, float *lo, float *hi)
+{
+    /* min(x, acc) is acc when x is NaN, so NaNs are passed over */
+    __m128 l = _mm_set1_ps(*lo), h = _mm_set1_ps(*hi), v;
+    float a[4], b[4];
+    long i;
+    int k;
+
+    for (i=0; i+4<=n; i+=4) {
+        v = _mm_loadu_ps(x + i);
+        l = _mm_min_ps(v, l);
+        h = _mm_max_ps(v, h);
+    }
+    _mm_storeu_ps(a, l);
+    _mm_storeu_ps(b, h);
+    for (k=0; k<4; k++) {
+        if (a[k] < *lo) *lo = a[k];
+        if (b[k] > *hi) *hi = b[k];
+    }
+    minmax_generic(x + i, n - i, lo, hi);
+}
+
+__attribute__((target("sse4.2")))
+static void
+scale_u8_sse4(const float *x, long n, float scale, float off, float top, unsigned char *dst)
+{
+    const __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(off), t = _mm_set1_ps(top);
+    const __m128 zero = _mm_setzero_ps(), half = _mm_set1_ps(0.5f);
+    __m128i q[4];
+    long i;
+    int k;
+
+    for (i=0; i+16<=n; i+=16) {
+        for (k=0; k<4; k++)
+            q[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(
+                       _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i + 4*k), s), o), zero), t), half));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_packus_epi32(q[0], q[1]), _mm_packus_epi32(q[2], q[3])));
+    }
+    scale_u8_generic(x + i, n - i, scale, off, top, dst + i);
+}
+
+__attribute__((target("sse4.2")))
+static void
+bin2_row_sse4(const float *r0, const float *r1, long nx, float *out)
+{
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    __m128 a0, a1, b0, b1, s;
+    long i;
+
+    for (i=0; 2*i+8<=nx; i+=4) {
+        a0 = _mm_loadu_ps(r0 + 2*i);
+        a1 = _mm_loadu_ps(r0 + 2*i + 4);
+        b0 = _mm_loadu_ps(r1 + 2*i);
+        b1 = _mm_loadu_ps(r1 + 2*i + 4);
+        s = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)),
+                       _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1)));
+        s = _mm_add_ps(s, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+        s = _mm_add_ps(s, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_ps(out + i, _mm_mul_ps(quarter, s));
+    }
+    bin2_row_generic(r0 + 2*i, r1 + 2*i, nx - 2*i, out + i);
+}
+
+static const struct kern_ops ops_sse4 = {
+    "sse4.2", to_float_sse4, minmax_sse4, scale_u8_sse4, bin2_row_sse4
+};
+
+/* ------------------------------------------------------------------- AVX2 */
+
+__attribute__((target("avx2")))
+static void
+to_float_avx2(const unsigned char *src, int bitpix, long n, double scale, double zero, float *dst)
+{
+    const __m128i swap2 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256i swap4 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256 z = _mm256_set1_ps((float)zero);
+    __m256i v;
+    long i = 0;
+
+    switch (convert_kind(bitpix, scale, zero)) {
+        case KERN_I16:
+            for (; i+8<=n; i+=8) {
+                v = _mm256_cvtepi16_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 2*i)), swap2));
+                _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_cvtepi32_ps(v), z));
+            }
+            break;
+        case KERN_I32:
+            for (; i+8<=n; i+=8) {
+                v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + 4*i)), swap4);
+                _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(v));
+            }
+            break;
+        case KERN_F32:
+            for (; i+8<=n; i+=8) {
+                v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + 4*i)), swap4);
+                _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(v));
+            }
+            break;
+    }
+    to_float_generic(src + i * (abs(bitpix) / 8), bitpix, n - i, scale, zero, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void
+minmax_avx2(const float *x, long n, float *lo, float *hi)
+{
+    __m256 l = _mm256_set1_ps(*lo), h = _mm256_set1_ps(*hi), v;
+    float a[8], b[8];
+    long i;
+    int k;
+
+    for (i=0; i+8<=n; i+=8) {
+        v = _mm256_loadu_ps(x + i);
+        l = _mm256_min_ps(v, l);
+        h = _mm256_max_ps(v, h);
+    }
+    _mm256_storeu_ps(a, l);
+    _mm256_storeu_ps(b, h);
+    for (k=0; k<8; k++) {
+        if (a[k] < *lo) *lo = a[k];
+        if (b[k] > *hi) *hi = b[k];
+    }
+    minmax_generic(x + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void
+scale_u8_avx2(const float *x, long n, float scale, float off, float top, unsigned char *dst)
+{
+    const __m256 s = _mm256_set1_ps(scale), o = _mm256_set1_ps(off), t = _mm256_set1_ps(top);
+    const __m256 zero = _mm256_setzero_ps(), half = _mm256_set1_ps(0.5f);
+    /* the packs work within 128 bit lanes; this puts the dwords back in order */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i q[4], p;
+    long i;
+    int k;
+
+    for (i=0; i+32<=n; i+=32) {
+        for (k=0; k<4; k++)
+            q[k] = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_min_ps(_mm256_max_ps(
+                       _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i + 8*k), s), o), zero), t), half));
+        p = _mm256_packus_epi16(_mm256_packus_epi32(q[0], q[1]), _mm256_packus_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(p, order));
+    }
+    scale_u8_generic(x + i, n - i, scale, off, top, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void
+bin2_row_avx2(const float *r0, const float *r1, long nx, float *out)
+{
+    const __m256 quarter = _mm256_set1_ps(0.25f);
+    __m256 a0, a1, b0, b1, s;
+    long i;
+
+/* the even or odd ones of a0 a1, in order */
+#define EVEN(a, b) _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd( \
+                       _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)))
+#define ODD(a, b)  _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd( \
+                       _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)))
+
+    for (i=0; 2*i+16<=nx; i+=8) {
+        a0 = _mm256_loadu_ps(r0 + 2*i);
+        a1 = _mm256_loadu_ps(r0 + 2*i + 8);
+        b0 = _mm256_loadu_ps(r1 + 2*i);
+        b1 = _mm256_loadu_ps(r1 + 2*i + 8);
+        s = _mm256_add_ps(EVEN(a0, a1), ODD(a0, a1));
+        s = _mm256_add_ps(s, EVEN(b0, b1));
+        s = _mm256_add_ps(s, ODD(b0, b1));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(quarter, s));
+    }
+#undef EVEN
+#undef ODD
+    bin2_row_generic(r0 + 2*i, r1 + 2*i, nx - 2*i, out + i);
+}
+
+static const struct kern_ops ops_avx2 = {
+    "avx2", to_float_avx2, minmax_avx2, scale_u8_avx2, bin2_row_avx2
+};
+
+/* ---------------------------------------------------------------- AVX-512 */
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+to_float_avx512(const unsigned char *src, int bitpix, long n, double scale, double zero, float *dst)
+{
+    const __m256i swap2 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m512i swap4 = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+    __m512 z = _mm512_set1_ps((float)zero);
+    __m512i v;
+    long i = 0;
+
+    switch (convert_kind(bitpix, scale, zero)) {
+        case KERN_I16:
+            for (; i+16<=n; i+=16) {
+                v = _mm512_cvtepi16_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + 2*i)), swap2));
+                _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_cvtepi32_ps(v), z));
+            }
+            break;
+        case KERN_I32:
+            for (; i+16<=n; i+=16) {
+                v = _mm512_shuffle_epi8(_mm512_loadu_si512(src + 4*i), swap4);
+                _mm512_storeu_ps(dst + i, _mm512_cvtepi32_ps(v));
+            }
+            break;
+        case KERN_F32:
+            for (; i+16<=n; i+=16) {
+                v = _mm512_shuffle_epi8(_mm512_loadu_si512(src + 4*i), swap4);
+                _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(v));
+            }
+            break;
+    }
+    to_float_generic(src + i * (abs(bitpix) / 8), bitpix, n - i, scale, zero, dst + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+minmax_avx512(const float *x, long n, float *lo, float *hi)
+{
+    __m512 l = _mm512_set1_ps(*lo), h = _mm512_set1_ps(*hi), v;
+    float a[16], b[16];
+    long i;
+    int k;
+
+    for (i=0; i+16<=n; i+=16) {
+        v = _mm512_loadu_ps(x + i);
+        l = _mm512_min_ps(v, l);
+        h = _mm512_max_ps(v, h);
+    }
+    _mm512_storeu_ps(a, l);
+    _mm512_storeu_ps(b, h);
+    for (k=0; k<16; k++) {
+        if (a[k] < *lo) *lo = a[k];
+        if (b[k] > *hi) *hi = b[k];
+    }
+    minmax_generic(x + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+scale_u8_avx512(const float *x, long n, float scale, float off, float top, unsigned char *dst)
+{
+    const __m512 s = _mm512_set1_ps(scale), o = _mm512_set1_ps(off), t = _mm512_set1_ps(top);
+    const __m512 zero = _mm512_setzero_ps(), half = _mm512_set1_ps(0.5f);
+    __m512i q;
+    long i;
+
+    for (i=0; i+16<=n; i+=16) {
+        q = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_min_ps(_mm512_max_ps(
+                _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(x + i), s), o), zero), t), half));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm512_cvtusepi32_epi8(q));
+    }
+    scale_u8_generic(x + i, n - i, scale, off, top, dst + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+bin2_row_avx512(const float *r0, const float *r1, long nx, float *out)
+{
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    const __m512 quarter = _mm512_set1_ps(0.25f);
+    __m512 a0, a1, b0, b1, s;
+    long i;
+
+    for (i=0; 2*i+32<=nx; i+=16) {
+        a0 = _mm512_loadu_ps(r0 + 2*i);
+        a1 = _mm512_loadu_ps(r0 + 2*i + 16);
+        b0 = _mm512_loadu_ps(r1 + 2*i);
+        b1 = _mm512_loadu_ps(r1 + 2*i + 16);
+        s = _mm512_add_ps(_mm512_permutex2var_ps(a0, even, a1), _mm512_permutex2var_ps(a0, odd, a1));
+        s = _mm512_add_ps(s, _mm512_permutex2var_ps(b0, even, b1));
+        s = _mm512_add_ps(s, _mm512_permutex2var_ps(b0, odd, b1));
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(quarter, s));
+    }
+    bin2_row_generic(r0 + 2*i, r1 + 2*i, nx - 2*i, out + i);
+}
+
+static const struct kern_ops ops_avx512 = {
+    "avx512", to_float_avx512, minmax_avx512, scale_u8_avx512, bin2_row_avx512
+};
+
+#endif
+
+/* ------------------------------------------------------------- dispatch */
+
+static const struct kern_ops *ops = &ops_generic;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+/* The variant called name, NULL if there is none or the CPU lacks it. */
+static const struct kern_ops *
+kern_find(const char *name)
+{
+    if (!strcmp(name, "generic"))
+        return &ops_generic;
+#ifdef KERN_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "sse4.2") && __builtin_cpu_supports("sse4.2"))
+        return &ops_sse4;
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+        return &ops_avx2;
+    if (!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return &ops_avx512;
+#endif
+    return NULL;
+}
+
+static void
+kern_select(void)
+{
+    static const char *widest[] = {"avx512", "avx2", "sse4.2"};
+    const struct kern_ops *o;
+    char *env = getenv("IMAGEPREVIEW_ISA");
+    int k;
+
+    for (k=0; k<3; k++)
+        if ((o = kern_find(widest[k]))) {
+            ops = o;
+            break;
+        }
+    if (env && *env) {
+        if ((o = kern_find(env)))
+            ops = o;
+        else
+            fprintf(stderr, "IMAGEPREVIEW_ISA=%s is not available here, using %s\n", env, ops->name);
+    }
+}
+
+static const struct kern_ops *
+kern_ops(void)
+{
+    pthread_once(&ops_once, kern_select);
+    return ops;
+}
+
+/* The variant in use: generic, sse4.2, avx2 or avx512. */
+const char *
+kern_isa(void)
+{
+    return kern_ops()->name;
+}
+
+/* Switches to the variant called name, for timing them against each other.
+ * Returns -1, keeping the one in use, when this CPU cannot run it. */
+int
+kern_use(const char *name)
+{
+    const struct kern_ops *o;
+
+    kern_ops();
+    if (!(o = kern_find(name)))
+        return -1;
+    ops = o;
+    return 0;
+}
+
+/* n big-endian FITS values of the given BITPIX from src, as float times
+ * scale plus zero, as fits_read_img gives them with no null checking. */
+void
+kern_to_float(const void *src, int bitpix, long n, double scale, double zero, float *dst)
+{
+    kern_ops()->to_float(src, bitpix, n, scale, zero, dst);
+}
+
+/* Narrows [*lo, *hi] to the range of x, leaving out NaNs. Start from
+ * HUGE_VALF, -HUGE_VALF; they come back crossed if all n are NaN. */
+void
+kern_minmax(const float *x, long n, float *lo, float *hi)
+{
+    kern_ops()->minmax(x, n, lo, hi);
+}
+
+/* x*scale + off, clamped to [0, top] and rounded, as bytes. NaN gives 0. */
+void
+kern_scale_u8(const float *x, long n, float scale, float off, float top, unsigned char *dst)
+{
+    kern_ops()->scale_u8(x, n, scale, off, top, dst);
+}
+
+/* 2x2 means of the nx by ny src into (nx+1)/2 by (ny+1)/2 dst, the last row
+ * and column of an odd size on their own. */
+void
+kern_bin2(const float *src, long nx, long ny, float *dst)
+{
+    const struct kern_ops *o = kern_ops();
+    long j, mx = (nx + 1) / 2;
+
+    for (j=0; j<(ny + 1) / 2; j++)
+        o->bin2_row(src + 2*j*nx, src + ((2*j+1 < ny) ? 2*j+1 : 2*j) * nx, nx, dst + j*mx);
+}
+
+/* As fits_read_img of TFLOAT with nulval 0: n pixels from pixel first of
+ * the current HDU into array. The data are read as they are in the file
+ * and converted here; tile compressed images and 64 bit integers are left
+ * to CFITSIO. */
+int
+kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status)
+{
+    LONGLONG headstart, datastart, dataend;
+    double bscale = 1.0, bzero = 0.0;
+    unsigned char *buf;
+    float nulval = 0.;
+    int bitpix, bytepix, anynul, keystat = 0;
+    long k, m;
+
+    if (*status)
+        return *status;
+    if (fits_is_compressed_image(fptr, status) || fits_get_img_type(fptr, &bitpix, status) ||
+        bitpix == LONGLONG_IMG ||
+        fits_get_hduaddrll(fptr, &headstart, &datastart, &dataend, status) ||
+        !(buf = malloc((size_t)KERN_BLOCK * 8)))
+        return fits_read_img(fptr, TFLOAT, first, n, &nulval, array, &anynul, status);
+
+    fits_read_key(fptr, TDOUBLE, "BSCALE", &bscale, NULL, &keystat);
+    keystat = 0;
+    fits_read_key(fptr, TDOUBLE, "BZERO", &bzero, NULL, &keystat);
+
+    bytepix = abs(bitpix) / 8;
+    ffmbyt(fptr, datastart + (LONGLONG)(first - 1) * bytepix, 0, status);   /* 0: an error past the end */
+    for (k=0; k<n && !*status; k+=m) {
+        m = (n - k < KERN_BLOCK) ? n - k : KERN_BLOCK;
+        if (!ffgbyt(fptr, (LONGLONG)m * bytepix, buf, status))
+            kern_to_float(buf, bitpix, m, bscale, bzero, array + k);
+    }
+    free(buf);
+
+    return *status;
+}
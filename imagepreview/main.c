@@ -5,7 +5,7 @@
 //  Created by Eduardo on 06/02/2013.
 //  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
 //
-// gcc main.c torben.c coords.c fopen.c -o preview -I/usr/local/include/wcslib -lwcs -lcurl -lcfitsio -lcpgplot
+// gcc main.c torben.c coords.c fopen.c cube.c rgb.c ellipse.c grid.c catalogue.c density.c filter.c conesearch.c healpix.c tilecache.c refcat.c tableparse.c wcscache.c wcsgrid.c coordgrid.c previewd.c watch.c kernels.c bands.c -o preview -I/usr/local/include/wcslib -lwcs -lcurl -lcfitsio -lcpgplot -lpthread -lz
 
 #include <math.h>
 #include <ctype.h>
@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include "fitsio.h"
 #include "cpgplot.h"
 #include "wcs.h"
@@ -27,6 +29,9 @@
 #define SDSS_URL "http://casu.ast.cam.ac.uk/vistasp/conesearch/sdss?ra=%f&dec=%f&rad=%f"
 
 #define max( a, b ) ( ((a) > (b)) ? (a) : (b) )
+#define min( a, b ) ( ((a) < (b)) ? (a) : (b) )
+
+#define CAT_CHUNK 8192
 
 float torben(float a[], int n) ;
 float mad(float a[], int n) ;
@@ -34,6 +39,76 @@ float *zscale(float m[], int n);
 double str2ra (const char *in);
 double str2dec (const char *in);
 
+typedef struct cube_stream CUBE_STREAM;
+CUBE_STREAM *cube_open(char *filename, int hdunum, long npix, long nx, int x1, int x2, int y1, int y2, int bin, long rows, long first, long last, long start, int loop, int *status);
+float *cube_next(CUBE_STREAM *cs, long *plane);
+void cube_seek(CUBE_STREAM *cs, long plane);
+int cube_close(CUBE_STREAM *cs);
+
+void rgb_palette(int cimin, int levels);
+int *rgb_composite(char *filenames[], float sigma, int dozscale, float softening, int cimin, int levels, long naxes[], int *status);
+
+int ellipse_vertices(float xc, float yc, float a, float b, float pa, float devpix, float *xe, float *ye);
+
+typedef struct src_grid SRC_GRID;
+SRC_GRID *grid_build(const float *x, const float *y, long n, float cell, long nx, long ny);
+long grid_query(SRC_GRID *g, float x1, float x2, float y1, float y2, long *out);
+void grid_free(SRC_GRID *g);
+
+typedef struct cat_reader CAT_READER;
+CAT_READER *cat_open(char *filename, int *status);
+int cat_column(CAT_READER *cat, char *name);
+int cat_has_column(CAT_READER *cat, int slot);
+int cat_select(CAT_READER *cat, int hdu, long *nrows, int *status);
+int cat_read(CAT_READER *cat, int slot, long firstrow, long nrows, float *dest, int *status);
+int cat_close(CAT_READER *cat, int *status);
+int cat_cache(CAT_READER *cat);
+const float *cat_mapped(CAT_READER *cat, int slot);
+
+typedef struct row_filter ROW_FILTER;
+ROW_FILTER *filter_compile(const char *expr, CAT_READER *cat, char *errmsg);
+int filter_eval(ROW_FILTER *f, CAT_READER *cat, long firstrow, long n, unsigned char *mask, int *status);
+void filter_free(ROW_FILTER *f);
+typedef struct colour_rules COLOUR_RULES;
+COLOUR_RULES *rules_compile(const char *spec, CAT_READER *cat, char *errmsg);
+int rules_eval(COLOUR_RULES *r, CAT_READER *cat, long firstrow, long n, int defci, int *ci, int *status);
+void rules_free(COLOUR_RULES *r);
+
+int density_code(float classification);
+int density_shape_code(float ellipticity);
+long *density_bin(const float *x, const float *y, const unsigned char *code, const long *rows, long n, float x0, float y0, float cell, int nbx, int nby);
+void density_draw(const long *counts, int nbx, int nby, float x0, float y0, float cell);
+
+const char *kern_isa(void);
+void kern_minmax(const float *x, long n, float *lo, float *hi);
+int kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status);
+
+long peak_rss(void);
+long current_rss(void);
+int band_bin(long nx, long w, long h, int copies, long avail, long *rows);
+int band_read(fitsfile *fptr, long nx, long first, int x1, int x2, int y1, int y2, int bin, long rows, const long *sample, float *value, int nsample, float *out, int *status);
+
+int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+	
+	return (la > lb) - (la < lb);
+}
+
+/* Given sorted row numbers, finds the run from visible[k] that lies in one
+ * CAT_CHUNK block of the table. Returns the end of the run and sets the
+ * span of rows it covers. */
+long next_chunk(const long *visible, long k, long nvisible, long *row, long *nchunk)
+{
+	long m, block = visible[k] - visible[k] % CAT_CHUNK;
+	
+	for (m=k; m<nvisible && visible[m] < block+CAT_CHUNK; m++);
+	*row = visible[k];
+	*nchunk = visible[m-1] - visible[k] + 1;
+	
+	return m;
+}
+
 char *replace_str(char *str, char *orig, char *rep)
 {
     static char buffer[4096];
@@ -129,112 +204,205 @@ char *trimwhitespace(char *str)
     
 }
 
-double *get_radec(char *str)
+/* pixel limits of the displayed region for the -x sections */
+void section_limits(int section, long naxes[], int *x1, int *x2, int *y1, int *y2)
 {
-	static char buffer[256];
-	static char x1a[256], x1[256];
-	static double xx[2] = {0.0, 0.0};
-	
-	char *p, *p1, *p2;
+	*x1 = 1;
+	*x2 = naxes[0];
+	*y1 = 1;
+	*y2 = naxes[1];
 	
-	while(isspace(*str)) str++;
-	p = strstr(str, " ");
-	strncpy(buffer, str, p-str);
-	buffer[p-str] = '\0';
-	xx[0] =  (double) atof(buffer);
-    
-	if (!(p = strstr(str, " ")))
-		return xx;
-    
-	while(isspace(*p)) p++;
-	strcpy(x1a, p);
-	x1a[*p] = '\0';
-    
-	if ((p = strstr(x1a, " ")))
-	{
-		strncpy(buffer, x1a, p-x1a);
-		buffer[p-x1a] = '\0';
-		xx[1] =  (double) atof(buffer);
-	} else {
-		xx[1] =  (double) atof(x1a);
+	switch (section) {
+		case(1):
+			*x1=1;
+			*x2=600;
+			*y1=1;
+			*y2=600;
+			break;
+		case(2):
+			*x1=1.0;
+			*x2=600.;
+			*y1=naxes[1]-600.0;
+			*y2=naxes[1];
+			break;
+		case(3):
+			*x1=naxes[0]-600.0;
+			*x2=naxes[0];
+			*y1=naxes[1]-600.0;
+			*y2=naxes[1];
+			break;
+		case(4):
+			*x1=naxes[0]-600.0;
+			*x2=naxes[0]-1;
+			*y1=1.0;
+			*y2=600.0;
+			break;
+		case(5):
+			*x1=naxes[0]/2-300.0;
+			*x2=naxes[0]/2+300.0;
+			*y1=naxes[1]/2-300.0;
+			*y2=naxes[1]/2+300.0;
+			break;
 	}
-	
-	return xx;
 }
 
+struct wcsprm *wcs_hdu(fitsfile *fptr);
+long coord_grid(struct wcsprm *wcs, float x1, float x2, float y1, float y2);
+
 #ifndef NOCURL
 
-enum fcurl_type_e { CFTYPE_NONE=0, CFTYPE_FILE=1, CFTYPE_CURL=2 };
+double hp_distance(double ra1, double dec1, double ra2, double dec2);
 
-struct fcurl_data
+/* The centre of the displayed section of the current HDU and the radius
+ * (arcmin) of the cone just covering it, from its world coordinates */
+void section_cone(fitsfile *fptr, struct wcsprm *wcs, int section, double radec[2], float *radius)
 {
-    enum fcurl_type_e type;     /* type of handle */
-    union {
-        CURL *curl;
-        FILE *file;
-    } handle;                   /* handle */
-    
-    char *buffer;               /* buffer to store cached data*/
-    int buffer_len;             /* currently allocated buffers length */
-    int buffer_pos;             /* end of data in buffer*/
-    int still_running;          /* Is background url fetch still in progress */
-};
+	double xy[2], std[2], sky[2], phi, theta, d;
+	long naxes[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+	int x1, x2, y1, y2, bitpix, naxis, k, stat, status = 0;
+	
+	fits_get_img_param(fptr, 9, &bitpix, &naxis, naxes, &status);
+	section_limits(section, naxes, &x1, &x2, &y1, &y2);
+	
+	xy[0]=(x1+x2)/2.0;
+	xy[1]=(y1+y2)/2.0;
+	(void)wcsp2s(wcs,1,2,xy,std,&phi,&theta,radec,&stat);
+	
+	*radius = 0.0;
+	for (k=0; k<4; k++) {
+		xy[0] = (k & 1) ? x2 : x1;
+		xy[1] = (k & 2) ? y2 : y1;
+		if (!wcsp2s(wcs,1,2,xy,std,&phi,&theta,sky,&stat)) {
+			d = hp_distance(radec[0], radec[1], sky[0], sky[1]) * 60.0;
+			if (d > *radius) *radius = d;
+		}
+	}
+}
+
+#endif
+
+int daemon_serve(const char *path);
+
+typedef struct dir_watch DIR_WATCH;
+DIR_WATCH *watch_open(const char *dir, const char *pattern);
+double watch_next(DIR_WATCH *w, char *path, size_t len, int *skipped);
+
+void label_plane(long plane)
+{
+	static char label[32] = "";
+	
+	/* overwrite the previous label in the background colour first */
+	cpgsci(0);
+	cpgmtxt("T", 0.5, 0.0, 0.0, label);
+	sprintf(label, "plane %ld", plane);
+	cpgsci(1);
+	cpgmtxt("T", 0.5, 0.0, 0.0, label);
+}
+
+void show_plane(float *array, int dx, int dy, int x1, int x2, int y1, int y2, float z1, float z2, float *tr, long plane)
+{
+	cpgbbuf();
+	cpgimag(array, dx, dy, x1, x2, y1, y2, z1, z2, tr);
+	label_plane(plane);
+	cpgebuf();
+}
+
+#ifndef NOCURL
 
 typedef struct fcurl_data URL_FILE;
 
 URL_FILE *url_fopen(const char *url,const char *operation);
+int url_fclose(URL_FILE *file);
+char *url_fgetline(URL_FILE *file, size_t *len);
+int url_set_timeouts(const char *spec);
+void url_set_retries(int retries);
+void url_cleanup(void);
+
+typedef struct cone_set CONE_SET;
+CONE_SET *cone_open(const char *survey, const char *urlpath);
+CONE_SET *cone_open_index(const char *path);
+int cone_submit(CONE_SET *set, double ra, double dec, double radius, struct wcsprm *wcs);
+void cone_panel(CONE_SET *set, int k, int ix, int iy);
+int cone_drain(CONE_SET *set, int wait, int symbol, float cheight);
+void cone_close(CONE_SET *set);
 
 #endif
 
 int main (int argc, char *argv[]) {
 	int c, j;
 	long i, n;
-	int dozscale=0, catalogue=0, interactive=0, pawprint=0, hdunum, isclassified=1;
+	int dozscale=0, catalogue=0, catcache=0, interactive=0, pawprint=0, hdunum, isclassified=1, verbose=0;
 	unsigned int iseed = (unsigned int)time(NULL);
 	char *p;
 	int pawnum[16] = {13, 14, 15, 16, 9, 10, 11, 12, 5, 6, 7, 8, 1, 2, 3, 4};
 	int twomass=0, sdss=0;
+	char *refindex = NULL, *daemonpath = NULL;
+	
+	/* Watching a directory */
+	char *watchdir = NULL, watchfile[1024];
+	DIR_WATCH *watch;
+	struct timeval tv;
+	double found;
+	int skipped;
+	pid_t pid;
 	char rastr[32], decstr[32];
 	
+	/* Memory budget */
+	long maxmem=0, need, avail, bandrows, mx, my, ransample[1000];
+	float ranvalue[1000], btr[6];
+	int bandbin=0, copies, nsample, bandstatus, needstatus;
+	int idx=0, idy=0, ix1=0, ix2=0, iy1=0, iy2=0;
+	
+	/* Data cubes */
+	CUBE_STREAM *cube;
+	long plane, plane1=1, plane2=0, nplanes=1;
+	int cubehdu=1;
+	
+	/* RGB composites */
+	int rgbmode=0, *ci, cilo, cihi, levels;
+	float softening=0.0;
+	
 	/* 2MASS */
 #ifndef NOCURL
 	
-	URL_FILE *handle;
+	CONE_SET *cones = NULL;
 	FILE *outf;
     
 #endif
     
 	int nread;
-	char buffer[256];
-	char url[512];
 	char *urlpath;
+	int nxsub = 1, nysub = 1;
 	
 	/* WCSLIB */
-	double cd[2][2], cd11, cd22, cd12, cd21, pv21, pv22, pv23, pv24, pv25;
-	float x, y, distance = 0.0, pixscl;
-	float nxpix, nypix, crpix1, crpix2;
-#ifndef NOCURL
+	float x, y, distance = 0.0;
+	float nxpix, nypix;
 	struct wcsprm *wcs;
-	struct pvcard pv[5];
-#endif
-	char ctype[2][9] = {"RA---ZPN", "DEC--ZPN"};
-	char cunit[2][9] = {"deg", "deg"};
-	double xy[2],std[2],phi,theta,radec[2],crval1, crval2;
-	double *dox;
-	int stat;
+	int skygrid=0;
+	double radec[2];
     
 	/* CFITSIO */
-	fitsfile *infptr, *catfptr;
-	int status = 0, ii = 1, iteration = 0, single = 0, hdupos, thdupos, colnum;
-    int hdutype, bitpix, bytepix, naxis = 0, nkeys, datatype = 0, anynul;
+	fitsfile *infptr;
+	CAT_READER *cat = NULL;
+	int status = 0, ii = 1, iteration = 0, single = 0, hdupos, thdupos;
+	int colx, coly, colclass, colgauss, colell, colpa;
+    int hdutype, bitpix, bytepix, naxis = 0, nkeys, datatype = 0;
 	
     long naxes[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
-	long nrows;
+	long nrows, row, nchunk, m, kk;
 	
     long first, totpix = 0, npix;
-    float *array, *ranarray, bscale = 1.0, bzero = 0.0, nulval = 0.;
-	float *xcoord, *ycoord, *classification, *ellipticity, *posang, *gaussian;
-	float skylevel, skynoise;
+    float *array, *ranarray, bscale = 1.0, bzero = 0.0;
+	const float *xcoord, *ycoord, *gausscol;
+	float *xbuf = NULL, *ybuf = NULL, *classification, *ellipticity, *posang, *gaussian;
+	float skylevel, skynoise, rmax, rmin;
+	SRC_GRID *grid;
+	long k, *visible, nvisible, lodlimit=20000, *counts;
+	unsigned char *codes, *mask;
+	int nbx, nby, *rowci;
+	char *wherestr = NULL, *rulestr = NULL, errmsg[128];
+	ROW_FILTER *where = NULL;
+	COLOUR_RULES *rules = NULL;
 	float *zs;
     char comment[81];
 	char instrument[20];
@@ -243,14 +411,14 @@ int main (int argc, char *argv[]) {
 	int symbol=4;
 	float tr[6] = {0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
 	char *device = "/xserve", chout[10], section=0;
-	float z1, z2, width=9.0, sigma=10.0, cheight=2.0, radius=20.0;
+	float z1=0.0, z2=1.0, width=9.0, sigma=10.0, cheight=2.0, radius=20.0;
 	float gl[2] = {0.0, 1.0};
 	float gr[2] = {0.0, 1.0};
 	float gg[2] = {0.0, 1.0};
 	float gb[2] = {0.0, 1.0};
 	int x1, x2, y1, y2, dx, dy;
 	float *ox, xout, yout;
-	float xe[60], ye[60];
+	float xe[61], ye[61], vx1, vx2, vy1, vy2, devpix;
 	
 	if (argc < 2) {
 		printf("Usage:\n");
@@ -259,14 +427,41 @@ int main (int argc, char *argv[]) {
 		printf("\n");
 		printf("Options:\n\n");
 		printf("  -a 2mass/sdss : query 2mass or sdss archive [experimental]\n");
+		printf("                  [kept in ~/.imagepreview, see IMAGEPREVIEW_CACHE,\n");
+		printf("                   IMAGEPREVIEW_CACHE_MAXAGE days, _MAXSIZE MB]\n");
+		printf("  -b 10         : asinh (Lupton) softening for -r [default linear]\n");
 		printf("  -c            : plots sources from catalogue if present\n");
+		printf("  -C            : as -c, keeping the columns in a _cat.fits.cache sidecar\n");
+		printf("                  [next to the catalogue or in $IMAGEPREVIEW_CACHE]\n");
 		printf("  -d /xserve    : output graphics device\n");
+		printf("  -D sock       : renders on request over a UNIX socket until killed\n");
+		printf("                  [IMAGEPREVIEW_WORKERS, IMAGEPREVIEW_DAEMON_MAXSIZE MB]\n");
+		printf("  -f 'expr'     : only overlay catalogue rows matching expr, e.g.\n");
+		printf("                  'classification==-1 && aper_flux_3>1000'\n");
+		printf("  -g            : overlays an RA/Dec grid from the image WCS\n");
 		printf("  -h 1          : sets the symbol size when overlaying a catalogue\n");
 		printf("  -i            : returns (x,y) on cursor input\n");
+		printf("                  [cubes: n/b step planes, p plays the range]\n");
+		printf("  -k 'rules'    : colours for catalogue rows, first match wins, e.g.\n");
+		printf("                  'classification==-1:blue; ellipticity>0.4:4'\n");
+		printf("  -l 20000      : visible sources above which a density map is drawn\n");
+		printf("  -M 512        : stays within 512 MB, reading images too large for it\n");
+		printf("                  in bands and binned down [IMAGEPREVIEW_MAXMEM]\n");
+		printf("  -n 1[:10]     : cube plane or range of planes to display\n");
+		printf("  -N 2          : retries of a failed archive query [IMAGEPREVIEW_RETRIES]\n");
 		printf("  -p            : plots all 16 chips from VISTA\n");
+		printf("  -r            : colour composite of three images (red green blue)\n");
+		printf("  -R ref.idx    : as -a, from a local index built by mkrefcat\n");
 		printf("  -s 4          : sets the symbol type when overlaying a catalogue\n");
 	    printf("  -t 10         : adjust the contrast (sigmas around background)\n");
+		printf("  -T 10,300,30  : archive query connect and total timeouts, and time\n");
+		printf("                  under 100 bytes/s before giving up, in seconds\n");
+		printf("                  [IMAGEPREVIEW_TIMEOUT]\n");
+		printf("  -v            : reports the pixel kernels chosen for this CPU\n");
+		printf("                  [IMAGEPREVIEW_ISA=generic/sse4.2/avx2/avx512]\n");
 		printf("  -w 9          : sets the size of the output image\n");
+		printf("  -W dir        : previews each new file in dir once it is written,\n");
+		printf("                  the newest when behind [IMAGEPREVIEW_WATCH='*.fit']\n");
 		printf("  -x bl         : displays only a section [bl, tl, tr, br, cc]\n");
 		printf("  -z            : autoscale the image [default is to read SKYLEVEL, \n");
 		printf("                                               SKYNOISE from header]\n");
@@ -275,41 +470,101 @@ int main (int argc, char *argv[]) {
 		printf("Examples:\n");
 		printf("\n");
 		printf("    preview -h 1 -c -w 6 v20091103_00368_st.fit+12\n");
+		printf("    preview -r -b 10 ks.fit+5 h.fit+5 j.fit+5\n");
 		printf("\n");
 		return(0);
 	}
 	
 	
-	while ((c = getopt (argc, argv, "a:ch:izpd:s:t:w:x:")) != -1)
+	if ((p = getenv("IMAGEPREVIEW_MAXMEM")))
+		maxmem = atol(p) << 20;
+	
+	while ((c = getopt (argc, argv, "a:b:cCD:f:gh:ik:l:M:zn:N:prR:d:s:t:T:vw:W:x:")) != -1)
         switch(c) {
             case 'a':
                 if (strstr(optarg, "2mass")) twomass=1;
                 if (strstr(optarg, "sdss")) sdss=1;
                 break;
+            case 'b':
+                softening=atof(optarg);
+                break;
+            case 'g':
+                skygrid=1;
+                break;
             case 'i':
                 interactive=1;
                 break;
+            case 'k':
+                rulestr=optarg;
+                catalogue=1;
+                break;
+            case 'l':
+                lodlimit=atol(optarg);
+                break;
+#ifndef NOCURL
+            case 'N':
+                url_set_retries(atoi(optarg));
+                break;
+            case 'R':
+                refindex=optarg;
+                break;
+            case 'T':
+                if (url_set_timeouts(optarg)) {
+                    printf("Bad timeouts %s, expected connect,total,lowspeed\n", optarg);
+                    return(1);
+                }
+                break;
+#endif
             case 'c':
                 catalogue=1;
                 break;
+            case 'C':
+                catalogue=1;
+                catcache=1;
+                break;
+            case 'f':
+                wherestr=optarg;
+                catalogue=1;
+                break;
             case 'h':
                 cheight=atof(optarg);
                 break;
             case 'd':
                 device = optarg;
                 break;
+            case 'D':
+                daemonpath = optarg;
+                break;
+            case 'M':
+                maxmem = atol(optarg) << 20;
+                break;
+            case 'n':
+                plane1=atol(optarg);
+                plane2=(p = strstr(optarg, ":")) ? atol(p+1) : plane1;
+                if (plane1 < 1) plane1=1;
+                if (plane2 < plane1) plane2=plane1;
+                break;
             case 'p':
                 pawprint=1;
                 break;
+            case 'r':
+                rgbmode=1;
+                break;
             case 's':
                 symbol=atoi(optarg);
                 break;
             case 't':
                 sigma = atof(optarg);
                 break;
+            case 'v':
+                verbose=1;
+                break;
             case 'w':
                 width = atof(optarg);
                 break;
+            case 'W':
+                watchdir = optarg;
+                break;
             case 'x':
                 if (p = strstr(optarg, "bl")) section=1;
                 if (p = strstr(optarg, "tl")) section=2;
@@ -324,11 +579,52 @@ int main (int argc, char *argv[]) {
                 abort();
         }
 	
+	if (verbose)
+		printf("Pixel kernels: %s\n", kern_isa());
+	
+	if (daemonpath)
+		return(daemon_serve(daemonpath));
+	
+	/* each new file is previewed by a child, from a fresh start as if it
+	 * had been given on the command line, while the parent goes on
+	 * watching; a frame that comes in meanwhile waits for the next one */
+	if (watchdir) {
+		if (!(watch = watch_open(watchdir, getenv("IMAGEPREVIEW_WATCH")))) {
+			printf("Cannot watch %s\n", watchdir);
+			return(1);
+		}
+		printf("Watching %s\n", watchdir);
+		interactive = 0;
+		for (;;) {
+			found = watch_next(watch, watchfile, sizeof(watchfile), &skipped);
+			if (skipped) printf("Skipped %d older frames\n", skipped);
+			fflush(stdout);
+			if ((pid = fork()) == 0)
+				break;
+			if (pid < 0) {
+				perror("fork");
+				return(1);
+			}
+			waitpid(pid, &status, 0);
+			status = 0;
+			gettimeofday(&tv, NULL);
+			printf("%s shown %.2f s after it was complete\n", watchfile, tv.tv_sec + tv.tv_usec * 1e-6 - found);
+		}
+		argv[optind] = watchfile;
+		argc = optind + 1;
+	}
+	
 	if (optind == argc) {
 		printf("Image file not set. Type 'preview' for usage instructions.\n");
 		return(1);
 	}
 	
+	if (rgbmode && argc - optind < 3) {
+		printf("Colour composites need three images (red green blue).\n");
+		return(1);
+	}
+	if (rgbmode) pawprint=0;
+	
 	/* Open input file for read */
     if (fits_open_image(&infptr, argv[optind], READONLY, &status)) {
         fits_report_error(stderr, status);
@@ -349,18 +645,24 @@ int main (int argc, char *argv[]) {
 		fits_read_key(infptr, TSTRING, "INSTRUME", &instrument, comment, &status);
 		if (strstr(instrument, "VIRCAM")) {
 			cpgsubp(4,4);
+			nxsub=4;
+			nysub=4;
 		} else if (strstr(instrument, "WFCAM")) {
 			pawnum[0]=1;
 			pawnum[1]=2;
 			pawnum[2]=3;
 			pawnum[3]=4;
 			cpgsubp(2,2);
+			nxsub=2;
+			nysub=2;
 		} else if (strstr(instrument, "WFC")) {
 			pawnum[0]=1;
 			pawnum[1]=2;
 			pawnum[2]=3;
 			pawnum[3]=4;
 			cpgsubp(2,2);
+			nxsub=2;
+			nysub=2;
 		} else if (strstr(instrument, "MOSAIC")) {
 			pawnum[0]=1;
 			pawnum[1]=2;
@@ -371,6 +673,8 @@ int main (int argc, char *argv[]) {
 			pawnum[6]=7;
 			pawnum[7]=8;
 			cpgsubp(4,2);
+			nxsub=4;
+			nysub=2;
 		} else if (strstr(instrument, "SuprimeCam")) {
 			pawnum[0]=1;
 			pawnum[1]=2;
@@ -383,15 +687,122 @@ int main (int argc, char *argv[]) {
 			pawnum[8]=9;
 			pawnum[9]=10;
 			cpgsubp(5,2);
+			nxsub=5;
+			nysub=2;
 		} else {
 			printf("Instrument: %s %d\n", instrument, hdunum);
 		}
 	}
     
 	
+	if (rgbmode && maxmem) {
+		/* three channels and the colour indices, all the size of the image */
+		fits_get_img_param(infptr, 9, &bitpix, &naxis, naxes, &status);
+		need = current_rss() + 4 * naxes[0] * naxes[1] * (long)sizeof(float);
+		if (need > maxmem) {
+			printf("Colour composite needs %ld MB, over the %ld MB budget\n", need >> 20, maxmem >> 20);
+			cpgend();
+			return(1);
+		}
+	}
+	
+	if (rgbmode) {
+		/* as many levels per channel as the device has colour indices */
+		cpgqcir(&cilo, &cihi);
+		for (levels=2; (levels+1)*(levels+1)*(levels+1) <= cihi-cilo+1; levels++);
+		rgb_palette(cilo, levels);
+		
+		ci = rgb_composite(&argv[optind], sigma, dozscale, softening, cilo, levels, naxes, &status);
+		if (!ci) {
+			fits_report_error(stderr, status);
+			cpgend();
+			return(status);
+		}
+		
+		section_limits(section, naxes, &x1, &x2, &y1, &y2);
+		dx = naxes[0];
+		dy = naxes[1];
+		cpgwnad(x1,x2,y1,y2);
+		cpgpixl(ci, dx, dy, x1, x2, y1, y2, x1-0.5, x2+0.5, y1-0.5, y2+0.5);
+		free(ci);
+	}
+	
+	/* the catalogue stays open for all the HDUs */
+	if (catalogue) {
+		cat = cat_open(strip_str(replace_str(argv[optind], ".fit", "_cat.fits")), &status);
+		if (cat) {
+			colx = cat_column(cat, "x_coordinate");
+			coly = cat_column(cat, "y_coordinate");
+			colclass = cat_column(cat, "classification");
+			colgauss = cat_column(cat, "gaussian_sigma");
+			colell = cat_column(cat, "ellipticity");
+			colpa = cat_column(cat, "position_angle");
+			if (catcache) cat_cache(cat);
+			classification = (float *) malloc(CAT_CHUNK * sizeof(float));
+			gaussian = (float *) malloc(CAT_CHUNK * sizeof(float));
+			ellipticity = (float *) malloc(CAT_CHUNK * sizeof(float));
+			posang = (float *) malloc(CAT_CHUNK * sizeof(float));
+			mask = (unsigned char *) malloc(CAT_CHUNK);
+			rowci = (int *) malloc(CAT_CHUNK * sizeof(int));
+			
+			/* filters are compiled once, against the catalogue columns */
+			if (wherestr && !(where = filter_compile(wherestr, cat, errmsg))) {
+				printf("Filter: %s\n", errmsg);
+				cpgend();
+				return(1);
+			}
+			if (rulestr && !(rules = rules_compile(rulestr, cat, errmsg))) {
+				printf("Colour rules: %s\n", errmsg);
+				cpgend();
+				return(1);
+			}
+		} else {
+			catalogue = 0;
+		}
+		status = 0;
+	}
+	
 	if (hdunum==1) hdunum++;
-	for (hdupos=0; hdupos<hdunum-1; hdupos++) {
+	
+#ifndef NOCURL
+	/* all the archive queries go out together, before the first chip is
+	 * read, and come back while the chips are being drawn */
+	if ((twomass || sdss || refindex) && !rgbmode) {
+		if (refindex) {
+			if (!(cones = cone_open_index(refindex))) {
+				printf("Cannot read reference index %s\n", refindex);
+				return(1);
+			}
+		} else {
+			if (twomass) {
+				if(!(urlpath = getenv("TWOMASS_URL"))) urlpath=TWOMASS_URL;
+			} else {
+				if(!(urlpath = getenv("SDSS_URL"))) urlpath=SDSS_URL;
+			}
+			cones = cone_open(twomass ? "twomass" : "sdss", urlpath);
+		}
+		
+		fits_get_hdu_num(infptr, &thdupos);
+		for (hdupos=0; cones && hdupos<(pawprint ? hdunum-1 : 1); hdupos++) {
+			if (pawprint) fits_movabs_hdu(infptr, pawnum[hdupos]+1, &hdutype, &status);
+			/* an HDU without one still takes its query number, empty */
+			if ((wcs = wcs_hdu(infptr)))
+				section_cone(infptr, wcs, section, radec, &radius);
+			else
+				printf("No world coordinates in HDU %d, not overlaid\n", pawprint ? pawnum[hdupos] : thdupos-1);
+			cone_submit(cones, radec[0], radec[1], radius, wcs);
+		}
+		fits_movabs_hdu(infptr, thdupos, &hdutype, &status);
+	}
+#endif
+	
+	for (hdupos=0; !rgbmode && hdupos<hdunum-1; hdupos++) {
 		if (pawprint) {
+#ifndef NOCURL
+			/* a new page: finish the chips of the last one first */
+			if (cones && hdupos && hdupos % (nxsub*nysub) == 0)
+				cone_drain(cones, 1, symbol, cheight);
+#endif
 			cpgpage();
 			fits_movabs_hdu(infptr, pawnum[hdupos]+1, &hdutype, &status);
 		}
@@ -401,12 +812,70 @@ int main (int argc, char *argv[]) {
 		totpix = naxes[0] * naxes[1];
 		npix = totpix;
 		datatype=TFLOAT;
-		first=1;
-		//array = (float *) calloc(npix, datatype);
-		array = (float *) malloc(totpix * sizeof(float));
-		fits_read_img(infptr, datatype, first, npix, &nulval, array, &anynul, &status);
-		fits_read_key(infptr, TFLOAT, "SKYLEVEL", &skylevel, comment, &status);
-		fits_read_key(infptr, TFLOAT, "SKYNOISE", &skynoise, comment, &status);
+		
+		/* higher axes are flattened into a sequence of planes */
+		nplanes = 1;
+		for (j=2; j<naxis; j++) nplanes *= naxes[j];
+		if (plane1 > nplanes) plane1 = nplanes;
+		if (plane2 > nplanes) plane2 = nplanes;
+		if (!plane2) plane2 = plane1;
+		fits_get_hdu_num(infptr, &cubehdu);
+		first = 1 + (plane1-1) * totpix;
+		section_limits(section, naxes, &x1, &x2, &y1, &y2);
+		
+		/* over the -M budget only the section is read, in bands, binned
+		 * down as far as it takes; the catalogue is counted in full */
+		bandbin = 0;
+		if (maxmem) {
+			copies = (plane2 > plane1) ? 4 : 1;     /* and the prefetch ring */
+			need = current_rss();
+			needstatus = 0;
+			fits_get_hdu_num(infptr, &j);
+			/* positions, the visible rows and the grid index; the
+			 * overlay itself is selected again below */
+			if (catalogue && !cat_select(cat, j==1 ? 2 : j, &nrows, &needstatus))
+				need += nrows * (2*sizeof(float) + 2*sizeof(long));
+			avail = maxmem - need;
+			need += copies * totpix * (long)sizeof(float);
+			if (need > maxmem) {
+				fits_get_hdu_num(infptr, &thdupos);
+				if (!(bandbin = band_bin(naxes[0], x2-x1+1, y2-y1+1, copies, avail, &bandrows))) {
+					printf("HDU %d does not fit in %ld MB, even binned\n", thdupos-1, maxmem >> 20);
+					cpgend();
+					return(1);
+				}
+				printf("HDU %d needs %ld MB, over the %ld MB budget: read in bands of %ld rows, binned %dx%d\n",
+				       thdupos-1, need >> 20, maxmem >> 20, bandrows, bandbin, bandbin);
+			}
+		}
+		
+		if (bandbin) {
+			/* the keywords first, so that the pixels -z samples are
+			 * picked out as the bands go by */
+			fits_read_key(infptr, TFLOAT, "SKYLEVEL", &skylevel, comment, &status);
+			fits_read_key(infptr, TFLOAT, "SKYNOISE", &skynoise, comment, &status);
+			nsample = (status || dozscale) ? 1000 : 0;
+			srand (iseed);
+			for (i=0; i<nsample; i++) {
+				ransample[i] = rand()*1.0*npix/RAND_MAX;
+				if (ransample[i] >= npix) ransample[i] = npix-1;
+			}
+			mx = (x2-x1+bandbin)/bandbin;
+			my = (y2-y1+bandbin)/bandbin;
+			array = (float *) malloc(mx * my * sizeof(float));
+			bandstatus = array ? 0 : MEMORY_ALLOCATION;
+			if (band_read(infptr, naxes[0], first, x1, x2, y1, y2, bandbin, bandrows, ransample, ranvalue, nsample, array, &bandstatus)) {
+				fits_report_error(stderr, bandstatus);
+				cpgend();
+				return(bandstatus);
+			}
+		} else {
+			//array = (float *) calloc(npix, datatype);
+			array = (float *) malloc(totpix * sizeof(float));
+			kern_read_img(infptr, first, npix, array, &status);
+			fits_read_key(infptr, TFLOAT, "SKYLEVEL", &skylevel, comment, &status);
+			fits_read_key(infptr, TFLOAT, "SKYNOISE", &skynoise, comment, &status);
+		}
 		
 		if (status || dozscale) {
 			srand (iseed);
@@ -414,7 +883,7 @@ int main (int argc, char *argv[]) {
 			zs = (float *) calloc(2, datatype);
 			for (i=0; i<1000; i++) {
 				j = rand()*1.0*npix/RAND_MAX;
-				ranarray[i]=array[j];
+				ranarray[i] = bandbin ? ranvalue[i] : array[j];
 			}
 			zs=zscale(ranarray, 1000);
 			skylevel = zs[0];
@@ -432,269 +901,194 @@ int main (int argc, char *argv[]) {
 		}
 		
 		if (catalogue) {
-			if(fits_open_table(&catfptr, strip_str(replace_str(argv[optind], ".fit", "_cat.fits")), READONLY, &status)) {
-				//fits_report_error(stderr, status);
-		        //return(status);
-                status=0;
-                continue;
-			}
 			fits_get_hdu_num(infptr, &j);
 			if (j==1) { j=2; }
-			fits_movabs_hdu(catfptr, j, &hdutype, &status);
-			fits_get_num_rows(catfptr, &nrows, &status);
-			xcoord = (float *) calloc(nrows, TFLOAT);
-			ycoord = (float *) calloc(nrows, TFLOAT);
-			classification = (float *) calloc(nrows, TFLOAT);
-			gaussian = (float *) calloc(nrows, TFLOAT);
-			ellipticity = (float *) calloc(nrows, TFLOAT);
-			posang = (float *) calloc(nrows, TFLOAT);
-			fits_get_colnum(catfptr, 0, "x_coordinate", &colnum, &status);
-			fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, xcoord, &anynul, &status);
-			fits_get_colnum(catfptr, 0, "y_coordinate", &colnum, &status);
-			fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, ycoord, &anynul, &status);
-			fits_get_colnum(catfptr, 0, "classification", &colnum, &status);
-			if (status) {
-				status=0;
-				isclassified=0;
-			} else {
-				fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, classification, &anynul, &status);
+			cat_select(cat, j, &nrows, &status);
+			isclassified = cat_has_column(cat, colclass);
+			
+			/* positions are kept for the whole HDU to index them; the
+			 * other columns are only ever held one chunk at a time. The
+			 * largest ellipse sets the margin by which the displayed
+			 * window is grown when culling. Columns in the sidecar are
+			 * used where they are mapped */
+			xcoord = cat_mapped(cat, colx);
+			ycoord = cat_mapped(cat, coly);
+			gausscol = cat_mapped(cat, colgauss);
+			if (!xcoord) xcoord = xbuf = (float *) malloc(max(nrows, 1) * sizeof(float));
+			if (!ycoord) ycoord = ybuf = (float *) malloc(max(nrows, 1) * sizeof(float));
+			rmax = 0.0;
+			rmin = HUGE_VALF;
+			for (row=1; row<=nrows; row+=CAT_CHUNK) {
+				nchunk = min(CAT_CHUNK, nrows-row+1);
+				if (xbuf) cat_read(cat, colx, row, nchunk, xbuf+row-1, &status);
+				if (ybuf) cat_read(cat, coly, row, nchunk, ybuf+row-1, &status);
+				if (gausscol) {
+					kern_minmax(gausscol+row-1, nchunk, &rmin, &rmax);
+				} else {
+					cat_read(cat, colgauss, row, nchunk, gaussian, &status);
+					kern_minmax(gaussian, nchunk, &rmin, &rmax);
+				}
 			}
-			fits_get_colnum(catfptr, 0, "gaussian_sigma", &colnum, &status);
-			fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, gaussian, &anynul, &status);
-			fits_get_colnum(catfptr, 0, "ellipticity", &colnum, &status);
-			fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, ellipticity, &anynul, &status);
-			fits_get_colnum(catfptr, 0, "position_angle", &colnum, &status);
-			fits_read_col(catfptr, TFLOAT, colnum, 1, 1, nrows, &nulval, posang, &anynul, &status);
-			fits_close_file(catfptr, &status);
+			rmax *= 2.4*cheight;
+			grid = grid_build(xcoord, ycoord, nrows, 64.0, naxes[0], naxes[1]);
+			visible = (long *) malloc(max(nrows, 1) * sizeof(long));
 		}
         
-		x1 = 1;
-		x2 = naxes[0];
-		y1 = 1;
-		y2 = naxes[1];
-		dx = x2-x1+1;
-		dy = y2-y1+1;
+		dx = naxes[0];
+		dy = naxes[1];
 		
-		switch (section) {
-			case(1):
-                x1=1;
-                x2=600;
-                y1=1;
-                y2=600;
-                break;
-			case(2):
-                x1=1.0;
-                x2=600.;
-                y1=naxes[1]-600.0;
-                y2=naxes[1];
-                break;
-			case(3):
-                x1=naxes[0]-600.0;
-                x2=naxes[0];
-                y1=naxes[1]-600.0;
-                y2=naxes[1];
-                break;
-			case(4):
-                x1=naxes[0]-600.0;
-                x2=naxes[0]-1;
-                y1=1.0;
-                y2=600.0;
-                break;
-			case(5):
-                x1=naxes[0]/2-300.0;
-                x2=naxes[0]/2+300.0;
-                y1=naxes[1]/2-300.0;
-                y2=naxes[1]/2+300.0;
-                break;
+		/* a binned section is drawn to the same pixel coordinates */
+		memcpy(btr, tr, sizeof(btr));
+		if (bandbin) {
+			idx = ix2 = mx;
+			idy = iy2 = my;
+			ix1 = iy1 = 1;
+			btr[0] = x1 - (bandbin+1)/2.0;
+			btr[1] = bandbin;
+			btr[3] = y1 - (bandbin+1)/2.0;
+			btr[5] = bandbin;
+		} else {
+			idx = dx;
+			idy = dy;
+			ix1 = x1;  ix2 = x2;
+			iy1 = y1;  iy2 = y2;
 		}
         
 		
 		cpgwnad(x1,x2,y1,y2);
 		cpgctab(gl, gr, gg, gb, 2, 1.5, 0.5);
-		cpgimag(array, dx, dy, x1, x2, y1, y2, z1, z2, tr);
+		cpgimag(array, idx, idy, ix1, ix2, iy1, iy2, z1, z2, btr);
+		if (nplanes > 1) label_plane(plane1);
         
 		if (catalogue) {
 			cpgbbuf();
 			ox=get_section(argv[optind]);
 			cpgsci(2);
 			cpgsch(cheight);
-			for (i=0; i<nrows; i++) {
-				if (isclassified) {
-					if (classification[i]==-1 || classification[i]==-2){
-						cpgsci(4);
-					} else if (classification[i]==0) {
-						cpgsci(2);
-					} else if (classification[i]==1 || classification[i]==2) {
-						cpgsci(3);
+			/* world units per device pixel, to size the ellipses */
+			cpgqvp(3, &vx1, &vx2, &vy1, &vy2);
+			devpix = (x2-x1+1)/(vx2-vx1);
+			if (grid) {
+				nvisible = grid_query(grid, x1+ox[0]-rmax, x2+ox[0]+rmax, y1+ox[1]-rmax, y2+ox[1]+rmax, visible);
+			} else {
+				for (nvisible=0; nvisible<nrows; nvisible++) visible[nvisible]=nvisible;
+			}
+			qsort(visible, nvisible, sizeof(long), cmp_long);
+			
+			/* one pass over the filter columns of the visible rows; only
+			 * the rows that pass are read any further */
+			if (where) {
+				for (k=0, kk=0; k<nvisible; k=m) {
+					m = next_chunk(visible, k, nvisible, &row, &nchunk);
+					if (filter_eval(where, cat, row+1, nchunk, mask, &status)) break;
+					for (; k<m; k++)
+						if (mask[visible[k]-row]) visible[kk++] = visible[k];
+				}
+				nvisible = status ? 0 : kk;
+			}
+			
+			/* too crowded for ellipses: bin onto the display grid, with
+			 * cells of about six device pixels */
+			if (nvisible > lodlimit) {
+				codes = (unsigned char *) malloc(nvisible);
+				for (k=0; k<nvisible && codes; k=m) {
+					m = next_chunk(visible, k, nvisible, &row, &nchunk);
+					if (isclassified) {
+						cat_read(cat, colclass, row+1, nchunk, classification, &status);
+					} else {
+						cat_read(cat, colell, row+1, nchunk, ellipticity, &status);
 					}
-				} else {
-					if (ellipticity[i]<=0.2) {
-						cpgsci(4);
-					} else if (ellipticity[i]>0.4) {
-						cpgsci(2);
+					if (status) break;
+					for (kk=k; kk<m; kk++) {
+						j = visible[kk] - row;
+						codes[kk] = isclassified ? density_code(classification[j]) : density_shape_code(ellipticity[j]);
 					}
 				}
-				//cpgpt1(xcoord[i]-ox[0], ycoord[i]-ox[1], symbol);
-				for (j=0; j<60; j++) {
-					xe[j] = xcoord[i]-ox[0] + 2.4*cheight*gaussian[i]*cos(6*j/180.0*3.141592)*cos(posang[i]/180.*3.141592) - 2.4*cheight*gaussian[i]*(1-ellipticity[i])*sin(6*j/180.0*3.141592)*sin(posang[i]/180.*3.141592);
-					ye[j] = ycoord[i]-ox[1] + 2.4*cheight*gaussian[i]*cos(6*j/180.0*3.141592)*sin(posang[i]/180.*3.141592) + 2.4*cheight*gaussian[i]*(1-ellipticity[i])*sin(6*j/180.0*3.141592)*cos(posang[i]/180.*3.141592);
-				}
-				cpgline(60, xe, ye);
+				nbx = (vx2-vx1)/6.0 + 1;
+				nby = (vy2-vy1)/6.0 + 1;
+				counts = NULL;
+				if (codes && !status)
+					counts = density_bin(xcoord, ycoord, codes, visible, nvisible, x1+ox[0]-0.5, y1+ox[1]-0.5, 6.0*devpix, nbx, nby);
+				if (counts)
+					density_draw(counts, nbx, nby, x1-0.5, y1-0.5, 6.0*devpix);
+				free(counts);
+				free(codes);
+				nvisible = 0;
+			}
+			
+			/* stream the visible rows chunk by chunk, reading only the
+			 * span of each chunk that holds visible sources */
+			for (k=0; k<nvisible; k=m) {
+				m = next_chunk(visible, k, nvisible, &row, &nchunk);
+				if (isclassified) cat_read(cat, colclass, row+1, nchunk, classification, &status);
+				cat_read(cat, colgauss, row+1, nchunk, gaussian, &status);
+				cat_read(cat, colell, row+1, nchunk, ellipticity, &status);
+				cat_read(cat, colpa, row+1, nchunk, posang, &status);
+				if (rules) rules_eval(rules, cat, row+1, nchunk, 2, rowci, &status);
+				if (status) break;
 				
+				for (kk=k; kk<m; kk++) {
+					i = visible[kk];
+					j = i - row;
+					if (rules) {
+						cpgsci(rowci[j]);
+					} else if (isclassified) {
+						if (classification[j]==-1 || classification[j]==-2){
+							cpgsci(4);
+						} else if (classification[j]==0) {
+							cpgsci(2);
+						} else if (classification[j]==1 || classification[j]==2) {
+							cpgsci(3);
+						}
+					} else {
+						if (ellipticity[j]<=0.2) {
+							cpgsci(4);
+						} else if (ellipticity[j]>0.4) {
+							cpgsci(2);
+						}
+					}
+					//cpgpt1(xcoord[i]-ox[0], ycoord[i]-ox[1], symbol);
+					n = ellipse_vertices(xcoord[i]-ox[0], ycoord[i]-ox[1], 2.4*cheight*gaussian[j],
+					                     2.4*cheight*gaussian[j]*(1-ellipticity[j]), posang[j], devpix, xe, ye);
+					if (n) {
+						cpgline(n, xe, ye);
+					} else {
+						cpgpt1(xcoord[i]-ox[0], ycoord[i]-ox[1], -1);
+					}
+				}
 			}
 			cpgebuf();
 			//cpgpt(nrows, xcoord, ycoord, symbol);
 			
-		}
-        
-#ifndef NOCURL
-        
-		if (twomass || sdss) {
-			status=0;
-			fits_read_key(infptr, TDOUBLE, "CRVAL1", &crval1, comment, &status);
-			fits_read_key(infptr, TDOUBLE, "CRVAL2", &crval2, comment, &status);
-			fits_read_key(infptr, TFLOAT, "CRPIX1", &crpix1, comment, &status);
-			fits_read_key(infptr, TFLOAT, "CRPIX2", &crpix2, comment, &status);
-			fits_read_key(infptr, TDOUBLE, "CD1_1", &cd11, comment, &status);
-			fits_read_key(infptr, TDOUBLE, "CD1_2", &cd12, comment, &status);
-			fits_read_key(infptr, TDOUBLE, "CD2_2", &cd22, comment, &status);
-			fits_read_key(infptr, TDOUBLE, "CD2_1", &cd21, comment, &status);
-			status=0;
-            
-			pixscl=cd11*cd22-cd12*cd21;
-			if (pixscl<0) pixscl=-pixscl;
-			pixscl=sqrt(pixscl)*3600.0;
-            
-			radius = max(x2, y2) * pixscl /60.0/1.5;
-			
-			wcs = malloc(sizeof(struct wcsprm));
-			wcs->flag=-1;
-			wcsini(1, 2, wcs);
-			wcsnpv(5);
-            
-			strcpy(wcs->ctype[0], &ctype[0][0]);
-			strcpy(wcs->ctype[1], &ctype[1][0]);
-			strcpy(wcs->cunit[0], &cunit[0][0]);
-			strcpy(wcs->cunit[1], &cunit[1][0]);
-            
-			wcs->crval[0] = crval1;
-			wcs->crval[1] = crval2;
-			wcs->crpix[0] = ((double) crpix1);
-			wcs->crpix[1] = ((double) crpix2);
-            
-			cd[0][0] = ((double) cd11);
-			cd[0][1] = ((double) cd12);
-			cd[1][0] = ((double) cd21);
-			cd[1][1] = ((double) cd22);
-            
-			wcs->altlin|=2;
-			wcs->cd = *cd;
-            
-            
-			pv[0].i=2;
-			pv[0].m=1;
-			pv[0].value=1.0;
-			fits_read_key(infptr, TDOUBLE, "PV2_1", &pv21, comment, &status);
-			if (status==0) {
-				pv[0].value=pv21;
-			} else {
-				status=0;
-			}
-            
-			pv[1].i=2;
-			pv[1].m=2;
-			pv[1].value=0.0;
-			fits_read_key(infptr, TDOUBLE, "PV2_2", &pv22, comment, &status);
-			if (status==0) {
-				pv[1].value=pv22;
-			} else {
-				status=0;
-			}
-            
-			pv[2].i=2;
-			pv[2].m=3;
-			pv[2].value = (double) 0.0;
-			fits_read_key(infptr, TDOUBLE, "PV2_3", &pv23, comment, &status);
-			if (status==0) {
-				pv[2].value=pv23;
-			} else {
-				status=0;
-			}
-            
-			pv[3].i=2;
-			pv[3].m=4;
-			pv[3].value=0.0;
-			fits_read_key(infptr, TDOUBLE, "PV2_4", &pv24, comment, &status);
-			if (status==0) {
-				pv[3].value=pv24;
-			} else {
+			grid_free(grid);
+			free(visible);
+			free(xbuf);
+			free(ybuf);
+			xbuf = ybuf = NULL;
+			if (status) {
+				fits_report_error(stderr, status);
 				status=0;
 			}
-			
-			pv[4].i=2;
-			pv[4].m=5;
-			pv[4].value = (double) 0.0;
-			fits_read_key(infptr, TDOUBLE, "PV2_5", &pv25, comment, &status);
-			if (status==0) {
-				pv[4].value=pv25;
+		}
+		
+		if (skygrid) {
+			if ((wcs = wcs_hdu(infptr))) {
+				coord_grid(wcs, x1, x2, y1, y2);
+				wcsfree(wcs);
+				free(wcs);
 			} else {
-				status=0;
-			}
-            
-			wcs->npv=5;
-			wcs->pv[0] = pv[0];
-			wcs->pv[1] = pv[1];
-			wcs->pv[2] = pv[2];
-			wcs->pv[3] = pv[3];
-			wcs->pv[4] = pv[4];
-            
-			(void)wcsset(wcs);
-            
-			//printf("Querying 2MASS....\n");
-			xy[0]=x2/2.0;
-			xy[1]=y2/2.0;
-			
-			(void)wcsp2s(wcs,1,2,xy,std,&phi,&theta,radec,&stat);
-			
-			if (twomass) {
-				if(!(urlpath = getenv("TWOMASS_URL"))) urlpath=TWOMASS_URL;
-				
-			} else if (sdss) {
-				if(!(urlpath = getenv("SDSS_URL"))) urlpath=SDSS_URL;
+				fits_get_hdu_num(infptr, &thdupos);
+				printf("No world coordinates in HDU %d, no grid drawn\n", thdupos-1);
 			}
-			
-			sprintf(url, urlpath, radec[0], radec[1], radius);
-			handle = url_fopen(url, "r");
-			
-			cpgbbuf();
-			cpgsci(3);
-			cpgsch(cheight);
-			while(!url_feof(handle))
-            {
-                url_fgets(buffer,sizeof(buffer),handle);
-                
-                if( strstr(buffer, "#")) continue;
-                if( strstr(buffer, "RAJ")) continue;
-                if( strstr(buffer, "---")) continue;
-                if( strstr(buffer, "   ")) continue;
-                if( strstr(buffer, "2MASS")) continue;
-                if( strstr(buffer, "deg")) continue;
-                if ( strlen(buffer)<10 ) continue;
-                if( strstr(buffer, "xmlns")) break;
-                dox=get_radec(buffer);
-                radec[0]=dox[0];
-                radec[1]=dox[1];
-                (void)wcss2p(wcs,1,2,radec,&phi,&theta,std,xy,&stat);
-                
-                cpgpt1(xy[0],xy[1], symbol);
-                
-                //printf("%f %f\n", x, y);
-            }
-            
-			cpgebuf();
-            
-			wcsfree(wcs);
-			free(wcs);
+		}
+        
+#ifndef NOCURL
+        
+		if (cones) {
+			/* the query for this chip went out before the loop; plot
+			 * what has come back so far, here and on the earlier chips */
+			cone_panel(cones, hdupos, hdupos % nxsub + 1, hdupos / nxsub % nysub + 1);
+			cone_drain(cones, 0, symbol, cheight);
 		}
         
 #endif
@@ -704,19 +1098,72 @@ int main (int argc, char *argv[]) {
 		if (!pawprint) break;
 	}
 	
+#ifndef NOCURL
+	if (cones) {
+		cone_drain(cones, 1, symbol, cheight);
+		cone_close(cones);
+	}
+	url_cleanup();
+#endif
+	
 	fits_close_file(infptr, &status);
 	
+	if (cat) {
+		cat_close(cat, &status);
+		filter_free(where);
+		rules_free(rules);
+		free(mask);
+		free(rowci);
+		free(classification);
+		free(gaussian);
+		free(ellipticity);
+		free(posang);
+	}
+	
+	/* stream the rest of a plane range through the prefetch ring; a
+	 * colour composite shows the first plane only */
+	if (!interactive && !pawprint && !rgbmode && plane2 > plane1) {
+		cube = cube_open(argv[optind], cubehdu, totpix, dx, x1, x2, y1, y2, bandbin, bandrows,
+		                 plane1+1, plane2, plane1+1, 0, &status);
+		while (cube && (array = cube_next(cube, &plane))) {
+			cpgpage();
+			cpgwnad(x1,x2,y1,y2);
+			show_plane(array, idx, idy, ix1, ix2, iy1, iy2, z1, z2, btr, plane);
+		}
+		if (cube) status = cube_close(cube);
+	}
+	
 	if (interactive & !pawprint) {
 		ox=get_section(argv[optind]);
+		cube = NULL;
+		plane = plane1;
+		if (!rgbmode && plane2 > plane1)
+			cube = cube_open(argv[optind], cubehdu, totpix, dx, x1, x2, y1, y2, bandbin, bandrows,
+			                 plane1, plane2, plane1+1, 1, &status);
+		chout[0] = '\0';
 		while(!(p = strstr(chout, "q"))) {
 			cpgband(7, 1, dx/2.0, dy/2.0, &xout, &yout, chout);
+			if (cube && (chout[0] == 'n' || chout[0] == 'b' || chout[0] == 'p')) {
+				if (chout[0] == 'b') cube_seek(cube, plane-1);
+				n = (chout[0] == 'p') ? plane2-plane1+1 : 1;
+				for (i=0; i<n; i++) {
+					if (!(array = cube_next(cube, &plane))) break;
+					show_plane(array, idx, idy, ix1, ix2, iy1, iy2, z1, z2, btr, plane);
+				}
+				printf("plane %ld\n", plane);
+				continue;
+			}
 			printf("x = %d, y = %d\n", (int )(xout+ox[0]), (int )(yout+ox[1]) );
 		}
+		if (cube) status = cube_close(cube);
 	}
 	
 	cpgend();
 	//cpgclos();
 	
+	if (maxmem || verbose)
+		printf("Peak memory %ld MB\n", peak_rss() >> 20);
+	
 	/* if error occurred, print out error message */
 	if (status) fits_report_error(stderr, status);
 	
@@ -0,0 +1,289 @@
+//
+//  mkrefcat.c
+//  imagepreview
+//
+//  Builds the reference catalogue index read by preview -R, from a text
+//  dump of the catalogue: one source per line, RA and Dec in degrees and
+//  up to four magnitudes, in columns picked with -c. Lines starting with
+//  # and lines without a usable position are skipped, as are magnitudes
+//  that do not parse. The dump is read twice, so it must be a file.
+//
+//  -S n writes a synthetic index of n random sources instead, and -q lists
+//  a cone of an index with the time the search took.
+//
+//  gcc mkrefcat.c refcat.c -o mkrefcat -lm
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define MAXCOL 6
+#define MAXMAG 4
+
+typedef struct refcat REFCAT;
+REFCAT *refcat_open(const char *path);
+long refcat_each(REFCAT *rc, double ra, double dec, double radius,
+                 void (*fn)(double ra, double dec, const double *mag, int nmag, void *arg), void *arg);
+const char *refcat_magname(REFCAT *rc, int m);
+long refcat_size(REFCAT *rc);
+void refcat_close(REFCAT *rc);
+
+typedef struct refcat_build REFCAT_BUILD;
+REFCAT_BUILD *refcat_create(const char *path, double zone, int nmag, char **magname);
+void refcat_count(REFCAT_BUILD *b, double dec);
+int refcat_layout(REFCAT_BUILD *b);
+int refcat_put(REFCAT_BUILD *b, double ra, double dec, const double *mag);
+int refcat_finish(REFCAT_BUILD *b, int ok);
+
+/* Splits line into fields at any of the characters of sep; with a single
+ * separator every one ends a field, so empty fields count, while runs of
+ * white space count once. Returns the number of fields. */
+static int
+split_line(char *line, const char *sep, char **field, int max)
+{
+    int n = 0, runs = !strcmp(sep, " \t");
+    char *p = line;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (runs)
+        p += strspn(p, sep);
+    while (n < max && *p) {
+        field[n++] = p;
+        p += strcspn(p, sep);
+        if (!*p)
+            break;
+        *p++ = '\0';
+        if (runs)
+            p += strspn(p, sep);
+    }
+
+    return n;
+}
+
+static int
+parse_value(const char *s, double *v)
+{
+    char *end;
+
+    *v = strtod(s, &end);
+    while (*end == ' ' || *end == '\t')
+        end++;
+    return end == s || *end || !isfinite(*v);
+}
+
+/* The position and magnitudes of a line, 0 when it holds a source. */
+static int
+parse_source(char *line, const char *sep, const int *col, int nmag,
+             double *ra, double *dec, double *mag)
+{
+    char *field[256];
+    int n, m, want = col[1];
+
+    if (line[0] == '#')
+        return -1;
+    for (m=0; m<nmag; m++)
+        if (col[2+m] > want)
+            want = col[2+m];
+    if (col[0] > want)
+        want = col[0];
+
+    n = split_line(line, sep, field, want < 256 ? want : 256);
+    if (n < col[0] || n < col[1] ||
+        parse_value(field[col[0]-1], ra) || parse_value(field[col[1]-1], dec) ||
+        *dec < -90.0 || *dec > 90.0)
+        return -1;
+
+    for (m=0; m<nmag; m++)
+        if (col[2+m] < 1 || col[2+m] > n || parse_value(field[col[2+m]-1], &mag[m]))
+            mag[m] = NAN;
+
+    return 0;
+}
+
+/* A uniform source on the sky, the same sequence for the same seed. */
+static void
+random_source(double *ra, double *dec, double *mag, int nmag)
+{
+    int m;
+
+    *ra = 360.0 * drand48();
+    *dec = asin(2.0 * drand48() - 1.0) * 180.0 / M_PI;
+    for (m=0; m<nmag; m++)
+        mag[m] = drand48() < 0.05 ? NAN : 10.0 + 7.0 * drand48();
+}
+
+static void
+print_source(double ra, double dec, const double *mag, int nmag, void *arg)
+{
+    int m;
+
+    (void)arg;
+    printf("%11.7f %11.7f", ra, dec);
+    for (m=0; m<nmag; m++)
+        printf(isnan(mag[m]) ? "       -" : " %7.3f", mag[m]);
+    printf("\n");
+}
+
+static int
+query(const char *spec, const char *path)
+{
+    double ra, dec, radius, t0, t1;
+    struct timeval tv;
+    REFCAT *rc;
+    long n;
+    int m;
+
+    if (sscanf(spec, "%lf,%lf,%lf", &ra, &dec, &radius) != 3) {
+        fprintf(stderr, "Bad cone %s, expected ra,dec,arcmin\n", spec);
+        return 1;
+    }
+    if (!(rc = refcat_open(path))) {
+        fprintf(stderr, "Cannot read reference index %s\n", path);
+        return 1;
+    }
+
+    printf("# %ld sources; columns ra dec", refcat_size(rc));
+    for (m=0; refcat_magname(rc, m); m++)
+        printf(" %s", refcat_magname(rc, m));
+    printf("\n");
+
+    gettimeofday(&tv, NULL);
+    t0 = tv.tv_sec + tv.tv_usec * 1e-6;
+    n = refcat_each(rc, ra, dec, radius / 60.0, print_source, NULL);
+    gettimeofday(&tv, NULL);
+    t1 = tv.tv_sec + tv.tv_usec * 1e-6;
+    fprintf(stderr, "%ld sources in %.3f ms\n", n, (t1 - t0) * 1e3);
+
+    refcat_close(rc);
+    return 0;
+}
+
+int main (int argc, char *argv[]) {
+    REFCAT_BUILD *b;
+    FILE *fp = NULL;
+    char *line = NULL, *sep = " \t", *cone = NULL, *magname[MAXMAG], *p, *dump, *out;
+    char defname[MAXMAG][8] = {"mag1", "mag2", "mag3", "mag4"};
+    int col[MAXCOL] = {1, 2, 3, 4, 5, 0}, ncol = 0, nmag, c, pass, ok = 1;
+    double zone = 0.1, ra, dec, mag[MAXMAG];
+    long nsynth = 0, k, nbad = 0, nline;
+    size_t cap = 0;
+
+    for (k=0; k<MAXMAG; k++)
+        magname[k] = defname[k];
+
+    while ((c = getopt(argc, argv, "c:m:q:S:t:z:")) != -1)
+        switch(c) {
+            case 'c':
+                for (ncol=0, p=optarg; ncol<MAXCOL && p; ncol++) {
+                    col[ncol] = atoi(p);
+                    if ((p = strchr(p, ',')))
+                        p++;
+                }
+                break;
+            case 'm':
+                for (k=0, p=strtok(optarg, ","); k<MAXMAG && p; k++, p=strtok(NULL, ","))
+                    magname[k] = p;
+                break;
+            case 'q':
+                cone = optarg;
+                break;
+            case 'S':
+                nsynth = atol(optarg);
+                break;
+            case 't':
+                sep = optarg;
+                break;
+            case 'z':
+                zone = atof(optarg) / 60.0;
+                break;
+            default:
+                return 1;
+        }
+
+    if (cone && optind == argc-1)
+        return query(cone, argv[optind]);
+
+    if (optind != argc - (nsynth ? 1 : 2)) {
+        printf("Usage:\n");
+        printf("\n");
+        printf("    mkrefcat [-c 1,2,3] [-t '|'] [-z 6] dump.txt index\n");
+        printf("    mkrefcat -S 1000000 index\n");
+        printf("    mkrefcat -q ra,dec,arcmin index\n");
+        printf("\n");
+        printf("Options:\n\n");
+        printf("  -c 1,2,3,4,5  : columns of RA, Dec (degrees) and up to 4 magnitudes\n");
+        printf("  -m j,h,k      : names of the magnitudes [mag1, mag2...]\n");
+        printf("  -q ra,dec,r   : lists the sources of a cone (degrees, arcmin)\n");
+        printf("  -S 1000000    : random sources on the sky instead of a dump\n");
+        printf("  -t '|'        : column separator [runs of white space]\n");
+        printf("  -z 6          : height of the declination zones, arcmin\n");
+        printf("\n");
+        printf("Examples:\n");
+        printf("\n");
+        printf("    mkrefcat -t '|' -c 1,2,7,11,15 -m j,h,k psc.txt twomass.idx\n");
+        printf("    preview -R twomass.idx v20091103_00368_st.fit+12\n");
+        printf("\n");
+        return 1;
+    }
+
+    /* without -c, columns 1 to 5; magnitudes a line lacks are absent */
+    nmag = ncol ? ncol-2 : 3;
+    if (nmag < 0 || col[0] < 1 || col[1] < 1) {
+        fprintf(stderr, "-c needs the columns of RA and Dec at least\n");
+        return 1;
+    }
+    dump = nsynth ? NULL : argv[optind];
+    out = argv[argc-1];
+
+    if (dump && !(fp = fopen(dump, "r"))) {
+        fprintf(stderr, "Cannot open %s\n", dump);
+        return 1;
+    }
+    if (!(b = refcat_create(out, zone, nmag, magname))) {
+        fprintf(stderr, "Bad zone height or number of magnitudes\n");
+        return 1;
+    }
+
+    /* once to count the sources of each zone, once to write them */
+    for (pass=0; pass<2 && ok; pass++) {
+        srand48(1);
+        if (fp) rewind(fp);
+        for (nline=0; nsynth ? nline<nsynth : getline(&line, &cap, fp) > 0; nline++) {
+            if (nsynth)
+                random_source(&ra, &dec, mag, nmag);
+            else if (parse_source(line, sep, col, nmag, &ra, &dec, mag)) {
+                nbad += !pass;
+                continue;
+            }
+            if (!pass)
+                refcat_count(b, dec);
+            else if (refcat_put(b, ra, dec, mag)) {
+                fprintf(stderr, "%s changed while it was read\n", dump);
+                ok = 0;
+                break;
+            }
+        }
+        if (!pass && refcat_layout(b)) {
+            fprintf(stderr, "Cannot write %s\n", out);
+            ok = 0;
+        }
+    }
+
+    if (fp) fclose(fp);
+    free(line);
+    if (refcat_finish(b, ok)) {
+        if (ok)
+            fprintf(stderr, "Cannot write %s\n", out);
+        return 1;
+    }
+    if (nbad)
+        fprintf(stderr, "%ld lines skipped\n", nbad);
+
+    return 0;
+}
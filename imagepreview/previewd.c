@@ -0,0 +1,908 @@
+//
+//  previewd.c
+//  imagepreview
+//
+//  preview -D socket: a long-lived renderer for the web front end, which
+//  would otherwise start a process, PGPLOT and CFITSIO for every view. It
+//  listens on a UNIX socket and each connection sends one request a line,
+//
+//      file=v20091103_00368_st.fit hdu=12 size=512 t=10 c=1 format=png
+//
+//  answered with "OK bytes width height format" and the image, or with
+//  "ERR message". Keys, with the command line options they mirror:
+//
+//      file=name      the image, or the first word of the line
+//      hdu=1          extension, 0 for the primary
+//      x=bl           section as -x, or region=x1:x2,y1:y2 in pixels
+//      size=512       longest side of the image returned, in pixels
+//      t=10           contrast in sigmas, as -t
+//      z=1            sky from the pixels rather than SKYLEVEL, SKYNOISE, as -z
+//      c=1            ellipses from the _cat.fits catalogue, as -c, and h=2 as -h
+//      format=pgm     pgm (ppm with c=1) or png
+//
+//  The pixels of an HDU, copies of it binned by 2, 4, 8 and 16 and its sky
+//  statistics are worked out once and kept, least recently used first out,
+//  up to IMAGEPREVIEW_DAEMON_MAXSIZE MB [1024], together with the catalogue
+//  sources and the open files they came from; a repeat view only samples
+//  the nearest binned copy. Connections are served by a pool of workers,
+//  IMAGEPREVIEW_WORKERS of them [one per processor]. Nothing here calls
+//  PGPLOT, which is not reentrant; CFITSIO needs to be built reentrant.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <zlib.h>
+#include "fitsio.h"
+
+#define PD_QUEUE 64             /* requests waiting for a worker */
+#define PD_CONNS 1024           /* connections open at once */
+#define PD_FILES 16             /* files kept open */
+#define PD_ENTRIES 1024
+#define PD_NLEVEL 5             /* the HDU and binned by 2, 4, 8, 16 */
+#define PD_NSAMPLE 1000
+#define PD_LINE 4096
+#define PD_MAXSIZE 4096         /* largest image returned */
+
+enum { PD_IMAGE, PD_CATALOGUE };
+
+void zscale_r(float m[], int n, float *median, float *mad);
+int ellipse_vertices(float xc, float yc, float a, float b, float pa, float devpix, float *xe, float *ye);
+void kern_scale_u8(const float *x, long n, float scale, float off, float top, unsigned char *dst);
+void kern_bin2(const float *src, long nx, long ny, float *dst);
+int kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status);
+void section_limits(int section, long naxes[], int *x1, int *x2, int *y1, int *y2);
+
+typedef struct cat_reader CAT_READER;
+CAT_READER *cat_open(char *filename, int *status);
+int cat_column(CAT_READER *cat, char *name);
+int cat_has_column(CAT_READER *cat, int slot);
+int cat_select(CAT_READER *cat, int hdu, long *nrows, int *status);
+int cat_read(CAT_READER *cat, int slot, long firstrow, long nrows, float *dest, int *status);
+int cat_close(CAT_READER *cat, int *status);
+
+struct pd_file
+{
+    char name[1024];
+    time_t mtime;
+    off_t size;
+    fitsfile *fptr;
+    int refs;
+    unsigned long used;
+    pthread_mutex_t lock;       /* held while the file is read */
+};
+
+/* An HDU or the catalogue rows for it, read by the first request that
+ * wants it while the others wait, and not changed after. */
+struct pd_entry
+{
+    char file[1024];
+    int hdu, kind;
+    time_t mtime;
+    off_t size;
+    int state;                  /* 0 being read, 1 ready */
+    int status;
+    int refs;
+    unsigned long used;
+    size_t bytes;
+
+    long nx[PD_NLEVEL], ny[PD_NLEVEL];
+    float *level[PD_NLEVEL];
+    float skylevel, skynoise;   /* from the header, when hdrsky */
+    float median, mad;          /* from a sample of the pixels */
+    int hdrsky;
+
+    long nsrc;
+    float *src;                 /* x, y, a, b, pa of each source */
+};
+
+struct pd_conn
+{
+    int fd;
+    size_t have;
+    char buf[PD_LINE];          /* what has come of the next requests */
+};
+
+struct pd_request
+{
+    char file[1024];
+    int hdu, section, x1, x2, y1, y2, size, dozscale, catalogue, png;
+    float sigma, cheight;
+};
+
+static struct pd_file files[PD_FILES];
+static struct pd_entry *entries[PD_ENTRIES];
+static int nentries;
+static size_t cached, maxcached;
+static unsigned long ticks;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+
+static struct pd_conn *queue[PD_QUEUE];
+static int qhead, qlen, nconns;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qroom = PTHREAD_COND_INITIALIZER;
+
+/* The open file for name, reopened if it has changed, with a reference
+ * taken; NULL with status set if it cannot be opened. Called with the
+ * lock held. */
+static struct pd_file *
+file_get(const char *name, struct stat *st, int *status)
+{
+    struct pd_file *f, *old = NULL;
+    int k;
+
+    for (k=0; k<PD_FILES; k++) {
+        f = &files[k];
+        if (f->fptr && f->mtime == st->st_mtime && f->size == st->st_size &&
+            !strcmp(f->name, name)) {
+            f->refs++;
+            f->used = ++ticks;
+            return f;
+        }
+    }
+
+    /* a free slot, else the one unused the longest that nobody is reading;
+     * the old copy of a file that has changed goes the same way */
+    for (k=0; k<PD_FILES; k++) {
+        f = &files[k];
+        if (!f->fptr) {
+            old = f;
+            break;
+        }
+        if (!f->refs && (!old || f->used < old->used))
+            old = f;
+    }
+    if (!old) {
+        *status = TOO_MANY_FILES;
+        return NULL;
+    }
+
+    f = old;
+    if (f->fptr) {
+        k = 0;
+        fits_close_file(f->fptr, &k);
+        f->fptr = NULL;
+    }
+    if (fits_open_file(&f->fptr, name, READONLY, status)) {
+        f->fptr = NULL;
+        return NULL;
+    }
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->mtime = st->st_mtime;
+    f->size = st->st_size;
+    f->refs = 1;
+    f->used = ++ticks;
+
+    return f;
+}
+
+static void
+entry_free(struct pd_entry *e)
+{
+    int k;
+
+    for (k=0; k<PD_NLEVEL; k++)
+        free(e->level[k]);
+    free(e->src);
+    free(e);
+}
+
+/* Drops the entries unused the longest that nobody holds until the rest
+ * fit in the budget. Called with the lock held. */
+static void
+entry_evict(void)
+{
+    int k, old;
+
+    while (cached > maxcached) {
+        for (k=0, old=-1; k<nentries; k++)
+            if (!entries[k]->refs && entries[k]->state &&
+                (old < 0 || entries[k]->used < entries[old]->used))
+                old = k;
+        if (old < 0)
+            return;
+        cached -= entries[old]->bytes;
+        entry_free(entries[old]);
+        entries[old] = entries[--nentries];
+    }
+}
+
+/* 2x2 means of src, the last row and column of an odd size on their own. */
+static float *
+bin2(const float *src, long nx, long ny, long *mx, long *my)
+{
+    float *dst;
+
+    *mx = (nx + 1) / 2;
+    *my = (ny + 1) / 2;
+    if (!(dst = malloc(*mx * *my * sizeof(float))))
+        return NULL;
+    kern_bin2(src, nx, ny, dst);
+    return dst;
+}
+
+static int
+load_image(struct pd_entry *e, fitsfile *fptr)
+{
+    float sample[PD_NSAMPLE];
+    long naxes[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1}, npix, i, j;
+    unsigned int seed = 12345;
+    int k, bitpix, naxis, hdutype, status = 0;
+    char comment[81];
+
+    fits_movabs_hdu(fptr, e->hdu + 1, &hdutype, &status);
+    fits_get_img_param(fptr, 9, &bitpix, &naxis, naxes, &status);
+    if (status)
+        return status;
+    if (hdutype != IMAGE_HDU || naxis < 2)
+        return NOT_IMAGE;
+
+    npix = naxes[0] * naxes[1];
+    if (!(e->level[0] = malloc(npix * sizeof(float))))
+        return MEMORY_ALLOCATION;
+    kern_read_img(fptr, 1, npix, e->level[0], &status);
+    if (status)
+        return status;
+
+    fits_read_key(fptr, TFLOAT, "SKYLEVEL", &e->skylevel, comment, &status);
+    fits_read_key(fptr, TFLOAT, "SKYNOISE", &e->skynoise, comment, &status);
+    e->hdrsky = !status;
+
+    for (i=0; i<PD_NSAMPLE; i++) {
+        j = rand_r(&seed)*1.0*npix/RAND_MAX;
+        if (j >= npix) j = npix-1;
+        sample[i] = e->level[0][j];
+    }
+    zscale_r(sample, PD_NSAMPLE, &e->median, &e->mad);
+
+    e->nx[0] = naxes[0];
+    e->ny[0] = naxes[1];
+    e->bytes = npix * sizeof(float);
+    for (k=1; k<PD_NLEVEL && e->nx[k-1] > 64 && e->ny[k-1] > 64; k++) {
+        if (!(e->level[k] = bin2(e->level[k-1], e->nx[k-1], e->ny[k-1], &e->nx[k], &e->ny[k])))
+            return MEMORY_ALLOCATION;
+        e->bytes += e->nx[k] * e->ny[k] * sizeof(float);
+    }
+
+    return 0;
+}
+
+/* The sources of the _cat.fits catalogue next to the image, as -c finds
+ * it, in the table of the same extension. */
+static int
+load_catalogue(struct pd_entry *e)
+{
+    CAT_READER *cat;
+    char name[1024], *p;
+    float *col;
+    long n = 0, i;
+    int k, slot[5], status = 0;
+    static char *colname[5] = {"x_coordinate", "y_coordinate", "gaussian_sigma",
+                               "ellipticity", "position_angle"};
+
+    if (!(p = strstr(e->file, ".fit")))
+        return FILE_NOT_OPENED;
+    snprintf(name, sizeof(name), "%.*s_cat.fits%s", (int)(p - e->file), e->file, p + 4);
+    if ((p = strchr(name, '[')))
+        *p = '\0';
+
+    if (!(cat = cat_open(name, &status)))
+        return status;
+    for (k=0; k<5; k++)
+        slot[k] = cat_column(cat, colname[k]);
+    if (cat_select(cat, e->hdu > 0 ? e->hdu + 1 : 2, &n, &status)) {
+        k = 0;
+        cat_close(cat, &k);
+        return status;
+    }
+
+    e->src = malloc(5 * (n > 0 ? n : 1) * sizeof(float));
+    col = malloc((n > 0 ? n : 1) * sizeof(float));
+    if (!status && (!e->src || !col))
+        status = MEMORY_ALLOCATION;
+    for (k=0; !status && k<5; k++) {
+        if (k < 2 || cat_has_column(cat, slot[k]))
+            cat_read(cat, slot[k], 1, n, col, &status);
+        else
+            for (i=0; i<n; i++) col[i] = (k == 2) ? 1.0 : 0.0;
+        for (i=0; i<n; i++)
+            e->src[5*i + k] = col[i];
+    }
+    free(col);
+    e->nsrc = n;
+    e->bytes = 5 * n * sizeof(float);
+
+    k = 0;
+    cat_close(cat, &k);
+    return status;
+}
+
+/* The cache entry of kind for the HDU of the request with a reference
+ * taken, read in if it is not there, or NULL with status set. */
+static struct pd_entry *
+entry_get(struct pd_request *rq, int kind, int *status)
+{
+    struct pd_entry *e = NULL;
+    struct pd_file *f;
+    struct stat st;
+    char *p, name[1024];
+    int k;
+
+    snprintf(name, sizeof(name), "%s", rq->file);
+    if ((p = strchr(name, '[')))
+        *p = '\0';
+    if (stat(name, &st)) {
+        *status = FILE_NOT_OPENED;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        for (k=0; k<nentries; k++) {
+            e = entries[k];
+            if (e->kind == kind && e->hdu == rq->hdu && e->mtime == st.st_mtime &&
+                e->size == st.st_size && !strcmp(e->file, rq->file))
+                break;
+        }
+        if (k == nentries)
+            break;
+        if (e->state) {
+            e->refs++;
+            e->used = ++ticks;
+            *status = e->status;
+            pthread_mutex_unlock(&lock);
+            return e;
+        }
+        /* being read by another worker */
+        pthread_cond_wait(&loaded, &lock);
+    }
+
+    if (nentries == PD_ENTRIES) {
+        for (k=0; k<nentries; k++)
+            if (!entries[k]->refs && entries[k]->state)
+                break;
+        if (k == nentries) {
+            pthread_mutex_unlock(&lock);
+            *status = MEMORY_ALLOCATION;
+            return NULL;
+        }
+        cached -= entries[k]->bytes;
+        entry_free(entries[k]);
+        entries[k] = entries[--nentries];
+    }
+    if (!(e = calloc(1, sizeof(struct pd_entry)))) {
+        pthread_mutex_unlock(&lock);
+        *status = MEMORY_ALLOCATION;
+        return NULL;
+    }
+    snprintf(e->file, sizeof(e->file), "%s", rq->file);
+    e->hdu = rq->hdu;
+    e->kind = kind;
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->refs = 1;
+    e->used = ++ticks;
+    entries[nentries++] = e;
+    f = (kind == PD_IMAGE) ? file_get(rq->file, &st, &e->status) : NULL;
+    pthread_mutex_unlock(&lock);
+
+    /* read without the lock, so that other HDUs can be served meanwhile */
+    if (kind == PD_CATALOGUE)
+        e->status = load_catalogue(e);
+    else if (f) {
+        pthread_mutex_lock(&f->lock);
+        e->status = load_image(e, f->fptr);
+        pthread_mutex_unlock(&f->lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (f)
+        f->refs--;
+    pthread_cond_broadcast(&loaded);
+    if (e->status) {
+        /* not kept, so that the next request for it reads it again: the
+         * file may have been busy, or memory short, only for now */
+        for (k=0; entries[k] != e; k++);
+        entries[k] = entries[--nentries];
+        pthread_mutex_unlock(&lock);
+        *status = e->status;
+        entry_free(e);
+        return NULL;
+    }
+    e->state = 1;
+    cached += e->bytes;
+    entry_evict();
+    pthread_mutex_unlock(&lock);
+
+    *status = 0;
+    return e;
+}
+
+static void
+entry_put(struct pd_entry *e)
+{
+    pthread_mutex_lock(&lock);
+    e->refs--;
+    entry_evict();
+    pthread_mutex_unlock(&lock);
+}
+
+/* A line from (x0, y0) to (x1, y1) in red. */
+static void
+draw_line(unsigned char *rgb, int w, int h, float x0, float y0, float x1, float y1)
+{
+    float dx = x1 - x0, dy = y1 - y0, t;
+    int n, k, i, j;
+
+    n = (int)fmaxf(fabsf(dx), fabsf(dy)) + 1;
+    for (k=0; k<=n; k++) {
+        t = (float)k / n;
+        i = (int)(x0 + t*dx);
+        j = (int)(y0 + t*dy);
+        if (i >= 0 && i < w && j >= 0 && j < h) {
+            rgb[3*(j*w + i)] = 255;
+            rgb[3*(j*w + i) + 1] = 0;
+            rgb[3*(j*w + i) + 2] = 0;
+        }
+    }
+}
+
+static void
+be32(unsigned char *p, unsigned long v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* A PNG chunk at out: length, type, data and CRC. Returns its size. */
+static size_t
+png_chunk(unsigned char *out, const char *type, const unsigned char *data, size_t len)
+{
+    be32(out, len);
+    memcpy(out + 4, type, 4);
+    if (len && data != out + 8)
+        memmove(out + 8, data, len);
+    be32(out + 8 + len, crc32(crc32(0L, Z_NULL, 0), out + 4, len + 4));
+    return len + 12;
+}
+
+/* pix, w by h of grey or rgb as channels says, as a PNG: one IDAT,
+ * compressed fast, each row with the filter byte 0. */
+static unsigned char *
+png_encode(const unsigned char *pix, int w, int h, int channels, size_t *len)
+{
+    static const unsigned char sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    unsigned char *raw, *out, ihdr[13];
+    uLongf zlen;
+    size_t rowlen = (size_t)w * channels + 1, n;
+    int j;
+
+    if (!(raw = malloc(rowlen * h)))
+        return NULL;
+    for (j=0; j<h; j++) {
+        raw[j*rowlen] = 0;
+        memcpy(raw + j*rowlen + 1, pix + (size_t)j * w * channels, rowlen - 1);
+    }
+    zlen = compressBound(rowlen * h);
+    if (!(out = malloc(8 + 25 + 12 + zlen + 12))) {
+        free(raw);
+        return NULL;
+    }
+    memcpy(out, sig, 8);
+    be32(ihdr, w);
+    be32(ihdr + 4, h);
+    ihdr[8] = 8;
+    ihdr[9] = (channels == 3) ? 2 : 0;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    n = 8 + png_chunk(out + 8, "IHDR", ihdr, 13);
+    if (compress2(out + n + 8, &zlen, raw, rowlen * h, Z_BEST_SPEED) != Z_OK) {
+        free(raw);
+        free(out);
+        return NULL;
+    }
+    n += png_chunk(out + n, "IDAT", out + n + 8, zlen);
+    n += png_chunk(out + n, "IEND", NULL, 0);
+    free(raw);
+
+    *len = n;
+    return out;
+}
+
+/* The view asked for, encoded, with its size; NULL with status set. */
+static unsigned char *
+render(struct pd_request *rq, size_t *len, int *width, int *height, int *channels, int *status)
+{
+    struct pd_entry *e, *c = NULL;
+    const float *pix, *s;
+    unsigned char *img, *out, *p;
+    char head[64];
+    float *row, z1, z2, scale, off, step, xe[61], ye[61], u, v, a;
+    long naxes[2], i, n, *col;
+    int x1, x2, y1, y2, w, h, k, lv, j, nh, nc;
+
+    if (!(e = entry_get(rq, PD_IMAGE, status)))
+        return NULL;
+
+    naxes[0] = e->nx[0];
+    naxes[1] = e->ny[0];
+    section_limits(rq->section, naxes, &x1, &x2, &y1, &y2);
+    if (rq->x2 > 0) {
+        x1 = rq->x1;  x2 = rq->x2;
+        y1 = rq->y1;  y2 = rq->y2;
+    }
+    if (x1 < 1) x1 = 1;
+    if (y1 < 1) y1 = 1;
+    if (x2 > naxes[0]) x2 = naxes[0];
+    if (y2 > naxes[1]) y2 = naxes[1];
+    if (x2 < x1 || y2 < y1) {
+        entry_put(e);
+        *status = BAD_PIX_NUM;
+        return NULL;
+    }
+
+    /* image pixels a returned pixel, and the most binned copy finer than that */
+    step = fmaxf((float)(x2 - x1 + 1) / rq->size, (float)(y2 - y1 + 1) / rq->size);
+    if (step < 1.0) step = 1.0;
+    w = (int)ceilf((x2 - x1 + 1) / step);
+    h = (int)ceilf((y2 - y1 + 1) / step);
+    for (lv=0; lv+1<PD_NLEVEL && e->level[lv+1] && (1 << (lv+1)) <= step; lv++);
+    pix = e->level[lv];
+
+    if (rq->dozscale || !e->hdrsky) {
+        z1 = e->median - rq->sigma * e->mad / 1.2;
+        z2 = e->median + rq->sigma * e->mad;
+    } else {
+        z1 = e->skylevel - rq->sigma * e->skynoise / 1.2;
+        z2 = e->skylevel + rq->sigma * e->skynoise;
+    }
+    if (z2 <= z1) z2 = z1 + 1.0;
+    /* grey as cpgctab with contrast 1.5 and brightness 0.5 gives it */
+    scale = 1.5 * 255.0 / (z2 - z1);
+    off = 127.5 - scale * 0.5 * (z1 + z2);
+
+    /* the image without the sources if they cannot be had */
+    if (rq->catalogue && !(c = entry_get(rq, PD_CATALOGUE, status)))
+        *status = 0;
+    nc = c ? 3 : 1;
+
+    col = malloc(w * sizeof(long));
+    row = malloc(w * sizeof(float));
+    img = malloc((size_t)w * h * nc);
+    if (!col || !row || !img) {
+        free(col);
+        free(row);
+        free(img);
+        entry_put(e);
+        if (c) entry_put(c);
+        *status = MEMORY_ALLOCATION;
+        return NULL;
+    }
+    for (i=0; i<w; i++) {
+        col[i] = (long)((x1 - 1 + (i + 0.5) * step) / (1 << lv));
+        if (col[i] >= e->nx[lv]) col[i] = e->nx[lv] - 1;
+    }
+
+    /* the top row first, as the images are shown */
+    for (j=0; j<h; j++) {
+        n = (long)((y1 - 1 + (h - j - 0.5) * step) / (1 << lv));
+        if (n >= e->ny[lv]) n = e->ny[lv] - 1;
+        s = pix + n * e->nx[lv];
+        p = img + (size_t)j * w * nc;
+        for (i=0; i<w; i++)
+            row[i] = s[col[i]];
+        /* grey into the last third of an RGB row, spread out from the front:
+         * the writes never overtake the reads */
+        kern_scale_u8(row, w, scale, off, 255.0f, p + (size_t)(nc - 1) * w);
+        if (nc == 3)
+            for (i=0; i<w; i++)
+                p[3*i] = p[3*i+1] = p[3*i+2] = p[2*w + i];
+    }
+    free(col);
+    free(row);
+
+    if (c) {
+        for (i=0; i<c->nsrc; i++) {
+            s = c->src + 5*i;
+            a = 2.4 * rq->cheight * s[2];
+            if (s[0] + a < x1 || s[0] - a > x2 || s[1] + a < y1 || s[1] - a > y2)
+                continue;
+            u = (s[0] - x1 + 0.5) / step;
+            v = h - (s[1] - y1 + 0.5) / step;
+            /* y runs down here, which turns the position angle round */
+            nh = ellipse_vertices(u, v, a / step, a * (1 - s[3]) / step, -s[4], 1.0, xe, ye);
+            if (nh)
+                for (k=0; k+1<nh; k++)
+                    draw_line(img, w, h, xe[k], ye[k], xe[k+1], ye[k+1]);
+            else
+                draw_line(img, w, h, u, v, u, v);
+        }
+        entry_put(c);
+    }
+    entry_put(e);
+
+    if (rq->png) {
+        out = png_encode(img, w, h, nc, len);
+        free(img);
+    } else {
+        k = snprintf(head, sizeof(head), "P%d\n%d %d\n255\n", nc == 3 ? 6 : 5, w, h);
+        if ((out = malloc(k + (size_t)w * h * nc))) {
+            memcpy(out, head, k);
+            memcpy(out + k, img, (size_t)w * h * nc);
+            *len = k + (size_t)w * h * nc;
+        }
+        free(img);
+    }
+    if (!out)
+        *status = MEMORY_ALLOCATION;
+
+    *width = w;
+    *height = h;
+    *channels = nc;
+    return out;
+}
+
+/* Fills rq from a request line; returns a complaint or NULL. */
+static const char *
+parse_request(char *line, struct pd_request *rq)
+{
+    static const char *sections[] = {"bl", "tl", "tr", "br", "cc"};
+    char *tok, *val, *save;
+    int k;
+
+    memset(rq, 0, sizeof(struct pd_request));
+    rq->hdu = 1;
+    rq->size = 512;
+    rq->sigma = 10.0;
+    rq->cheight = 2.0;
+
+    for (tok = strtok_r(line, " \t\r", &save); tok; tok = strtok_r(NULL, " \t\r", &save)) {
+        if (!(val = strchr(tok, '='))) {
+            if (rq->file[0])
+                return "more than one file";
+            snprintf(rq->file, sizeof(rq->file), "%s", tok);
+            continue;
+        }
+        *val++ = '\0';
+        if (!strcmp(tok, "file"))
+            snprintf(rq->file, sizeof(rq->file), "%s", val);
+        else if (!strcmp(tok, "hdu"))
+            rq->hdu = atoi(val);
+        else if (!strcmp(tok, "size"))
+            rq->size = atoi(val);
+        else if (!strcmp(tok, "t"))
+            rq->sigma = atof(val);
+        else if (!strcmp(tok, "z"))
+            rq->dozscale = atoi(val);
+        else if (!strcmp(tok, "c"))
+            rq->catalogue = atoi(val);
+        else if (!strcmp(tok, "h"))
+            rq->cheight = atof(val);
+        else if (!strcmp(tok, "format")) {
+            if (!strcmp(val, "png"))
+                rq->png = 1;
+            else if (strcmp(val, "pgm") && strcmp(val, "ppm"))
+                return "format is pgm or png";
+        } else if (!strcmp(tok, "x")) {
+            for (k=0; k<5 && strcmp(val, sections[k]); k++);
+            if (k == 5)
+                return "section is bl, tl, tr, br or cc";
+            rq->section = k + 1;
+        } else if (!strcmp(tok, "region")) {
+            if (sscanf(val, "%d:%d,%d:%d", &rq->x1, &rq->x2, &rq->y1, &rq->y2) != 4 || rq->x2 < 1)
+                return "region is x1:x2,y1:y2";
+        } else
+            return "unknown key";
+    }
+
+    if (!rq->file[0])
+        return "no file";
+    if (rq->hdu < 0 || rq->size < 1 || rq->size > PD_MAXSIZE)
+        return "hdu or size out of range";
+    return NULL;
+}
+
+static int
+send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if ((n = send(fd, p, len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* The next request of a connection, once a whole line of it has come.
+ * Returns 0 to wait for more from it, -1 when it is to be closed. */
+static int
+serve(struct pd_conn *conn)
+{
+    struct pd_request rq;
+    char head[128], errtext[FLEN_STATUS], *eol;
+    const char *complaint;
+    unsigned char *img;
+    size_t len;
+    ssize_t n;
+    int w, h, nc, status, ok;
+
+    /* the poll said there is something, so this does not block */
+    if (!(eol = memchr(conn->buf, '\n', conn->have))) {
+        if (conn->have == sizeof(conn->buf))
+            return -1;          /* no line is that long */
+        if ((n = recv(conn->fd, conn->buf + conn->have, sizeof(conn->buf) - conn->have, 0)) <= 0)
+            return (n < 0 && errno == EINTR) ? 0 : -1;
+        conn->have += n;
+        if (!(eol = memchr(conn->buf, '\n', conn->have)))
+            return 0;
+    }
+    *eol = '\0';
+
+    status = 0;
+    img = NULL;
+    if ((complaint = parse_request(conn->buf, &rq)))
+        snprintf(head, sizeof(head), "ERR %s\n", complaint);
+    else if (!(img = render(&rq, &len, &w, &h, &nc, &status))) {
+        fits_get_errstatus(status, errtext);
+        snprintf(head, sizeof(head), "ERR %s\n", errtext);
+    } else
+        snprintf(head, sizeof(head), "OK %lu %d %d %s\n", (unsigned long)len, w, h,
+                 rq.png ? "png" : nc == 3 ? "ppm" : "pgm");
+
+    ok = !send_all(conn->fd, head, strlen(head)) && (!img || !send_all(conn->fd, img, len));
+    free(img);
+
+    conn->have -= eol + 1 - conn->buf;
+    memmove(conn->buf, eol + 1, conn->have);
+    return ok ? 0 : -1;
+}
+
+/* Serves one request at a time from whichever connection the poll loop
+ * found ready, and hands the connection back to it, so that a client
+ * that keeps its connection open does not keep a worker. */
+static void *
+worker(void *arg)
+{
+    struct pd_conn *conn;
+    int gone, back = *(int *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&qlock);
+        while (!qlen)
+            pthread_cond_wait(&qwork, &qlock);
+        conn = queue[qhead];
+        qhead = (qhead + 1) % PD_QUEUE;
+        qlen--;
+        pthread_cond_signal(&qroom);
+        pthread_mutex_unlock(&qlock);
+
+        /* a request already in the buffer is served straight after */
+        while (!(gone = serve(conn)) && memchr(conn->buf, '\n', conn->have));
+        if (!gone && write(back, &conn, sizeof(conn)) == sizeof(conn))
+            continue;
+        close(conn->fd);
+        free(conn);
+        pthread_mutex_lock(&qlock);
+        nconns--;
+        pthread_mutex_unlock(&qlock);
+    }
+    return NULL;
+}
+
+static void
+enqueue(struct pd_conn *conn)
+{
+    pthread_mutex_lock(&qlock);
+    while (qlen == PD_QUEUE)
+        pthread_cond_wait(&qroom, &qlock);
+    queue[(qhead + qlen++) % PD_QUEUE] = conn;
+    pthread_cond_signal(&qwork);
+    pthread_mutex_unlock(&qlock);
+}
+
+/* Serves requests on the UNIX socket path until killed. Returns 1 when it
+ * cannot listen. */
+int
+daemon_serve(const char *path)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd[PD_CONNS + 2];
+    struct pd_conn *idle[PD_CONNS], *conn;
+    pthread_t thread;
+    char *env;
+    int fd, client, k, full, nidle = 0, nworkers, back[2];
+
+    maxcached = ((env = getenv("IMAGEPREVIEW_DAEMON_MAXSIZE")) ? atol(env) : 1024) << 20;
+    nworkers = (env = getenv("IMAGEPREVIEW_WORKERS")) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1)
+        nworkers = 1;
+    for (k=0; k<PD_FILES; k++)
+        pthread_mutex_init(&files[k].lock, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, PD_QUEUE) || pipe(back)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    /* a client that goes away mid-answer is not a reason to stop */
+    signal(SIGPIPE, SIG_IGN);
+    for (k=0; k<nworkers; k++)
+        if (!pthread_create(&thread, NULL, worker, &back[1]))
+            pthread_detach(thread);
+    printf("Serving on %s with %d workers, %lu MB of cache\n", path, nworkers,
+           (unsigned long)(maxcached >> 20));
+    fflush(stdout);
+
+    /* new connections, connections handed back by the workers, and those
+     * of them with a request coming */
+    for (;;) {
+        pfd[0].fd = fd;
+        pfd[1].fd = back[0];
+        pfd[0].events = pfd[1].events = POLLIN;
+        for (k=0; k<nidle; k++) {
+            pfd[k+2].fd = idle[k]->fd;
+            pfd[k+2].events = POLLIN;
+        }
+        if (poll(pfd, nidle + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            return 1;
+        }
+
+        for (k=nidle-1; k>=0; k--)
+            if (pfd[k+2].revents) {
+                enqueue(idle[k]);
+                idle[k] = idle[--nidle];
+            }
+        if ((pfd[1].revents & POLLIN) && read(back[0], &conn, sizeof(conn)) == sizeof(conn))
+            idle[nidle++] = conn;
+        if ((pfd[0].revents & POLLIN) && (client = accept(fd, NULL, NULL)) >= 0) {
+            pthread_mutex_lock(&qlock);
+            if (!(full = nconns == PD_CONNS))
+                nconns++;
+            pthread_mutex_unlock(&qlock);
+            if (!full && (conn = calloc(1, sizeof(struct pd_conn)))) {
+                conn->fd = client;
+                idle[nidle++] = conn;
+            } else {
+                close(client);
+                if (!full) {
+                    pthread_mutex_lock(&qlock);
+                    nconns--;
+                    pthread_mutex_unlock(&qlock);
+                }
+            }
+        }
+    }
+}
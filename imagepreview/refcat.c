@@ -0,0 +1,440 @@
+//
+//  refcat.c
+//  imagepreview
+//
+//  Local reference catalogue index, for cone searches where the archive
+//  cannot be reached. Sources are kept as integer RA and Dec (milliarcsec)
+//  and up to four magnitudes (millimag) in declination zones, each sorted
+//  by RA, so that a cone is a binary search and a short scan in the few
+//  zones it crosses. The index is mapped into memory, not read.
+//
+//  mkrefcat builds the index from a text dump in two passes, counting the
+//  sources of each zone first and then writing each one straight into its
+//  place in the mapped output.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define REFCAT_MAGIC "IPREFCT"
+#define REFCAT_VERSION 1
+#define REFCAT_BYTEORDER 0x01020304
+#define REFCAT_ALIGN 64
+#define REFCAT_MAXMAG 4
+#define REFCAT_NOMAG 32767
+
+#define MAS_PER_DEG 3600000.0
+#define D2R (M_PI/180.0)
+
+/* index layout: the header, nzone+1 record numbers where the zones start,
+ * then the records from the first REFCAT_ALIGN boundary after them */
+struct refcat_head
+{
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t version;
+    int32_t nzone;
+    int32_t nmag;
+    double zone;                    /* zone height, degrees */
+    int64_t nrec;
+    char magname[REFCAT_MAXMAG][16];
+};
+
+struct refcat_rec
+{
+    int32_t ra, dec;                /* milliarcsec */
+    int16_t mag[REFCAT_MAXMAG];     /* millimag, REFCAT_NOMAG when absent */
+};
+
+struct refcat
+{
+    char *map;
+    size_t maplen;
+    const struct refcat_head *head;
+    const int64_t *zstart;
+    const struct refcat_rec *rec;
+};
+
+typedef struct refcat REFCAT;
+
+struct refcat_build
+{
+    char path[1024], tmp[1040];
+    struct refcat_head head;
+    int64_t *count;                 /* per zone in the first pass, then the next free slot */
+    int64_t nput;
+    char *map;
+    size_t maplen;
+    struct refcat_rec *rec;
+    int fd;
+};
+
+typedef struct refcat_build REFCAT_BUILD;
+
+static size_t
+records_offset(int nzone)
+{
+    size_t off = sizeof(struct refcat_head) + (nzone+1) * sizeof(int64_t);
+
+    return (off + REFCAT_ALIGN-1) / REFCAT_ALIGN * REFCAT_ALIGN;
+}
+
+static int
+zone_of(const struct refcat_head *head, double dec)
+{
+    int z = (int)floor((dec + 90.0) / head->zone);
+
+    if (z < 0) z = 0;
+    if (z >= head->nzone) z = head->nzone-1;
+    return z;
+}
+
+static int32_t
+ra_mas(double ra)
+{
+    double a = fmod(ra, 360.0);
+    int32_t m;
+
+    if (a < 0) a += 360.0;
+    m = (int32_t)floor(a * MAS_PER_DEG + 0.5);
+    return m >= (int32_t)(360 * MAS_PER_DEG) ? 0 : m;
+}
+
+REFCAT *
+refcat_open(const char *path)
+{
+    struct refcat_head head;
+    struct stat st;
+    REFCAT *rc;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(head) ||
+        read(fd, &head, sizeof(head)) != sizeof(head) ||
+        memcmp(head.magic, REFCAT_MAGIC, 8) || head.byteorder != REFCAT_BYTEORDER ||
+        head.version != REFCAT_VERSION || head.nzone < 1 || head.nrec < 0 ||
+        (size_t)st.st_size != records_offset(head.nzone) + head.nrec * sizeof(struct refcat_rec)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    rc = malloc(sizeof(REFCAT));
+    if (!rc) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    rc->map = map;
+    rc->maplen = st.st_size;
+    rc->head = (const struct refcat_head *)map;
+    rc->zstart = (const int64_t *)(map + sizeof(struct refcat_head));
+    rc->rec = (const struct refcat_rec *)(map + records_offset(head.nzone));
+
+    return rc;
+}
+
+/* Calls fn on each source within radius (degrees) of (ra, dec), zone by
+ * zone, and returns how many there were. */
+static long
+cone_scan(REFCAT *rc, double ra, double dec, double radius,
+          void (*fn)(const struct refcat_rec *r, void *arg), void *arg)
+{
+    const struct refcat_rec *r, *end;
+    double cosr = cos(radius*D2R), x0, y0, z0, a, d, cd, dra;
+    int32_t lo[2], hi[2], dmas, rmas;
+    int64_t b, e, mid;
+    int zone, z1, z2, nrange, k;
+    long found = 0;
+
+    x0 = cos(dec*D2R) * cos(ra*D2R);
+    y0 = cos(dec*D2R) * sin(ra*D2R);
+    z0 = sin(dec*D2R);
+    dmas = (int32_t)floor(dec * MAS_PER_DEG + 0.5);
+    rmas = (int32_t)ceil(radius * MAS_PER_DEG) + 1;
+
+    /* the RA extent of the cone, in one range or two across 0h */
+    nrange = 1;
+    lo[0] = 0;
+    hi[0] = (int32_t)(360 * MAS_PER_DEG);
+    if (fabs(dec) + radius < 90.0 && (dra = asin(sin(radius*D2R) / cos(dec*D2R)) / D2R) < 180.0) {
+        lo[0] = ra_mas(ra - dra);
+        hi[0] = ra_mas(ra + dra);
+        if (lo[0] > hi[0]) {
+            lo[1] = 0;
+            hi[1] = hi[0];
+            hi[0] = (int32_t)(360 * MAS_PER_DEG);
+            nrange = 2;
+        }
+    }
+
+    z1 = zone_of(rc->head, dec - radius);
+    z2 = zone_of(rc->head, dec + radius);
+    for (zone=z1; zone<=z2; zone++) {
+        end = rc->rec + rc->zstart[zone+1];
+        for (k=0; k<nrange; k++) {
+            b = rc->zstart[zone];
+            e = rc->zstart[zone+1];
+            while (b < e) {
+                mid = (b + e) / 2;
+                if (rc->rec[mid].ra < lo[k]) b = mid+1; else e = mid;
+            }
+            for (r = rc->rec + b; r < end && r->ra <= hi[k]; r++) {
+                if (abs(r->dec - dmas) > rmas)
+                    continue;
+                a = r->ra / MAS_PER_DEG * D2R;
+                d = r->dec / MAS_PER_DEG * D2R;
+                cd = cos(d);
+                if (cd*cos(a)*x0 + cd*sin(a)*y0 + sin(d)*z0 < cosr)
+                    continue;
+                fn(r, arg);
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+struct cone_out
+{
+    double **radec;
+    long *n, *max;
+};
+
+static void
+add_radec(const struct refcat_rec *r, void *arg)
+{
+    struct cone_out *out = arg;
+
+    if (*out->n == *out->max) {
+        *out->max = *out->max ? 2 * *out->max : 1024;
+        *out->radec = realloc(*out->radec, 2 * *out->max * sizeof(double));
+    }
+    (*out->radec)[2 * *out->n] = r->ra / MAS_PER_DEG;
+    (*out->radec)[2 * *out->n + 1] = r->dec / MAS_PER_DEG;
+    (*out->n)++;
+}
+
+/* Appends the (ra, dec) of the sources within radius (degrees) of (ra, dec)
+ * to *radec, which holds *n of room for *max. Returns how many were added. */
+long
+refcat_cone(REFCAT *rc, double ra, double dec, double radius,
+            double **radec, long *n, long *max)
+{
+    struct cone_out out = {radec, n, max};
+
+    return cone_scan(rc, ra, dec, radius, add_radec, &out);
+}
+
+struct each_out
+{
+    void (*fn)(double ra, double dec, const double *mag, int nmag, void *arg);
+    void *arg;
+    int nmag;
+};
+
+static void
+each_source(const struct refcat_rec *r, void *arg)
+{
+    struct each_out *out = arg;
+    double mag[REFCAT_MAXMAG];
+    int m;
+
+    for (m=0; m<out->nmag; m++)
+        mag[m] = r->mag[m] == REFCAT_NOMAG ? NAN : r->mag[m] / 1000.0;
+    out->fn(r->ra / MAS_PER_DEG, r->dec / MAS_PER_DEG, mag, out->nmag, out->arg);
+}
+
+/* As refcat_cone, with the magnitudes (NAN when absent) handed to fn. */
+long
+refcat_each(REFCAT *rc, double ra, double dec, double radius,
+            void (*fn)(double ra, double dec, const double *mag, int nmag, void *arg), void *arg)
+{
+    struct each_out out = {fn, arg, rc->head->nmag};
+
+    return cone_scan(rc, ra, dec, radius, each_source, &out);
+}
+
+const char *
+refcat_magname(REFCAT *rc, int m)
+{
+    return m < rc->head->nmag ? rc->head->magname[m] : NULL;
+}
+
+long
+refcat_size(REFCAT *rc)
+{
+    return (long)rc->head->nrec;
+}
+
+void
+refcat_close(REFCAT *rc)
+{
+    if (!rc)
+        return;
+    munmap(rc->map, rc->maplen);
+    free(rc);
+}
+
+/* Starts an index at path with zones of the given height (degrees) and
+ * nmag magnitudes named by magname. Sources are given once to
+ * refcat_count, then, after refcat_layout, again in any order to
+ * refcat_put; refcat_finish sorts and puts the index in place. */
+REFCAT_BUILD *
+refcat_create(const char *path, double zone, int nmag, char **magname)
+{
+    REFCAT_BUILD *b;
+    int m;
+
+    if (zone <= 0 || zone > 180.0 || nmag < 0 || nmag > REFCAT_MAXMAG)
+        return NULL;
+
+    b = calloc(1, sizeof(REFCAT_BUILD));
+    if (!b)
+        return NULL;
+    snprintf(b->path, sizeof(b->path), "%s", path);
+    snprintf(b->tmp, sizeof(b->tmp), "%s.%d", path, (int)getpid());
+    b->head.byteorder = REFCAT_BYTEORDER;
+    b->head.version = REFCAT_VERSION;
+    b->head.nzone = (int32_t)ceil(180.0 / zone - 1e-9);
+    b->head.nmag = nmag;
+    b->head.zone = zone;
+    for (m=0; m<nmag; m++)
+        snprintf(b->head.magname[m], sizeof(b->head.magname[m]), "%s", magname[m]);
+    b->fd = -1;
+
+    b->count = calloc(b->head.nzone + 1, sizeof(int64_t));
+    if (!b->count) {
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+void
+refcat_count(REFCAT_BUILD *b, double dec)
+{
+    b->count[zone_of(&b->head, dec)]++;
+    b->head.nrec++;
+}
+
+/* Makes the output file at its full size and maps it. */
+int
+refcat_layout(REFCAT_BUILD *b)
+{
+    int64_t *zstart, next = 0;
+    int z;
+
+    b->maplen = records_offset(b->head.nzone) + b->head.nrec * sizeof(struct refcat_rec);
+    b->fd = open(b->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (b->fd < 0)
+        return -1;
+    if (ftruncate(b->fd, b->maplen))
+        return -1;
+    b->map = mmap(NULL, b->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (b->map == MAP_FAILED) {
+        b->map = NULL;
+        return -1;
+    }
+
+    /* the counts become the slot of the next source of each zone */
+    zstart = (int64_t *)(b->map + sizeof(struct refcat_head));
+    for (z=0; z<=b->head.nzone; z++) {
+        zstart[z] = next;
+        next += b->count[z];
+        b->count[z] = zstart[z];
+    }
+    b->rec = (struct refcat_rec *)(b->map + records_offset(b->head.nzone));
+
+    return 0;
+}
+
+/* mag holds nmag magnitudes, NAN for those missing. */
+int
+refcat_put(REFCAT_BUILD *b, double ra, double dec, const double *mag)
+{
+    const int64_t *zstart = (const int64_t *)(b->map + sizeof(struct refcat_head));
+    struct refcat_rec *r;
+    int z = zone_of(&b->head, dec), m;
+    double v;
+
+    /* the second pass must see the sources of the first */
+    if (b->count[z] >= zstart[z+1])
+        return -1;
+
+    r = &b->rec[b->count[z]++];
+    memset(r, 0, sizeof(*r));
+    r->ra = ra_mas(ra);
+    r->dec = (int32_t)floor(dec * MAS_PER_DEG + 0.5);
+    for (m=0; m<REFCAT_MAXMAG; m++) {
+        v = m < b->head.nmag ? mag[m] : NAN;
+        if (isnan(v))
+            r->mag[m] = REFCAT_NOMAG;
+        else
+            r->mag[m] = (int16_t)floor(fmax(-32.767, fmin(32.766, v)) * 1000.0 + 0.5);
+    }
+    b->nput++;
+
+    return 0;
+}
+
+static int
+cmp_rec(const void *a, const void *b)
+{
+    const struct refcat_rec *x = a, *y = b;
+
+    if (x->ra != y->ra)
+        return (x->ra > y->ra) - (x->ra < y->ra);
+    return (x->dec > y->dec) - (x->dec < y->dec);
+}
+
+/* Sorts the zones and renames the index into place; with ok clear, or if
+ * the passes disagree, throws it away instead. Returns 0 on success. */
+int
+refcat_finish(REFCAT_BUILD *b, int ok)
+{
+    const int64_t *zstart;
+    int z, status = -1;
+
+    if (b->map && ok && b->nput == b->head.nrec) {
+        zstart = (const int64_t *)(b->map + sizeof(struct refcat_head));
+        for (z=0; z<b->head.nzone; z++)
+            qsort(b->rec + zstart[z], zstart[z+1] - zstart[z], sizeof(struct refcat_rec), cmp_rec);
+
+        /* the magic goes in last, so an index cut short never opens */
+        memcpy(b->head.magic, REFCAT_MAGIC, 8);
+        memcpy(b->map, &b->head, sizeof(b->head));
+        status = msync(b->map, b->maplen, MS_SYNC);
+    }
+
+    if (b->map)
+        munmap(b->map, b->maplen);
+    if (b->fd >= 0 && close(b->fd))
+        status = -1;
+    if (!status && rename(b->tmp, b->path))
+        status = -1;
+    if (status && b->fd >= 0)
+        remove(b->tmp);
+
+    free(b->count);
+    free(b);
+    return status;
+}
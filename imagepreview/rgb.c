@@ -0,0 +1,240 @@
+//
+//  rgb.c
+//  imagepreview
+//
+//  Colour composites from three images. Each channel is read and scaled on
+//  its own thread with its own sky statistics, then the three are combined
+//  into PGPLOT colour indices in a single pass. Reading on three threads
+//  needs a reentrant CFITSIO; where fits_is_reentrant() says otherwise the
+//  channels are read one after another and only their scaling is threaded.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fitsio.h"
+#include "cpgplot.h"
+
+#define RGB_NSAMPLE 1000
+#define RGB_BLOCK 4096          /* pixels scaled at a time */
+
+void zscale_r(float m[], int n, float *median, float *mad);
+void kern_scale_u8(const float *x, long n, float scale, float off, float top, unsigned char *dst);
+int kern_read_img(fitsfile *fptr, long first, long n, float *array, int *status);
+
+struct rgb_channel
+{
+    char *filename;
+    float sigma;                /* contrast, as the -t option */
+    int dozscale;
+    unsigned int seed;
+    int load;                   /* read on the channel's own thread */
+
+    float *array;
+    long naxes[2];
+    float skylevel, skynoise;
+    int hdrsky;                 /* both keywords were in the header */
+    float z1, z2;
+    int status;
+};
+
+/* read one channel and its sky keywords */
+static void
+rgb_load(struct rgb_channel *ch)
+{
+    fitsfile *fptr;
+    int bitpix, naxis, status = 0;
+    long npix, naxes[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+    char comment[81];
+
+    if (fits_open_image(&fptr, ch->filename, READONLY, &status)) {
+        ch->status = status;
+        return;
+    }
+
+    fits_get_img_param(fptr, 9, &bitpix, &naxis, naxes, &status);
+    npix = naxes[0] * naxes[1];
+    ch->naxes[0] = naxes[0];
+    ch->naxes[1] = naxes[1];
+
+    ch->array = (float *) malloc(npix * sizeof(float));
+    if (!ch->array) {
+        ch->status = MEMORY_ALLOCATION;
+        fits_close_file(fptr, &status);
+        return;
+    }
+    kern_read_img(fptr, 1, npix, ch->array, &status);
+    if (status) {
+        ch->status = status;
+        fits_close_file(fptr, &status);
+        return;
+    }
+
+    fits_read_key(fptr, TFLOAT, "SKYLEVEL", &ch->skylevel, comment, &status);
+    fits_read_key(fptr, TFLOAT, "SKYNOISE", &ch->skynoise, comment, &status);
+    ch->hdrsky = !status;
+    status = 0;
+    fits_close_file(fptr, &status);
+}
+
+/* read one channel unless it has been already, and work out its display
+ * limits */
+static void *
+rgb_read(void *arg)
+{
+    struct rgb_channel *ch = (struct rgb_channel *)arg;
+    long i, j, npix;
+    float skylevel, skynoise, sample[RGB_NSAMPLE];
+
+    if (ch->load)
+        rgb_load(ch);
+    if (ch->status)
+        return NULL;
+
+    skylevel = ch->skylevel;
+    skynoise = ch->skynoise;
+
+    npix = ch->naxes[0] * ch->naxes[1];
+    if (!ch->hdrsky || ch->dozscale) {
+        for (i=0; i<RGB_NSAMPLE; i++) {
+            j = rand_r(&ch->seed)*1.0*npix/RAND_MAX;
+            if (j >= npix) j = npix-1;
+            sample[i] = ch->array[j];
+        }
+        zscale_r(sample, RGB_NSAMPLE, &skylevel, &skynoise);
+        printf("%s - Median: %f Mad: %f\n", ch->filename, skylevel, skynoise);
+    }
+
+    ch->z1 = skylevel - ch->sigma * skynoise / 1.2;
+    ch->z2 = skylevel + ch->sigma * skynoise;
+    if (ch->z2 <= ch->z1) ch->z2 = ch->z1 + 1.0;
+
+    return NULL;
+}
+
+/* colour index cimin + (r*levels + g)*levels + b for each level triplet */
+void
+rgb_palette(int cimin, int levels)
+{
+    int r, g, b;
+    float step = 1.0 / (levels - 1);
+
+    for (r=0; r<levels; r++)
+        for (g=0; g<levels; g++)
+            for (b=0; b<levels; b++)
+                cpgscr(cimin + (r*levels + g)*levels + b, r*step, g*step, b*step);
+}
+
+/* Reads filenames[0..2] as red, green and blue and returns an array of
+ * colour indices for the palette set up by rgb_palette. softening > 0
+ * selects Lupton et al. (2004) asinh scaling of the total intensity,
+ * which keeps the colour of bright sources instead of saturating them
+ * to white. */
+int *
+rgb_composite(char *filenames[], float sigma, int dozscale, float softening,
+              int cimin, int levels, long naxes[], int *status)
+{
+    struct rgb_channel ch[3];
+    pthread_t thread[3];
+    const float *restrict rp, *restrict gp, *restrict bp;
+    int *restrict ci;
+    float r, g, b, sr, sg, sb, offr, offg, offb, in, f, m, top, norm;
+    unsigned char lr[RGB_BLOCK], lg[RGB_BLOCK], lb[RGB_BLOCK];
+    long i, i0, n, npix;
+    int k, reentrant = fits_is_reentrant();
+
+    if (*status)
+        return NULL;
+
+    for (k=0; k<3; k++) {
+        memset(&ch[k], 0, sizeof(struct rgb_channel));
+        ch[k].filename = filenames[k];
+        ch[k].sigma = sigma;
+        ch[k].dozscale = dozscale;
+        ch[k].seed = 12345 + k;
+        ch[k].load = reentrant;
+        if (!reentrant)
+            rgb_load(&ch[k]);
+    }
+    for (k=0; k<3; k++)
+        pthread_create(&thread[k], NULL, rgb_read, &ch[k]);
+    for (k=0; k<3; k++)
+        pthread_join(thread[k], NULL);
+
+    for (k=0; k<3; k++) {
+        if (!*status && ch[k].status) {
+            fprintf(stderr, "%s: ", ch[k].filename);
+            *status = ch[k].status;
+        }
+        if (!*status && (ch[k].naxes[0] != ch[0].naxes[0] || ch[k].naxes[1] != ch[0].naxes[1])) {
+            fprintf(stderr, "%s: image size differs from %s\n", ch[k].filename, ch[0].filename);
+            *status = BAD_NAXES;
+        }
+    }
+    if (*status) {
+        for (k=0; k<3; k++)
+            free(ch[k].array);
+        return NULL;
+    }
+
+    naxes[0] = ch[0].naxes[0];
+    naxes[1] = ch[0].naxes[1];
+    npix = naxes[0] * naxes[1];
+
+    ci = (int *) malloc(npix * sizeof(int));
+    if (!ci) {
+        *status = MEMORY_ALLOCATION;
+        for (k=0; k<3; k++)
+            free(ch[k].array);
+        return NULL;
+    }
+    rp = ch[0].array;
+    gp = ch[1].array;
+    bp = ch[2].array;
+
+    /* per channel (x - z1)/(z2 - z1), as scale and offset */
+    sr = 1.0 / (ch[0].z2 - ch[0].z1);  offr = -ch[0].z1 * sr;
+    sg = 1.0 / (ch[1].z2 - ch[1].z1);  offg = -ch[1].z1 * sg;
+    sb = 1.0 / (ch[2].z2 - ch[2].z1);  offb = -ch[2].z1 * sb;
+    top = levels - 1;
+
+    if (softening <= 0) {
+        /* linear: each channel straight to its level, a block at a time */
+        for (i0=0; i0<npix; i0+=n) {
+            n = (npix - i0 < RGB_BLOCK) ? npix - i0 : RGB_BLOCK;
+            kern_scale_u8(rp + i0, n, sr*top, offr*top, top, lr);
+            kern_scale_u8(gp + i0, n, sg*top, offg*top, top, lg);
+            kern_scale_u8(bp + i0, n, sb*top, offb*top, top, lb);
+            for (i=0; i<n; i++)
+                ci[i0+i] = cimin + (lr[i]*levels + lg[i])*levels + lb[i];
+        }
+    } else {
+        norm = 1.0 / asinhf(softening);
+        for (i=0; i<npix; i++) {
+            r = fmaxf(rp[i]*sr + offr, 0.0f);
+            g = fmaxf(gp[i]*sg + offg, 0.0f);
+            b = fmaxf(bp[i]*sb + offb, 0.0f);
+            in = (r + g + b) * (1.0f/3.0f);
+            f = (in > 0.0f) ? asinhf(softening*in) * norm / in : 0.0f;
+            r *= f;
+            g *= f;
+            b *= f;
+            /* clip to the brightest channel so hues are preserved */
+            m = fmaxf(fmaxf(r, g), fmaxf(b, 1.0f));
+            r /= m;
+            g /= m;
+            b /= m;
+            ci[i] = cimin + ((int)(r*top + 0.5f)*levels + (int)(g*top + 0.5f))*levels
+                  + (int)(b*top + 0.5f);
+        }
+    }
+
+    for (k=0; k<3; k++)
+        free(ch[k].array);
+
+    return ci;
+}
@@ -0,0 +1,796 @@
+//
+//  tableparse.c
+//  imagepreview
+//
+//  Streaming reader of the tables that cone searches send back: VOTable in
+//  TABLEDATA, BINARY or BINARY2 serialisation, or delimited text, with or
+//  without a header. RA and Dec are found from the ucd or name of the
+//  FIELDs or the column names of a text header, and otherwise taken to be
+//  the first two columns.
+//
+//  The parser works on the received data in place, as it arrives, and says
+//  how much of it it is done with; a row cut short by the end of what has
+//  come so far is left where it is and looked at again, whole, next time.
+//  Numbers are read by scan_double, which needs neither a copy nor the C
+//  locale, and RA and Dec fields by str2angle of coords.c on top of it,
+//  which takes them in sexagesimal as well.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+enum { TP_UNKNOWN, TP_TEXT, TP_XML };
+enum { SER_NONE, SER_TABLEDATA, SER_BINARY, SER_BINARY2 };
+
+struct tp_field
+{
+    char type;                  /* first letter of the datatype, 'B' for bit */
+    int size;                   /* bytes per element, 0 for bits */
+    long count;                 /* elements, -1 when given with each row */
+};
+
+struct table_parser
+{
+    void (*fn)(double ra, double dec, void *arg);
+    void *arg;
+    int format;
+    long nrows;
+    int racol, deccol;          /* columns from 0, -1 until known */
+    int rarank, decrank;        /* how sure the choice of each is */
+
+    /* delimited text */
+    char sep;                   /* ' ' for runs of white space, 0 until known */
+
+    /* VOTable */
+    struct tp_field *field;
+    int nfield, maxfield;
+    int ser, intd, instream, cell;
+    double ra, dec;
+    int gotra, gotdec;
+
+    /* decoded BINARY stream, rows taken from the front */
+    unsigned char *bin;
+    size_t binstart, binend, binmax;
+    unsigned long quad;
+    int nquad;
+};
+
+typedef struct table_parser TABLE_PARSER;
+
+int str2angle(const char *s, const char *e, int hours, double *deg);
+
+static const double pow10tab[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Reads a decimal number at the start of [s, e), after any blanks, with a
+ * '.' for the point whatever the locale. Returns the end of the number, or
+ * NULL when there is none. Up to 15 significant digits and exponents of
+ * -22 to 22 come out correctly rounded; longer ones to within an ulp. */
+const char *
+scan_double(const char *s, const char *e, double *v)
+{
+    uint64_t m = 0;
+    int digits = 0, exp10 = 0, neg = 0, eneg, ex, any = 0;
+    const char *t;
+    double x;
+
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    if (s < e && (*s == '+' || *s == '-'))
+        neg = *s++ == '-';
+
+    for (; s < e && *s >= '0' && *s <= '9'; s++) {
+        any = 1;
+        if (digits < 19) {
+            m = m*10 + (*s - '0');
+            if (m) digits++;
+        } else
+            exp10++;
+    }
+    if (s < e && *s == '.') {
+        for (s++; s < e && *s >= '0' && *s <= '9'; s++) {
+            any = 1;
+            if (digits < 19) {
+                m = m*10 + (*s - '0');
+                if (m) digits++;
+                exp10--;
+            }
+        }
+    }
+    if (!any)
+        return NULL;
+
+    if (s < e && (*s == 'e' || *s == 'E' || *s == 'd' || *s == 'D')) {
+        t = s+1;
+        eneg = 0;
+        if (t < e && (*t == '+' || *t == '-'))
+            eneg = *t++ == '-';
+        if (t < e && *t >= '0' && *t <= '9') {
+            for (ex=0; t < e && *t >= '0' && *t <= '9'; t++)
+                if (ex < 10000)
+                    ex = ex*10 + (*t - '0');
+            exp10 += eneg ? -ex : ex;
+            s = t;
+        }
+    }
+
+    /* both m and the power of ten exact, so one rounding (Clinger) */
+    if (m < (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+        x = exp10 < 0 ? m / pow10tab[-exp10] : m * pow10tab[exp10];
+    else if (!m)
+        x = 0.0;
+    else
+        x = (double)(m * powl(10.0L, exp10));
+
+    *v = neg ? -x : x;
+    return s;
+}
+
+static int
+name_in(const char *s, size_t n, const char *const *names)
+{
+    char lower[32];
+    size_t k;
+    int i;
+
+    while (n && (*s == '_' || *s == '"' || *s == ' ')) {
+        s++;
+        n--;
+    }
+    while (n && (s[n-1] == '"' || s[n-1] == ' ' || s[n-1] == '\r'))
+        n--;
+    if (n >= sizeof(lower))
+        return 0;
+    for (k=0; k<n; k++)
+        lower[k] = tolower((unsigned char)s[k]);
+    lower[n] = '\0';
+
+    /* earlier names are surer */
+    for (i=0; names[i]; i++)
+        if (!strcmp(lower, names[i]))
+            return 20 - i;
+    return 0;
+}
+
+static const char *const ra_names[] = {
+    "raj2000", "ra_j2000", "ra_icrs", "radeg", "ra_deg", "ra(deg)", "ra2000",
+    "ra", "alpha_j2000", "alpha", NULL
+};
+static const char *const dec_names[] = {
+    "dej2000", "decj2000", "dec_j2000", "de_icrs", "dec_icrs", "dedeg", "decdeg",
+    "dec_deg", "dec(deg)", "dec2000", "dec", "de", "delta_j2000", "delta", NULL
+};
+
+/* Takes column col as RA or Dec when its name or ucd is a surer match than
+ * the one chosen so far. */
+static void
+rank_column(TABLE_PARSER *tp, int col, int rarank, int decrank)
+{
+    if (rarank > tp->rarank) {
+        tp->rarank = rarank;
+        tp->racol = col;
+    }
+    if (decrank > tp->decrank) {
+        tp->decrank = decrank;
+        tp->deccol = col;
+    }
+}
+
+static void
+emit(TABLE_PARSER *tp, double ra, double dec)
+{
+    if (dec < -90.0 || dec > 90.0)
+        return;
+    tp->fn(ra, dec, tp->arg);
+    tp->nrows++;
+}
+
+TABLE_PARSER *
+table_parser(void (*fn)(double ra, double dec, void *arg), void *arg)
+{
+    TABLE_PARSER *tp = calloc(1, sizeof(TABLE_PARSER));
+
+    if (!tp)
+        return NULL;
+    tp->fn = fn;
+    tp->arg = arg;
+    tp->racol = 0;
+    tp->deccol = 1;
+
+    return tp;
+}
+
+long
+table_rows(TABLE_PARSER *tp)
+{
+    return tp->nrows;
+}
+
+void
+table_free(TABLE_PARSER *tp)
+{
+    if (!tp)
+        return;
+    free(tp->field);
+    free(tp->bin);
+    free(tp);
+}
+
+/* Steps to the next field of [*p, e), returning 0 after the last. */
+static int
+next_field(const char **p, const char *e, char sep, const char **fs, const char **fe)
+{
+    const char *s = *p;
+
+    if (sep == ' ') {
+        while (s < e && (*s == ' ' || *s == '\t'))
+            s++;
+        if (s == e)
+            return 0;
+        *fs = s;
+        while (s < e && *s != ' ' && *s != '\t')
+            s++;
+        *fe = s;
+        *p = s;
+        return 1;
+    }
+
+    if (s > e)
+        return 0;
+    *fs = s;
+    if (s < e && *s == '"') {
+        for (s++; s < e && *s != '"'; s++)
+            ;
+    }
+    while (s < e && *s != sep)
+        s++;
+    *fe = s;
+    *p = s+1;                   /* past e after the last field */
+    return 1;
+}
+
+static char
+guess_sep(const char *s, const char *e)
+{
+    if (memchr(s, '\t', e-s)) return '\t';
+    if (memchr(s, '|', e-s)) return '|';
+    if (memchr(s, ',', e-s)) return ',';
+    if (memchr(s, ';', e-s)) return ';';
+    return ' ';
+}
+
+/* Looks for RA and Dec among the names of a header line; when both are
+ * there, they and the separator of the line are what the rows use. */
+static void
+text_header(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    const char *p, *fs, *fe;
+    char sep;
+    int col, ra = -1, dec = -1, rarank = 0, decrank = 0, r, ipac = 0;
+
+    /* IPAC tables name the columns between bars, the rows are blank
+     * separated */
+    if (*s == '|') {
+        s++;
+        sep = '|';
+        ipac = 1;
+    } else
+        sep = guess_sep(s, e);
+
+    for (p=s, col=0; next_field(&p, e, sep, &fs, &fe); col++) {
+        if ((r = name_in(fs, fe-fs, ra_names)) > rarank) {
+            rarank = r;
+            ra = col;
+        }
+        if ((r = name_in(fs, fe-fs, dec_names)) > decrank) {
+            decrank = r;
+            dec = col;
+        }
+    }
+
+    if (ra >= 0 && dec >= 0) {
+        tp->racol = ra;
+        tp->deccol = dec;
+        tp->sep = ipac ? ' ' : sep;
+    }
+}
+
+static void
+text_line(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    const char *p, *fs, *fe;
+    double ra = 0, dec = 0;
+    int col, got = 0, last = tp->racol > tp->deccol ? tp->racol : tp->deccol;
+
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    while (e > s && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+    if (s == e || *s == '<' || *s == '\\')
+        return;                 /* markup around the table, IPAC keywords */
+    if (*s == '#') {
+        text_header(tp, s+1, e);
+        return;
+    }
+
+    if (!tp->sep)
+        tp->sep = (*s == '|') ? ' ' : guess_sep(s, e);
+
+    for (p=s, col=0; col<=last && next_field(&p, e, tp->sep, &fs, &fe); col++) {
+        if (col == tp->racol)
+            got += str2angle(fs, fe, 1, &ra);
+        if (col == tp->deccol)
+            got += str2angle(fs, fe, 0, &dec);
+    }
+
+    /* not a row: names, units, rules under them */
+    if (got == 2)
+        emit(tp, ra, dec);
+    else
+        text_header(tp, s, e);
+}
+
+static size_t
+text_feed(TABLE_PARSER *tp, const char *data, size_t len, int last)
+{
+    const char *p = data, *e = data + len, *nl;
+
+    while ((nl = memchr(p, '\n', e-p))) {
+        text_line(tp, p, nl);
+        p = nl+1;
+    }
+    if (last && p < e) {
+        text_line(tp, p, e);
+        p = e;
+    }
+
+    return p - data;
+}
+
+/* The value of attribute name of the tag in [s, e). */
+static int
+get_attr(const char *s, const char *e, const char *name, const char **v, size_t *vlen)
+{
+    size_t n = strlen(name);
+    const char *a, *ae, *q;
+    char quote;
+
+    /* past the element name */
+    while (s < e && !isspace((unsigned char)*s))
+        s++;
+    for (;;) {
+        while (s < e && isspace((unsigned char)*s))
+            s++;
+        if (s >= e)
+            return 0;
+        for (a=s; s < e && *s != '=' && !isspace((unsigned char)*s); s++)
+            ;
+        ae = s;
+        while (s < e && isspace((unsigned char)*s))
+            s++;
+        if (s >= e || *s != '=')
+            continue;
+        for (s++; s < e && isspace((unsigned char)*s); s++)
+            ;
+        if (s >= e || (*s != '"' && *s != '\''))
+            return 0;
+        quote = *s++;
+        for (q=s; q < e && *q != quote; q++)
+            ;
+        if ((size_t)(ae-a) == n && !memcmp(a, name, n)) {
+            *v = s;
+            *vlen = q - s;
+            return 1;
+        }
+        s = q+1;
+    }
+}
+
+/* Whether the ucd in [s, s+n) has word w in it, words parted by ';'. */
+static int
+ucd_has(const char *s, size_t n, const char *w)
+{
+    size_t k = strlen(w), i, j;
+
+    for (i=0; i+k <= n; i=j+1) {
+        for (j=i; j<n && s[j] != ';'; j++)
+            ;
+        while (i < j && s[i] == ' ') i++;
+        if (j-i == k && !strncasecmp(s+i, w, k))
+            return 1;
+    }
+    return 0;
+}
+
+static void
+add_field(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    static const struct { const char *name; char type; int size; } types[] = {
+        {"boolean", 'b', 1}, {"bit", 'B', 0}, {"unsignedByte", 'u', 1},
+        {"short", 's', 2}, {"int", 'i', 4}, {"long", 'l', 8},
+        {"char", 'c', 1}, {"unicodeChar", 'U', 2}, {"float", 'f', 4},
+        {"double", 'd', 8}, {"floatComplex", 'F', 8}, {"doubleComplex", 'D', 16}
+    };
+    struct tp_field *f;
+    const char *v;
+    size_t n;
+    long dim;
+    int k, col = tp->nfield, rarank = 0, decrank = 0;
+
+    if (tp->nfield == tp->maxfield) {
+        tp->maxfield = tp->maxfield ? 2*tp->maxfield : 32;
+        tp->field = realloc(tp->field, tp->maxfield * sizeof(struct tp_field));
+    }
+    f = &tp->field[tp->nfield++];
+    f->type = 'c';
+    f->size = 1;
+    f->count = 1;
+
+    if (get_attr(s, e, "datatype", &v, &n)) {
+        for (k=0; k<(int)(sizeof(types)/sizeof(types[0])); k++) {
+            if (strlen(types[k].name) == n && !memcmp(v, types[k].name, n)) {
+                f->type = types[k].type;
+                f->size = types[k].size;
+            }
+        }
+    }
+    /* "10", "3x4", or variable with a "*" anywhere */
+    if (get_attr(s, e, "arraysize", &v, &n)) {
+        if (memchr(v, '*', n))
+            f->count = -1;
+        else {
+            for (f->count=1; n; ) {
+                for (dim=0; n && isdigit((unsigned char)*v); v++, n--)
+                    dim = dim*10 + (*v - '0');
+                f->count *= dim;
+                for (; n && !isdigit((unsigned char)*v); v++, n--)
+                    ;
+            }
+        }
+    }
+
+    /* the ucd is surer than the name */
+    if (get_attr(s, e, "ucd", &v, &n)) {
+        if (ucd_has(v, n, "pos.eq.ra"))
+            rarank = ucd_has(v, n, "meta.main") ? 40 : 30;
+        else if (ucd_has(v, n, "POS_EQ_RA_MAIN"))
+            rarank = 40;
+        else if (ucd_has(v, n, "POS_EQ_RA"))
+            rarank = 30;
+        if (ucd_has(v, n, "pos.eq.dec"))
+            decrank = ucd_has(v, n, "meta.main") ? 40 : 30;
+        else if (ucd_has(v, n, "POS_EQ_DEC_MAIN"))
+            decrank = 40;
+        else if (ucd_has(v, n, "POS_EQ_DEC"))
+            decrank = 30;
+    }
+    if (!rarank && !decrank && (get_attr(s, e, "name", &v, &n) || get_attr(s, e, "ID", &v, &n))) {
+        rarank = name_in(v, n, ra_names);
+        decrank = name_in(v, n, dec_names);
+    }
+
+    rank_column(tp, col, rarank, decrank);
+}
+
+static uint64_t
+get_be(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    int k;
+
+    for (k=0; k<n; k++)
+        v = (v << 8) | p[k];
+    return v;
+}
+
+static double
+bin_value(const struct tp_field *f, const unsigned char *p)
+{
+    uint64_t u = get_be(p, f->size);
+    uint32_t u32;
+    float x;
+    double d;
+
+    switch (f->type) {
+        case 'f':
+            u32 = (uint32_t)u;
+            memcpy(&x, &u32, 4);
+            return x;
+        case 'd':
+            memcpy(&d, &u, 8);
+            return d;
+        case 'u':
+            return (double)u;
+        case 's':
+            return (double)(int16_t)u;
+        case 'i':
+            return (double)(int32_t)u;
+        case 'l':
+            return (double)(int64_t)u;
+        default:
+            return NAN;
+    }
+}
+
+/* Takes the whole rows off the front of the decoded stream. */
+static void
+bin_rows(TABLE_PARSER *tp)
+{
+    const unsigned char *row, *p, *end = tp->bin + tp->binend, *nulls = NULL;
+    struct tp_field *f;
+    double ra = NAN, dec = NAN;
+    long count, bytes;
+    int k;
+
+    if (!tp->nfield)
+        return;
+    for (;;) {
+        row = p = tp->bin + tp->binstart;
+        if (tp->ser == SER_BINARY2) {
+            nulls = p;
+            p += (tp->nfield + 7) / 8;
+        }
+        for (k=0; k<tp->nfield && p <= end; k++) {
+            f = &tp->field[k];
+            count = f->count;
+            if (count < 0) {
+                if (end - p < 4)
+                    break;
+                count = (long)get_be(p, 4);
+                p += 4;
+            }
+            bytes = f->size ? count * f->size : (count + 7) / 8;
+            if (end - p < bytes)
+                break;
+            if (count > 0 && (!nulls || !(nulls[k/8] & (0x80 >> (k%8))))) {
+                if (k == tp->racol)
+                    ra = bin_value(f, p);
+                if (k == tp->deccol)
+                    dec = bin_value(f, p);
+            }
+            p += bytes;
+        }
+        if (k < tp->nfield || p > end || p == row)
+            break;
+
+        if (isfinite(ra) && isfinite(dec))
+            emit(tp, ra, dec);
+        ra = dec = NAN;
+        tp->binstart += p - row;
+    }
+
+    if (tp->binstart) {
+        memmove(tp->bin, tp->bin + tp->binstart, tp->binend - tp->binstart);
+        tp->binend -= tp->binstart;
+        tp->binstart = 0;
+    }
+}
+
+static void
+b64_decode(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    int c, v;
+
+    if (tp->binmax - tp->binend < (size_t)(e - s)) {
+        tp->binmax = tp->binend + (e - s) + 4096;
+        tp->bin = realloc(tp->bin, tp->binmax);
+    }
+
+    for (; s < e; s++) {
+        c = (unsigned char)*s;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+') v = 62;
+        else if (c == '/') v = 63;
+        else continue;          /* line breaks and the '=' padding */
+
+        tp->quad = (tp->quad << 6) | v;
+        if (++tp->nquad == 4) {
+            tp->bin[tp->binend++] = (tp->quad >> 16) & 0xff;
+            tp->bin[tp->binend++] = (tp->quad >> 8) & 0xff;
+            tp->bin[tp->binend++] = tp->quad & 0xff;
+            tp->nquad = 0;
+            tp->quad = 0;
+        }
+    }
+    bin_rows(tp);
+}
+
+/* The padding leaves 2 or 3 characters of a last group. */
+static void
+b64_flush(TABLE_PARSER *tp)
+{
+    if (tp->nquad >= 2 && tp->binend + 2 <= tp->binmax) {
+        tp->quad <<= 6 * (4 - tp->nquad);
+        tp->bin[tp->binend++] = (tp->quad >> 16) & 0xff;
+        if (tp->nquad == 3)
+            tp->bin[tp->binend++] = (tp->quad >> 8) & 0xff;
+        bin_rows(tp);
+    }
+    tp->nquad = 0;
+    tp->quad = 0;
+    tp->binstart = tp->binend = 0;
+}
+
+static void
+text(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    double v;
+
+    if (tp->instream)
+        b64_decode(tp, s, e);
+    else if (tp->intd && (tp->cell == tp->racol || tp->cell == tp->deccol) && str2angle(s, e, tp->cell == tp->racol, &v)) {
+        if (tp->cell == tp->racol) {
+            tp->ra = v;
+            tp->gotra = 1;
+        }
+        if (tp->cell == tp->deccol) {
+            tp->dec = v;
+            tp->gotdec = 1;
+        }
+    }
+}
+
+static const char *
+find(const char *s, const char *e, const char *w)
+{
+    size_t n = strlen(w);
+
+    for (; (size_t)(e-s) >= n; s++)
+        if (*s == *w && !memcmp(s, w, n))
+            return s;
+    return NULL;
+}
+
+static int
+is_tag(const char *s, const char *e, const char *name)
+{
+    size_t n = strlen(name);
+
+    return (size_t)(e-s) >= n && !memcmp(s, name, n) &&
+           ((size_t)(e-s) == n || isspace((unsigned char)s[n]) || s[n] == '/');
+}
+
+/* A tag in [s, e), from just after the '<' to just before the '>'. */
+static void
+tag(TABLE_PARSER *tp, const char *s, const char *e)
+{
+    const char *name, *colon, *v;
+    int closing = 0, empty = 0;
+    size_t n;
+
+    if (s < e && *s == '/') {
+        closing = 1;
+        s++;
+    }
+    if (e > s && e[-1] == '/') {
+        empty = 1;
+        e--;
+    }
+    /* any namespace prefix */
+    for (name=s; name < e && !isspace((unsigned char)*name); name++)
+        ;
+    if ((colon = memchr(s, ':', name-s)))
+        s = colon+1;
+
+    if (is_tag(s, e, "TABLE") && !closing) {
+        tp->nfield = 0;
+        tp->racol = tp->deccol = -1;
+        tp->rarank = tp->decrank = 0;
+        tp->ser = SER_NONE;
+    } else if (is_tag(s, e, "FIELD") && !closing) {
+        add_field(tp, s, e);
+    } else if (is_tag(s, e, "TABLEDATA") && !closing) {
+        tp->ser = SER_TABLEDATA;
+    } else if (is_tag(s, e, "BINARY2") && !closing) {
+        tp->ser = SER_BINARY2;
+    } else if (is_tag(s, e, "BINARY") && !closing) {
+        tp->ser = SER_BINARY;
+    } else if (is_tag(s, e, "TR")) {
+        if (!closing) {
+            tp->cell = 0;
+            tp->gotra = tp->gotdec = 0;
+        } else if (tp->gotra && tp->gotdec)
+            emit(tp, tp->ra, tp->dec);
+    } else if (is_tag(s, e, "TD")) {
+        if (closing) {
+            tp->intd = 0;
+            tp->cell++;
+        } else if (empty)
+            tp->cell++;
+        else
+            tp->intd = 1;
+    } else if (is_tag(s, e, "STREAM")) {
+        /* only base64 is read; a STREAM pointing elsewhere has no body */
+        if (closing) {
+            if (tp->instream)
+                b64_flush(tp);
+            tp->instream = 0;
+        } else if (!empty && (tp->ser == SER_BINARY || tp->ser == SER_BINARY2) &&
+                   tp->racol >= 0 && tp->deccol >= 0 &&
+                   get_attr(s, e, "encoding", &v, &n) && n == 6 && !memcmp(v, "base64", 6))
+            tp->instream = 1;
+    } else if (is_tag(s, e, "INFO") && !closing) {
+        if (get_attr(s, e, "name", &v, &n) && n == 12 && !memcmp(v, "QUERY_STATUS", 12) &&
+            get_attr(s, e, "value", &v, &n) && n == 5 && !memcmp(v, "ERROR", 5))
+            fprintf(stderr, "Archive query failed\n");
+    }
+}
+
+static size_t
+xml_feed(TABLE_PARSER *tp, const char *data, size_t len, int last)
+{
+    const char *p = data, *e = data + len, *lt, *end;
+
+    while (p < e) {
+        if (*p != '<') {
+            if (!(lt = memchr(p, '<', e-p))) {
+                /* a cell is read whole, or once the rest is here */
+                if (tp->instream || last) {
+                    text(tp, p, e);
+                    p = e;
+                } else if (!tp->intd)
+                    p = e;
+                break;
+            }
+            text(tp, p, lt);
+            p = lt;
+            continue;
+        }
+
+        if (e-p >= 4 && !memcmp(p, "<!--", 4)) {
+            if (!(end = find(p+4, e, "-->")))
+                break;
+            p = end+3;
+        } else if (e-p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+            if (!(end = find(p+9, e, "]]>")))
+                break;
+            text(tp, p+9, end);
+            p = end+3;
+        } else if (e-p < 9 && (e-p < 2 || p[1] == '!') && !last) {
+            break;              /* can't tell which yet */
+        } else {
+            if (!(end = memchr(p, '>', e-p)))
+                break;
+            if (p[1] != '?' && p[1] != '!')
+                tag(tp, p+1, end);
+            p = end+1;
+        }
+    }
+
+    return last ? len : (size_t)(p - data);
+}
+
+/* Parses what it can of len bytes of the response, calling fn on each
+ * source, and returns how many of them it is done with; the rest must come
+ * again, with more after it. With last set, all of it is used. */
+size_t
+table_feed(TABLE_PARSER *tp, const char *data, size_t len, int last)
+{
+    size_t skip = 0;
+
+    if (tp->format == TP_UNKNOWN) {
+        if (len >= 3 && !memcmp(data, "\xef\xbb\xbf", 3))
+            skip = 3;
+        while (skip < len && isspace((unsigned char)data[skip]))
+            skip++;
+        if (skip == len)
+            return len;
+        tp->format = data[skip] == '<' ? TP_XML : TP_TEXT;
+        if (tp->format == TP_XML)
+            tp->racol = tp->deccol = -1;
+    }
+
+    if (tp->format == TP_XML)
+        return skip + xml_feed(tp, data + skip, len - skip, last);
+    return skip + text_feed(tp, data + skip, len - skip, last);
+}
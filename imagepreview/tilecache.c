@@ -0,0 +1,305 @@
+//
+//  tilecache.c
+//  imagepreview
+//
+//  Disk cache of archive reference sources in HEALPix cells, so that a cone
+//  already seen, or covered by earlier ones, is answered without asking the
+//  archive again. Each cell is a file of native (ra, dec) doubles, empty for
+//  a cell known to hold nothing, under
+//
+//      $IMAGEPREVIEW_CACHE/tiles-<survey>-<url hash>/<cell>
+//
+//  with $IMAGEPREVIEW_CACHE defaulting to ~/.imagepreview. Cells older than
+//  IMAGEPREVIEW_CACHE_MAXAGE days (default 30) are fetched again, and the
+//  oldest go once the cache is over IMAGEPREVIEW_CACHE_MAXSIZE MB (default
+//  200, 0 turns the cache off).
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TILE_ORDER 10           /* cells of about 3.4 arcmin */
+#define TILE_MAXCELL 4096
+#define TILE_MAXAGE 30
+#define TILE_MAXSIZE 200
+
+long hp_ang2pix(int order, double ra, double dec);
+void hp_pix2ang(int order, long pix, double *ra, double *dec);
+double hp_pixrad(int order);
+double hp_distance(double ra1, double dec1, double ra2, double dec2);
+int hp_disc(int order, double ra, double dec, double radius, long *pix, int maxpix);
+
+struct tile_cache
+{
+    char dir[1024];
+    double maxage;              /* seconds */
+    double maxsize;             /* bytes */
+};
+
+typedef struct tile_cache TILE_CACHE;
+
+struct tile_file
+{
+    char name[32];
+    time_t mtime;
+    off_t size;
+};
+
+static unsigned long
+hash_str(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *s; s++)
+        h = ((h ^ (unsigned char)*s) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+/* The cache of one survey; the URL template is part of the key, so that
+ * pointing TWOMASS_URL elsewhere does not mix catalogues. NULL when the
+ * cache is turned off or cannot be made. */
+TILE_CACHE *
+tile_open(const char *survey, const char *urlpath)
+{
+    TILE_CACHE *tc;
+    char base[1024], *env;
+    double maxsize = TILE_MAXSIZE, maxage = TILE_MAXAGE;
+
+    if ((env = getenv("IMAGEPREVIEW_CACHE_MAXSIZE")))
+        maxsize = atof(env);
+    if ((env = getenv("IMAGEPREVIEW_CACHE_MAXAGE")))
+        maxage = atof(env);
+    if (maxsize <= 0)
+        return NULL;
+
+    if ((env = getenv("IMAGEPREVIEW_CACHE")) && *env)
+        snprintf(base, sizeof(base), "%s", env);
+    else if ((env = getenv("HOME")))
+        snprintf(base, sizeof(base), "%s/.imagepreview", env);
+    else
+        return NULL;
+
+    tc = malloc(sizeof(TILE_CACHE));
+    if (!tc)
+        return NULL;
+    if (snprintf(tc->dir, sizeof(tc->dir), "%s/tiles-%s-%08lx", base, survey,
+                 hash_str(urlpath)) >= (int)sizeof(tc->dir)) {
+        free(tc);
+        return NULL;
+    }
+    tc->maxage = maxage * 86400.0;
+    tc->maxsize = maxsize * 1048576.0;
+
+    mkdir(base, 0755);
+    if (mkdir(tc->dir, 0755) && access(tc->dir, W_OK)) {
+        free(tc);
+        return NULL;
+    }
+
+    return tc;
+}
+
+static void
+cell_path(TILE_CACHE *tc, long pix, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%d-%ld", tc->dir, TILE_ORDER, pix);
+}
+
+/* Appends the sources of a cell within radius of (ra, dec) to *radec. */
+static int
+cell_read(const char *path, double ra, double dec, double radius,
+          double **radec, long *n, long *max)
+{
+    double buf[512];
+    size_t got, k;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "rb")))
+        return -1;
+
+    while ((got = fread(buf, 2*sizeof(double), 256, fp)) > 0) {
+        for (k=0; k<got; k++) {
+            if (hp_distance(ra, dec, buf[2*k], buf[2*k+1]) > radius)
+                continue;
+            if (*n == *max) {
+                *max = *max ? 2 * *max : 1024;
+                *radec = realloc(*radec, 2 * *max * sizeof(double));
+            }
+            (*radec)[2 * *n] = buf[2*k];
+            (*radec)[2 * *n + 1] = buf[2*k+1];
+            (*n)++;
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/* Adds the cached sources within radius (degrees) of (ra, dec) to *radec,
+ * which holds *n of room for *max, and returns the number of cells of the
+ * cone that are missing or stale. When there are some, *fetch is set to the
+ * radius of a cone about the same centre that covers them all; the sources
+ * added so far are then best dropped in favour of the fetched ones. */
+int
+tile_lookup(TILE_CACHE *tc, double ra, double dec, double radius,
+            double **radec, long *n, long *max, double *fetch)
+{
+    long pix[TILE_MAXCELL], np, k;
+    char path[1100];
+    struct stat st;
+    double cra, cdec, d, now = (double)time(NULL);
+    int missing = 0;
+
+    *fetch = 0.0;
+    np = hp_disc(TILE_ORDER, ra, dec, radius, pix, TILE_MAXCELL);
+    if (np > TILE_MAXCELL)
+        return -1;
+
+    for (k=0; k<np; k++) {
+        cell_path(tc, pix[k], path, sizeof(path));
+        if (!stat(path, &st) && now - st.st_mtime <= tc->maxage &&
+            !cell_read(path, ra, dec, radius, radec, n, max))
+            continue;
+
+        missing++;
+        hp_pix2ang(TILE_ORDER, pix[k], &cra, &cdec);
+        d = hp_distance(ra, dec, cra, cdec) + hp_pixrad(TILE_ORDER);
+        if (d > *fetch)
+            *fetch = d;
+    }
+
+    return missing;
+}
+
+static int
+cmp_age(const void *a, const void *b)
+{
+    const struct tile_file *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* Drops the oldest cells until the cache fits its size limit. */
+static void
+tile_trim(TILE_CACHE *tc)
+{
+    struct tile_file *files = NULL;
+    struct dirent *de;
+    struct stat st;
+    char path[1100];
+    double total = 0;
+    long n = 0, max = 0, k;
+    DIR *dir;
+
+    if (!(dir = opendir(tc->dir)))
+        return;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(files->name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", tc->dir, de->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+        if (n == max) {
+            max = max ? 2*max : 1024;
+            files = realloc(files, max * sizeof(struct tile_file));
+        }
+        strcpy(files[n].name, de->d_name);
+        files[n].mtime = st.st_mtime;
+        /* small cells still take a block */
+        files[n].size = st.st_size + 4096;
+        total += files[n].size;
+        n++;
+    }
+    closedir(dir);
+
+    if (total > tc->maxsize) {
+        qsort(files, n, sizeof(struct tile_file), cmp_age);
+        for (k=0; k<n && total > tc->maxsize; k++) {
+            snprintf(path, sizeof(path), "%s/%s", tc->dir, files[k].name);
+            if (!unlink(path))
+                total -= files[k].size;
+        }
+    }
+    free(files);
+}
+
+/* Files the n sources of a complete fetch of the cone of radius (degrees)
+ * about (ra, dec) into the cells that lie wholly inside it. */
+int
+tile_store(TILE_CACHE *tc, double ra, double dec, double radius, const double *radec, long n)
+{
+    long pix[TILE_MAXCELL], start[TILE_MAXCELL+1], np, k, c, lo, hi, mid;
+    long *slot, *order;
+    char path[1100], tmp[1120];
+    double cra, cdec;
+    FILE *fp;
+    int nstored = 0;
+
+    np = hp_disc(TILE_ORDER, ra, dec, radius, pix, TILE_MAXCELL);
+    if (np > TILE_MAXCELL)
+        return -1;
+
+    slot = malloc((n > 0 ? n : 1) * sizeof(long));
+    order = malloc((n > 0 ? n : 1) * sizeof(long));
+    if (!slot || !order) {
+        free(slot);
+        free(order);
+        return -1;
+    }
+
+    /* sources grouped by cell, so one file is open at a time */
+    memset(start, 0, sizeof(start));
+    for (k=0; k<n; k++) {
+        c = hp_ang2pix(TILE_ORDER, radec[2*k], radec[2*k+1]);
+        for (lo=0, hi=np; lo<hi; ) {
+            mid = (lo + hi) / 2;
+            if (pix[mid] < c) lo = mid+1; else hi = mid;
+        }
+        slot[k] = (lo < np && pix[lo] == c) ? lo : -1;
+        if (slot[k] >= 0)
+            start[lo+1]++;
+    }
+    for (k=0; k<np; k++)
+        start[k+1] += start[k];
+    for (k=0; k<n; k++)
+        if (slot[k] >= 0)
+            order[start[slot[k]]++] = k;
+    for (k=np; k>0; k--)
+        start[k] = start[k-1];
+    start[0] = 0;
+
+    /* only the cells the cone covers entirely are complete */
+    for (c=0; c<np; c++) {
+        hp_pix2ang(TILE_ORDER, pix[c], &cra, &cdec);
+        if (hp_distance(ra, dec, cra, cdec) + hp_pixrad(TILE_ORDER) > radius)
+            continue;
+        cell_path(tc, pix[c], path, sizeof(path));
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        if (!(fp = fopen(tmp, "wb")))
+            continue;
+        for (k=start[c]; k<start[c+1]; k++)
+            fwrite(&radec[2*order[k]], sizeof(double), 2, fp);
+        if (ferror(fp) | fclose(fp) || rename(tmp, path))
+            remove(tmp);
+        else
+            nstored++;
+    }
+    free(slot);
+    free(order);
+
+    tile_trim(tc);
+    return nstored;
+}
+
+void
+tile_close(TILE_CACHE *tc)
+{
+    free(tc);
+}
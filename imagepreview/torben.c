@@ -66,19 +66,23 @@ float mad(float m[], int n)
 	return mad;
 }
 
-float *zscale(float m[], int n)
+/* reentrant form of zscale, safe to call from several threads */
+void zscale_r(float m[], int n, float *median, float *mad)
 {
-	static float retbuf[2];
 	int i;
-	float median, mad;
 	float *m2;
 	
-	m2 = (float *) calloc(n, TFLOAT);
-	median = torben(m, n);
-	for (i=0; i<n; i++) m2[i]=fabs(m[i]-median);
-	mad = torben(m2, n)*1.4826;
+	m2 = (float *) calloc(n, sizeof(float));
+	*median = torben(m, n);
+	for (i=0; i<n; i++) m2[i]=fabs(m[i]-*median);
+	*mad = torben(m2, n)*1.4826;
+	free(m2);
+}
+
+float *zscale(float m[], int n)
+{
+	static float retbuf[2];
 	
-	retbuf[0]=median;
-	retbuf[1]=mad;
+	zscale_r(m, n, &retbuf[0], &retbuf[1]);
 	return retbuf;
 }
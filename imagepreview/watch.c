@@ -0,0 +1,302 @@
+//
+//  watch.c
+//  imagepreview
+//
+//  New files in an ingest directory, for preview -W. A thread notices them,
+//  with inotify where there is one and by listing the directory every
+//  WATCH_POLL ms elsewhere, and queues each once it is complete: closed
+//  (or renamed into place) and the same size and time WATCH_SETTLE ms
+//  later, or, when listing, the same in two listings running. The queue
+//  holds WATCH_QUEUE frames, the oldest making room for a new one;
+//  watch_next hands out the newest and drops the rest, so that when
+//  previewing falls behind the camera it skips to the latest frame
+//  instead of working through the backlog. Names too long for a path
+//  of 1024 bytes are passed over.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define WATCH_QUEUE 8
+#define WATCH_SETTLE 100
+#define WATCH_POLL 250
+#define WATCH_SEEN 4096         /* names remembered when listing */
+
+struct watch_file
+{
+    char path[1024];
+    double found;               /* when it was seen to be complete */
+};
+
+typedef struct dir_watch
+{
+    char dir[1024];
+    char pattern[256];
+    int fd;                     /* inotify, or -1 to list the directory */
+    pthread_t thread;
+
+    struct watch_file queue[WATCH_QUEUE];
+    int head, len, dropped;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+    /* when listing: the names there already and their sizes last time */
+    char (*seen)[256];
+    off_t *size;
+    time_t *mtime;
+    int nseen;
+} DIR_WATCH;
+
+static void
+sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void
+push(DIR_WATCH *w, const char *path)
+{
+    struct watch_file *f;
+    int k;
+
+    pthread_mutex_lock(&w->lock);
+
+    /* a file written again while still queued keeps its place */
+    for (k=0; k<w->len; k++)
+        if (!strcmp(w->queue[(w->head + k) % WATCH_QUEUE].path, path))
+            break;
+    if (k == w->len) {
+        if (w->len == WATCH_QUEUE) {
+            w->head = (w->head + 1) % WATCH_QUEUE;
+            w->len--;
+            w->dropped++;
+        }
+        f = &w->queue[(w->head + w->len++) % WATCH_QUEUE];
+        snprintf(f->path, sizeof(f->path), "%s", path);
+        f->found = now();
+    }
+
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+}
+
+#ifdef __linux__
+
+/* Waits until path stops changing. Returns 0 when it has, -1 when it is
+ * gone. */
+static int
+settle(const char *path, struct stat *st)
+{
+    struct stat later;
+
+    if (stat(path, st))
+        return -1;
+    for (;;) {
+        sleep_ms(WATCH_SETTLE);
+        if (stat(path, &later))
+            return -1;
+        if (later.st_size == st->st_size && later.st_mtime == st->st_mtime)
+            return 0;
+        *st = later;
+    }
+}
+
+static void *
+watch_inotify(void *arg)
+{
+    DIR_WATCH *w = arg;
+    char buf[4096], path[1024], last[1024] = "";
+    const struct inotify_event *ev;
+    struct stat st, done = {0};
+    ssize_t n;
+    char *p;
+
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0)
+        for (p=buf; p<buf+n; p+=sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (!ev->len || fnmatch(w->pattern, ev->name, 0) ||
+                snprintf(path, sizeof(path), "%s/%s", w->dir, ev->name) >= (int)sizeof(path))
+                continue;
+
+            /* a file written in pieces, closed after each, is closed
+             * again as often; those it settled through are let go */
+            if (last[0] && !strcmp(path, last) && !stat(path, &st) &&
+                st.st_size == done.st_size && st.st_mtime == done.st_mtime)
+                continue;
+            if (!settle(path, &st)) {
+                push(w, path);
+                strcpy(last, path);
+                done = st;
+            }
+        }
+
+    return NULL;
+}
+
+#endif
+
+/* The slot of name among those seen, or -1. */
+static int
+seen_find(DIR_WATCH *w, const char *name)
+{
+    int k;
+
+    for (k=w->nseen-1; k>=0; k--)
+        if (!strcmp(w->seen[k], name))
+            return k;
+    return -1;
+}
+
+/* Lists the directory, queueing the files that were not there before once
+ * a listing finds them the same size and time as the last one did. With
+ * first set it only takes note of what is there. */
+static void
+list_dir(DIR_WATCH *w, int first)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    char path[1024];
+    int k;
+
+    if (!(d = opendir(w->dir)))
+        return;
+    while ((de = readdir(d))) {
+        if (fnmatch(w->pattern, de->d_name, 0) || strlen(de->d_name) >= sizeof(w->seen[0]) ||
+            snprintf(path, sizeof(path), "%s/%s", w->dir, de->d_name) >= (int)sizeof(path))
+            continue;
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        if ((k = seen_find(w, de->d_name)) < 0) {
+            if (w->nseen == WATCH_SEEN) {
+                /* forget the oldest half */
+                memmove(w->seen, w->seen + WATCH_SEEN/2, WATCH_SEEN/2 * sizeof(w->seen[0]));
+                memmove(w->size, w->size + WATCH_SEEN/2, WATCH_SEEN/2 * sizeof(off_t));
+                memmove(w->mtime, w->mtime + WATCH_SEEN/2, WATCH_SEEN/2 * sizeof(time_t));
+                w->nseen -= WATCH_SEEN/2;
+            }
+            k = w->nseen++;
+            strcpy(w->seen[k], de->d_name);
+            /* -1 once queued, or there before we started */
+            w->size[k] = first ? -1 : st.st_size;
+            w->mtime[k] = st.st_mtime;
+            continue;
+        }
+        if (w->size[k] < 0)
+            continue;
+        if (st.st_size == w->size[k] && st.st_mtime == w->mtime[k]) {
+            push(w, path);
+            w->size[k] = -1;
+        } else {
+            w->size[k] = st.st_size;
+            w->mtime[k] = st.st_mtime;
+        }
+    }
+    closedir(d);
+}
+
+static void *
+watch_list(void *arg)
+{
+    DIR_WATCH *w = arg;
+
+    for (;;) {
+        sleep_ms(WATCH_POLL);
+        list_dir(w, 0);
+    }
+    return NULL;
+}
+
+/* Watches dir for new files matching pattern ["*.fit"]. NULL if dir
+ * cannot be read. */
+DIR_WATCH *
+watch_open(const char *dir, const char *pattern)
+{
+    DIR_WATCH *w;
+    DIR *d;
+
+    if (!(d = opendir(dir)))
+        return NULL;
+    closedir(d);
+    if (!(w = calloc(1, sizeof(DIR_WATCH))))
+        return NULL;
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    snprintf(w->pattern, sizeof(w->pattern), "%s", pattern ? pattern : "*.fit");
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    w->fd = -1;
+
+#ifdef __linux__
+    if ((w->fd = inotify_init()) >= 0 &&
+        inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    if (w->fd >= 0 && !pthread_create(&w->thread, NULL, watch_inotify, w))
+        return w;
+#endif
+
+    w->seen = malloc(WATCH_SEEN * sizeof(w->seen[0]));
+    w->size = malloc(WATCH_SEEN * sizeof(off_t));
+    w->mtime = malloc(WATCH_SEEN * sizeof(time_t));
+    if (w->seen && w->size && w->mtime) {
+        list_dir(w, 1);
+        if (!pthread_create(&w->thread, NULL, watch_list, w))
+            return w;
+    }
+    free(w->seen);
+    free(w->size);
+    free(w->mtime);
+    free(w);
+    return NULL;
+}
+
+/* Waits for a complete new file and puts its path in path. Returns when
+ * it was found complete, in seconds as gettimeofday, and in skipped the
+ * number of older ones passed over since the last call. */
+double
+watch_next(DIR_WATCH *w, char *path, size_t len, int *skipped)
+{
+    struct watch_file *f;
+    double found;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->len)
+        pthread_cond_wait(&w->ready, &w->lock);
+    f = &w->queue[(w->head + w->len - 1) % WATCH_QUEUE];
+    snprintf(path, len, "%s", f->path);
+    found = f->found;
+    *skipped = w->dropped + w->len - 1;
+    w->len = 0;
+    w->dropped = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    return found;
+}
@@ -0,0 +1,191 @@
+//
+//  wcscache.c
+//  imagepreview
+//
+//  World coordinates of an image HDU, read from its whole header with
+//  wcspih so that any projection and distortion WCSLIB knows (TAN, ZPN,
+//  TPV, SIP...) comes out right, and kept with its wcsset done, per file and
+//  HDU, for as long as the process runs. Headers without a celestial WCS
+//  wcspih can find, such as CD matrices with no CTYPE, are read the old way
+//  as ZPN from CRVAL, CRPIX, CD and PV2_1 to PV2_5.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fitsio.h"
+#include "wcs.h"
+#include "wcshdr.h"
+
+#define WCS_CACHE_MAX 64
+
+struct wcs_entry
+{
+    char file[1024];
+    int hdu;
+    time_t mtime;               /* of the file, so a rewritten one is read again */
+    off_t size;
+    int found;                  /* 0 when the HDU has no WCS */
+    unsigned long used;         /* clock of the last lookup */
+    struct wcsprm wcs;
+};
+
+static struct wcs_entry cache[WCS_CACHE_MAX];
+static int ncache;
+static unsigned long ticks;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ZPN from the keywords, PV2_1 defaulting to 1 and the rest to 0. */
+static int
+zpn_wcs(fitsfile *fptr, struct wcsprm *wcs)
+{
+    double crval[2], crpix[2], cd[4] = {0.0, 0.0, 0.0, 0.0}, pv;
+    char comment[81], keyword[9];
+    int m, status = 0;
+
+    fits_read_key(fptr, TDOUBLE, "CRVAL1", &crval[0], comment, &status);
+    fits_read_key(fptr, TDOUBLE, "CRVAL2", &crval[1], comment, &status);
+    fits_read_key(fptr, TDOUBLE, "CRPIX1", &crpix[0], comment, &status);
+    fits_read_key(fptr, TDOUBLE, "CRPIX2", &crpix[1], comment, &status);
+    fits_read_key(fptr, TDOUBLE, "CD1_1", &cd[0], comment, &status);
+    fits_read_key(fptr, TDOUBLE, "CD2_2", &cd[3], comment, &status);
+    if (status)
+        return -1;
+    fits_read_key(fptr, TDOUBLE, "CD1_2", &cd[1], comment, &status);
+    status = 0;
+    fits_read_key(fptr, TDOUBLE, "CD2_1", &cd[2], comment, &status);
+    status = 0;
+
+    wcs->flag = -1;
+    wcsnpv(5);
+    if (wcsini(1, 2, wcs))
+        return -1;
+    strcpy(wcs->ctype[0], "RA---ZPN");
+    strcpy(wcs->ctype[1], "DEC--ZPN");
+    strcpy(wcs->cunit[0], "deg");
+    strcpy(wcs->cunit[1], "deg");
+    wcs->crval[0] = crval[0];
+    wcs->crval[1] = crval[1];
+    wcs->crpix[0] = crpix[0];
+    wcs->crpix[1] = crpix[1];
+    wcs->altlin |= 2;
+    memcpy(wcs->cd, cd, sizeof(cd));
+
+    wcs->npv = 5;
+    for (m=1; m<=5; m++) {
+        wcs->pv[m-1].i = 2;
+        wcs->pv[m-1].m = m;
+        wcs->pv[m-1].value = (m == 1) ? 1.0 : 0.0;
+        sprintf(keyword, "PV2_%d", m);
+        if (!fits_read_key(fptr, TDOUBLE, keyword, &pv, comment, &status))
+            wcs->pv[m-1].value = pv;
+        status = 0;
+    }
+
+    if (wcsset(wcs)) {
+        wcsfree(wcs);
+        return -1;
+    }
+    return 0;
+}
+
+/* The celestial axes of the primary WCS of the header of the current HDU. */
+static int
+read_wcs(fitsfile *fptr, struct wcsprm *wcs)
+{
+    struct wcsprm *all = NULL;
+    char *header = NULL;
+    int axes[2] = {WCSSUB_LONGITUDE, WCSSUB_LATITUDE};
+    int nkeys, nreject, nwcs = 0, nsub = 2, k, ret = -1, status = 0;
+
+    if (fits_hdr2str(fptr, 1, NULL, 0, &header, &nkeys, &status))
+        return -1;
+
+    if (!wcspih(header, nkeys, WCSHDR_all, 0, &nreject, &nwcs, &all)) {
+        for (k=0; k<nwcs; k++)
+            if (all[k].alt[0] == ' ' || !all[k].alt[0])
+                break;
+        wcs->flag = -1;
+        if (k < nwcs && !wcssub(1, &all[k], &nsub, axes, wcs)) {
+            if (nsub == 2 && !wcsset(wcs))
+                ret = 0;
+            else
+                wcsfree(wcs);
+        }
+        wcsvfree(&nwcs, &all);
+    }
+    fits_free_memory(header, &status);
+
+    return ret;
+}
+
+/* The entry of the current HDU of fptr, read in if it is not there yet. */
+static struct wcs_entry *
+lookup(fitsfile *fptr)
+{
+    struct wcs_entry *e, *old = cache;
+    char file[1024];
+    struct stat st;
+    int hdu, k, status = 0;
+
+    if (fits_file_name(fptr, file, &status))
+        return NULL;
+    fits_get_hdu_num(fptr, &hdu);
+    if (stat(file, &st))
+        memset(&st, 0, sizeof(st));
+
+    for (k=0; k<ncache; k++) {
+        e = &cache[k];
+        if (e->hdu == hdu && e->mtime == st.st_mtime && e->size == st.st_size &&
+            !strcmp(e->file, file)) {
+            e->used = ++ticks;
+            return e;
+        }
+        if (e->used < old->used)
+            old = e;
+    }
+
+    /* a new entry while there is room, then the one unused the longest */
+    if (ncache < WCS_CACHE_MAX)
+        e = &cache[ncache++];
+    else {
+        e = old;
+        if (e->found)
+            wcsfree(&e->wcs);
+    }
+    snprintf(e->file, sizeof(e->file), "%s", file);
+    e->hdu = hdu;
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->used = ++ticks;
+    e->found = !read_wcs(fptr, &e->wcs) || !zpn_wcs(fptr, &e->wcs);
+
+    return e;
+}
+
+/* The celestial WCS of the current HDU of fptr, or NULL when it has none.
+ * The header is only read the first time; the copy returned is the
+ * caller's, to wcsfree and free. */
+struct wcsprm *
+wcs_hdu(fitsfile *fptr)
+{
+    struct wcs_entry *e;
+    struct wcsprm *wcs = NULL;
+
+    pthread_mutex_lock(&lock);
+    if ((e = lookup(fptr)) && e->found && (wcs = malloc(sizeof(struct wcsprm)))) {
+        wcs->flag = -1;
+        if (wcssub(1, &e->wcs, 0x0, 0x0, wcs) || wcsset(wcs)) {
+            wcsfree(wcs);
+            free(wcs);
+            wcs = NULL;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return wcs;
+}
@@ -0,0 +1,478 @@
+//
+//  wcsgrid.c
+//  imagepreview
+//
+//  Fast approximate world coordinates over a box of pixels, for converting
+//  many points at once. Both directions are fitted, by least squares on a
+//  grid of Chebyshev nodes, with Chebyshev polynomials of the lowest degree
+//  up to GRID_MAXDEG that keeps within the tolerance on a finer grid of
+//  points checked against WCSLIB. The sky side goes through the standard
+//  coordinates of the tangent plane at the centre of the box, which takes
+//  the rotation of the sphere out of the fit and leaves only the smooth
+//  part of the projection and its distortion to it. Where no degree is good
+//  enough the conversions are left to WCSLIB.
+//
+//  Copyright (c) 2013 Institute of Astronomy. All rights reserved.
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wcs.h"
+
+#define GRID_MAXDEG 7
+#define GRID_NTERM ((GRID_MAXDEG+1) * (GRID_MAXDEG+2) / 2)
+#define GRID_NFIT 16                /* nodes a side fitted */
+#define GRID_NCHECK 33              /* points a side checked, edges included */
+#define GRID_BLOCK 256              /* points evaluated together */
+
+#define D2R (M_PI/180.0)
+
+struct grid_fit
+{
+    int deg;                        /* 0 when no fit is good enough */
+    double u0, uh, v0, vh;          /* centre and half width of the domain */
+    double c[2][GRID_NTERM];
+    double err;                     /* largest error of the check */
+};
+
+struct wcs_grid
+{
+    double ra0, dec0, sd0, cd0;     /* tangent point, and sin and cos of dec0 */
+    double scale;                   /* degrees per pixel at the centre */
+    struct grid_fit p2s;            /* pixel to standard coordinates */
+    struct grid_fit s2p;            /* standard coordinates to pixel */
+};
+
+typedef struct wcs_grid WCS_GRID;
+
+/* Standard coordinates (degrees) of a position; -1 for one too far from
+ * the tangent point to be of use. */
+static int
+to_plane(const WCS_GRID *g, double ra, double dec, double *xi, double *eta)
+{
+    double d = (ra - g->ra0) * D2R, sd = sin(dec * D2R), cd = cos(dec * D2R);
+    double cosc = g->sd0 * sd + g->cd0 * cd * cos(d);
+
+    if (cosc < 0.1)
+        return -1;
+    *xi = cd * sin(d) / cosc / D2R;
+    *eta = (g->cd0 * sd - g->sd0 * cd * cos(d)) / cosc / D2R;
+    return 0;
+}
+
+static void
+from_plane(const WCS_GRID *g, double xi, double eta, double *ra, double *dec)
+{
+    double x = xi * D2R, y = eta * D2R, den = g->cd0 - y * g->sd0;
+
+    *ra = g->ra0 + atan2(x, den) / D2R;
+    if (*ra < 0.0) *ra += 360.0;
+    if (*ra >= 360.0) *ra -= 360.0;
+    *dec = atan2(g->sd0 + y * g->cd0, sqrt(x*x + den*den)) / D2R;
+}
+
+/* The Chebyshev polynomials T0..Tdeg at n points u, t[k*GRID_BLOCK + i]. */
+static void
+chebyshev(const double *u, int n, int deg, double *t)
+{
+    int i, k;
+
+    for (i=0; i<n; i++) {
+        t[i] = 1.0;
+        t[GRID_BLOCK + i] = u[i];
+    }
+    for (k=2; k<=deg; k++)
+        for (i=0; i<n; i++)
+            t[k*GRID_BLOCK + i] = 2.0 * u[i] * t[(k-1)*GRID_BLOCK + i] - t[(k-2)*GRID_BLOCK + i];
+}
+
+/* The fit at n <= GRID_BLOCK points (u, v), both outputs. */
+static void
+evaluate(const struct grid_fit *f, int n, const double *u, const double *v, double *out0, double *out1)
+{
+    double tu[(GRID_MAXDEG+1) * GRID_BLOCK], tv[(GRID_MAXDEG+1) * GRID_BLOCK];
+    double un[GRID_BLOCK], vn[GRID_BLOCK], a, b;
+    const double *pu, *pv;
+    int i, j, k, m;
+
+    for (k=0; k<n; k++) {
+        un[k] = (u[k] - f->u0) / f->uh;
+        vn[k] = (v[k] - f->v0) / f->vh;
+        out0[k] = out1[k] = 0.0;
+    }
+    chebyshev(un, n, f->deg, tu);
+    chebyshev(vn, n, f->deg, tv);
+
+    for (i=0, m=0; i<=f->deg; i++)
+        for (j=0; i+j<=f->deg; j++, m++) {
+            a = f->c[0][m];
+            b = f->c[1][m];
+            pu = tu + i*GRID_BLOCK;
+            pv = tv + j*GRID_BLOCK;
+            for (k=0; k<n; k++) {
+                out0[k] += a * pu[k] * pv[k];
+                out1[k] += b * pu[k] * pv[k];
+            }
+        }
+}
+
+/* Least squares solution of a x = b for the m columns of a (n by m, column
+ * by column) and nrhs right hand sides, by Householder QR; a and b are
+ * overwritten and the solutions left at the top of b. */
+static int
+least_squares(double *a, int n, int m, double *b, int nrhs)
+{
+    double s, norm, *col;
+    int i, j, k, r;
+
+    for (k=0; k<m; k++) {
+        col = a + (long)k*n;
+        for (norm=0.0, i=k; i<n; i++)
+            norm += col[i] * col[i];
+        norm = sqrt(norm);
+        if (norm == 0.0)
+            return -1;
+        if (col[k] > 0.0)
+            norm = -norm;
+        col[k] -= norm;
+        s = sqrt(-2.0 * norm * col[k]);
+        for (i=k; i<n; i++)
+            col[i] /= s;
+
+        /* reflect the columns to come and the right hand sides */
+        for (j=k+1; j<m+nrhs; j++) {
+            double *c = j < m ? a + (long)j*n : b + (long)(j-m)*n;
+            for (s=0.0, i=k; i<n; i++)
+                s += col[i] * c[i];
+            for (i=k; i<n; i++)
+                c[i] -= 2.0 * s * col[i];
+        }
+        col[k] = norm;
+    }
+
+    for (r=0; r<nrhs; r++)
+        for (k=m-1; k>=0; k--) {
+            s = b[(long)r*n + k];
+            for (j=k+1; j<m; j++)
+                s -= a[(long)j*n + k] * b[(long)r*n + j];
+            b[(long)r*n + k] = s / a[(long)k*n + k];
+        }
+    return 0;
+}
+
+/* Fits f over its domain to the values out0, out1 at the nodes (u, v), and
+ * keeps the lowest degree whose largest error on the check points is within
+ * tol; cu..c1 are the check points and the exact values there. */
+static void
+fit(struct grid_fit *f, const double *u, const double *v, const double *out0, const double *out1,
+    const double *cu, const double *cv, const double *c0, const double *c1, double tol)
+{
+    int n = GRID_NFIT * GRID_NFIT, nc = GRID_NCHECK * GRID_NCHECK, deg, m, i, j, k, t;
+    double *a, *b, tu[(GRID_MAXDEG+1) * GRID_BLOCK], tv[(GRID_MAXDEG+1) * GRID_BLOCK];
+    double un[GRID_BLOCK], vn[GRID_BLOCK], e0[GRID_BLOCK], e1[GRID_BLOCK], d;
+    int nb, p;
+
+    f->deg = 0;
+    a = malloc((GRID_NTERM + 2) * n * sizeof(double));
+    if (!a)
+        return;
+
+    for (deg=2; deg<=GRID_MAXDEG; deg++) {
+        m = (deg+1) * (deg+2) / 2;
+        b = a + (long)m*n;
+
+        /* the design matrix, a block of nodes at a time */
+        for (k=0; k<n; k+=GRID_BLOCK) {
+            nb = n-k < GRID_BLOCK ? n-k : GRID_BLOCK;
+            for (t=0; t<nb; t++) {
+                un[t] = (u[k+t] - f->u0) / f->uh;
+                vn[t] = (v[k+t] - f->v0) / f->vh;
+            }
+            chebyshev(un, nb, deg, tu);
+            chebyshev(vn, nb, deg, tv);
+            for (i=0, j=0; i<=deg; i++)
+                for (t=0; i+t<=deg; t++, j++)
+                    for (p=0; p<nb; p++)
+                        a[(long)j*n + k+p] = tu[i*GRID_BLOCK + p] * tv[t*GRID_BLOCK + p];
+        }
+        memcpy(b, out0, n * sizeof(double));
+        memcpy(b + n, out1, n * sizeof(double));
+        if (least_squares(a, n, m, b, 2))
+            break;
+
+        f->deg = deg;
+        for (j=0; j<m; j++) {
+            f->c[0][j] = b[j];
+            f->c[1][j] = b[n + j];
+        }
+
+        f->err = 0.0;
+        for (k=0; k<nc; k+=GRID_BLOCK) {
+            nb = nc-k < GRID_BLOCK ? nc-k : GRID_BLOCK;
+            evaluate(f, nb, cu + k, cv + k, e0, e1);
+            for (t=0; t<nb; t++) {
+                d = hypot(e0[t] - c0[k+t], e1[t] - c1[k+t]);
+                if (!(d <= f->err))
+                    f->err = d;
+            }
+        }
+        if (f->err <= tol)
+            break;
+        f->deg = 0;
+    }
+
+    free(a);
+}
+
+/* Node k of n across [-1, 1], the edges included for the check points. */
+static double
+node(int k, int n, int check)
+{
+    return check ? -1.0 + 2.0 * k / (n-1) : -cos(M_PI * (k + 0.5) / n);
+}
+
+/* Fits of the world coordinates of wcs over the pixels x1..x2, y1..y2,
+ * within tol pixels where checked; NULL when even the centre cannot be
+ * converted. */
+WCS_GRID *
+wcsgrid_new(struct wcsprm *wcs, double x1, double x2, double y1, double y2, double tol)
+{
+    int nf = GRID_NFIT * GRID_NFIT, nc = GRID_NCHECK * GRID_NCHECK, n = nf + nc, i, j, k, bad = 0;
+    double *buf, *pix, *world, *phi, *theta, *img, *u, *v, *o0, *o1;
+    double centre[6], xi1, xi2, eta1, eta2, m;
+    int *stat;
+    WCS_GRID *g;
+
+    if (!(g = calloc(1, sizeof(WCS_GRID))))
+        return NULL;
+    buf = malloc(12 * n * sizeof(double));
+    stat = malloc(n * sizeof(int));
+    if (!buf || !stat) {
+        free(buf);
+        free(stat);
+        free(g);
+        return NULL;
+    }
+    pix = buf;
+    world = pix + 2*n;
+    img = world + 2*n;
+    phi = img + 2*n;
+    theta = phi + n;
+    u = theta + n;
+    v = u + n;
+    o0 = v + n;
+    o1 = o0 + n;
+
+    /* the tangent point, and the scale there from the steps of a pixel */
+    g->p2s.u0 = (x1 + x2) / 2.0;
+    g->p2s.v0 = (y1 + y2) / 2.0;
+    g->p2s.uh = fabs(x2 - x1) / 2.0 + 0.5;
+    g->p2s.vh = fabs(y2 - y1) / 2.0 + 0.5;
+    for (k=0; k<3; k++) {
+        pix[2*k] = g->p2s.u0 + (k == 1);
+        pix[2*k+1] = g->p2s.v0 + (k == 2);
+    }
+    if (wcsp2s(wcs, 3, 2, pix, img, phi, theta, centre, stat) || stat[0] || stat[1] || stat[2]) {
+        free(buf);
+        free(stat);
+        free(g);
+        return NULL;
+    }
+    g->ra0 = centre[0];
+    g->dec0 = centre[1];
+    g->sd0 = sin(g->dec0 * D2R);
+    g->cd0 = cos(g->dec0 * D2R);
+    to_plane(g, centre[2], centre[3], &xi1, &eta1);
+    to_plane(g, centre[4], centre[5], &xi2, &eta2);
+    g->scale = sqrt(fabs(xi1 * eta2 - xi2 * eta1));
+
+    /* pixel to sky: the fit nodes then the check points, exact */
+    for (k=0; k<n; k++) {
+        int check = k >= nf, side = check ? GRID_NCHECK : GRID_NFIT;
+        i = (check ? k-nf : k) % side;
+        j = (check ? k-nf : k) / side;
+        u[k] = pix[2*k] = g->p2s.u0 + g->p2s.uh * node(i, side, check);
+        v[k] = pix[2*k+1] = g->p2s.v0 + g->p2s.vh * node(j, side, check);
+    }
+    (void)wcsp2s(wcs, n, 2, pix, img, phi, theta, world, stat);
+    for (k=0; k<n; k++)
+        bad |= stat[k] || to_plane(g, world[2*k], world[2*k+1], &o0[k], &o1[k]);
+    if (!bad)
+        fit(&g->p2s, u, v, o0, o1, u+nf, v+nf, o0+nf, o1+nf, tol * g->scale);
+
+    /* with no pixel to sky at the edges, no idea of the sky to cover:
+     * all of it is left to WCSLIB */
+    if (bad) {
+        g->s2p.uh = g->s2p.vh = HUGE_VAL;
+        free(buf);
+        free(stat);
+        return g;
+    }
+
+    /* sky to pixel, over the standard coordinates of the box and a little */
+    xi1 = eta1 = HUGE_VAL;
+    xi2 = eta2 = -HUGE_VAL;
+    for (k=nf; k<n; k++) {
+        if (o0[k] < xi1) xi1 = o0[k];
+        if (o0[k] > xi2) xi2 = o0[k];
+        if (o1[k] < eta1) eta1 = o1[k];
+        if (o1[k] > eta2) eta2 = o1[k];
+    }
+    m = 0.01 * (xi2 - xi1 > eta2 - eta1 ? xi2 - xi1 : eta2 - eta1);
+    g->s2p.u0 = (xi1 + xi2) / 2.0;
+    g->s2p.v0 = (eta1 + eta2) / 2.0;
+    g->s2p.uh = (xi2 - xi1) / 2.0 + m;
+    g->s2p.vh = (eta2 - eta1) / 2.0 + m;
+    for (k=0; k<n; k++) {
+        int check = k >= nf, side = check ? GRID_NCHECK : GRID_NFIT;
+        i = (check ? k-nf : k) % side;
+        j = (check ? k-nf : k) / side;
+        u[k] = g->s2p.u0 + g->s2p.uh * node(i, side, check);
+        v[k] = g->s2p.v0 + g->s2p.vh * node(j, side, check);
+        from_plane(g, u[k], v[k], &world[2*k], &world[2*k+1]);
+    }
+    (void)wcss2p(wcs, n, 2, world, phi, theta, img, pix, stat);
+    for (k=0; k<n; k++) {
+        bad |= stat[k];
+        o0[k] = pix[2*k];
+        o1[k] = pix[2*k+1];
+    }
+    if (!bad)
+        fit(&g->s2p, u, v, o0, o1, u+nf, v+nf, o0+nf, o1+nf, tol);
+
+    free(buf);
+    free(stat);
+    return g;
+}
+
+/* Pixel coordinates of n positions, world[2*k], world[2*k+1] in degrees,
+ * from the fit or, without one, from wcs (which is then needed). Positions outside the sky the fit
+ * covers get stat -1 and are left alone, for the caller to leave out or to
+ * give to wcss2p; returns how many there were. */
+int
+wcsgrid_s2p(WCS_GRID *g, struct wcsprm *wcs, int n, const double world[], double pix[], int stat[])
+{
+    double u[GRID_BLOCK], v[GRID_BLOCK], x[GRID_BLOCK], y[GRID_BLOCK];
+    double phi[GRID_BLOCK], theta[GRID_BLOCK], img[2*GRID_BLOCK], w[2*GRID_BLOCK], p[2*GRID_BLOCK];
+    int st[GRID_BLOCK];
+    const struct grid_fit *f = &g->s2p;
+    int k, i, m, nb, nout = 0;
+
+    for (k=0; k<n; k+=GRID_BLOCK) {
+        nb = n-k < GRID_BLOCK ? n-k : GRID_BLOCK;
+
+        /* the ones inside gathered at the front */
+        for (i=0, m=0; i<nb; i++) {
+            stat[k+i] = -1;
+            if (to_plane(g, world[2*(k+i)], world[2*(k+i)+1], &u[m], &v[m]) ||
+                fabs(u[m] - f->u0) > f->uh || fabs(v[m] - f->v0) > f->vh) {
+                nout++;
+                continue;
+            }
+            stat[k+i] = 0;
+            m++;
+        }
+
+        if (!f->deg) {
+            for (i=0, m=0; i<nb; i++)
+                if (!stat[k+i]) {
+                    w[2*m] = world[2*(k+i)];
+                    w[2*m+1] = world[2*(k+i)+1];
+                    m++;
+                }
+            if (m)
+                (void)wcss2p(wcs, m, 2, w, phi, theta, img, p, st);
+            for (i=0, m=0; i<nb; i++)
+                if (!stat[k+i]) {
+                    pix[2*(k+i)] = p[2*m];
+                    pix[2*(k+i)+1] = p[2*m+1];
+                    stat[k+i] = st[m++];
+                }
+            continue;
+        }
+
+        evaluate(f, m, u, v, x, y);
+        for (i=0, m=0; i<nb; i++)
+            if (!stat[k+i]) {
+                pix[2*(k+i)] = x[m];
+                pix[2*(k+i)+1] = y[m];
+                m++;
+            }
+    }
+
+    return nout;
+}
+
+/* World coordinates of n pixels, as wcsgrid_s2p the other way: those
+ * outside the box get stat -1. */
+int
+wcsgrid_p2s(WCS_GRID *g, struct wcsprm *wcs, int n, const double pix[], double world[], int stat[])
+{
+    double u[GRID_BLOCK], v[GRID_BLOCK], xi[GRID_BLOCK], eta[GRID_BLOCK];
+    double phi[GRID_BLOCK], theta[GRID_BLOCK], img[2*GRID_BLOCK], w[2*GRID_BLOCK], p[2*GRID_BLOCK];
+    int st[GRID_BLOCK];
+    const struct grid_fit *f = &g->p2s;
+    int k, i, m, nb, nout = 0;
+
+    for (k=0; k<n; k+=GRID_BLOCK) {
+        nb = n-k < GRID_BLOCK ? n-k : GRID_BLOCK;
+
+        for (i=0, m=0; i<nb; i++) {
+            u[m] = pix[2*(k+i)];
+            v[m] = pix[2*(k+i)+1];
+            stat[k+i] = -1;
+            if (fabs(u[m] - f->u0) > f->uh || fabs(v[m] - f->v0) > f->vh) {
+                nout++;
+                continue;
+            }
+            stat[k+i] = 0;
+            m++;
+        }
+
+        if (!f->deg) {
+            for (i=0, m=0; i<nb; i++)
+                if (!stat[k+i]) {
+                    p[2*m] = u[m];
+                    p[2*m+1] = v[m];
+                    m++;
+                }
+            if (m)
+                (void)wcsp2s(wcs, m, 2, p, img, phi, theta, w, st);
+            for (i=0, m=0; i<nb; i++)
+                if (!stat[k+i]) {
+                    world[2*(k+i)] = w[2*m];
+                    world[2*(k+i)+1] = w[2*m+1];
+                    stat[k+i] = st[m++];
+                }
+            continue;
+        }
+
+        evaluate(f, m, u, v, xi, eta);
+        for (i=0, m=0; i<nb; i++)
+            if (!stat[k+i]) {
+                from_plane(g, xi[m], eta[m], &world[2*(k+i)], &world[2*(k+i)+1]);
+                m++;
+            }
+    }
+
+    return nout;
+}
+
+/* The largest error found by the checks, in pixels, for the sky to pixel
+ * fit (dir 0) or the other; negative when it is left to WCSLIB. */
+double
+wcsgrid_error(WCS_GRID *g, int dir)
+{
+    const struct grid_fit *f = dir ? &g->p2s : &g->s2p;
+
+    if (!f->deg)
+        return -1.0;
+    return dir ? f->err / g->scale : f->err;
+}
+
+void
+wcsgrid_free(WCS_GRID *g)
+{
+    free(g);
+}